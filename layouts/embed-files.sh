@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# embed-files.sh SRCDIR FILE...
+#
+# Writes C source for the table of built in files that
+# src/config-embedded.c looks in, sorted by name. Each file is taken from
+# the build directory if it is there, SRCDIR otherwise.
+
+srcdir=$1
+shift
+
+echo "/* Generated by embed-files.sh from the layouts, do not edit */"
+echo
+echo "#include \"matchbox-keyboard-core.h\""
+
+files=`for f in "$@"; do echo $f; done | LC_ALL=C sort -u`
+
+n=0
+for f in $files; do
+    path=$f
+    test -f $path || path=$srcdir/$f
+
+    echo
+    echo "static const unsigned char file_$n[] = {"
+    od -An -v -tx1 $path | sed -e 's/ *\([0-9a-f][0-9a-f]\)/0x\1,/g' -e 's/^/  /'
+    echo "};"
+
+    n=`expr $n + 1`
+done
+
+echo
+echo "const MBKeyboardEmbeddedFile mb_kbd_embedded_files[] = {"
+
+n=0
+for f in $files; do
+    echo "  { \"`basename $f`\", file_$n, sizeof(file_$n) },"
+    n=`expr $n + 1`
+done
+
+echo "  { NULL, NULL, 0 }"
+echo "};"
@@ -0,0 +1,790 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Copyright (c) 2012 Vernier Software & Technology
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * Compiled configs. matchbox-keyboard-compile writes the parsed model of a
+ * keyboard config, includes and all, into a flat image next to the xml:
+ * a header, tables of fixed size records that point into each other by
+ * index, and a string table the records point into by offset. Keysyms are
+ * already resolved, images are referred to by path. On load the image is
+ * mmap'ed and the model built straight from the records, no parsing; the
+ * xml is only read if there is no compiled copy, or it is out of date with
+ * the files it was made from.
+ */
+
+#include "matchbox-keyboard-core.h"
+
+#include <sys/mman.h>
+
+#define MB_KBD_COMPILED_MAGIC   0x4c4b424d /* "MBKL" */
+#define MB_KBD_COMPILED_VERSION 1
+
+/* string offset for a NULL string; offset 0 is always "" */
+#define MB_KBD_COMPILED_NONE    0xffffffff
+
+#define MB_KBD_COMPILED_KEY_OBEY_CAPS (1<<0)
+#define MB_KBD_COMPILED_KEY_FILL      (1<<1)
+#define MB_KBD_COMPILED_KEY_BLANK     (1<<2)
+#define MB_KBD_COMPILED_KEY_EXTENDED  (1<<3)
+
+/* every table starts 8 byte aligned, the records keep it that way */
+typedef struct MBKeyboardCompiledHeader
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned int size;
+  unsigned int n_sources, sources;
+  unsigned int n_layouts, layouts;
+  unsigned int n_rows,    rows;
+  unsigned int n_keys,    keys;
+  unsigned int n_states,  states;
+  unsigned int strings_size, strings;
+  unsigned int pad;
+}
+MBKeyboardCompiledHeader;
+
+/* the first source is the config file itself, the rest its includes */
+typedef struct MBKeyboardCompiledSource
+{
+  unsigned int name;
+  unsigned int path;
+  int          autolocale;
+  unsigned int pad;
+  long long    mtime;
+  long long    size;
+}
+MBKeyboardCompiledSource;
+
+/* pages follow the layout they belong to */
+typedef struct MBKeyboardCompiledLayout
+{
+  unsigned int id;
+  int          page_rows;
+  int          is_page;
+  unsigned int first_row, n_rows;
+  unsigned int pad;
+}
+MBKeyboardCompiledLayout;
+
+typedef struct MBKeyboardCompiledRow
+{
+  unsigned int first_key, n_keys;
+}
+MBKeyboardCompiledRow;
+
+typedef struct MBKeyboardCompiledKey
+{
+  unsigned int flags;
+  int          req_uwidth;
+  unsigned int first_state, n_states;
+}
+MBKeyboardCompiledKey;
+
+/*
+ * action is a string offset for glyph actions, the keysym or the modifier
+ * type otherwise; layout is the target of layout modifiers.
+ */
+typedef struct MBKeyboardCompiledState
+{
+  int          state;
+  int          face_type;
+  unsigned int face;
+  int          action_type;
+  unsigned int action;
+  unsigned int layout;
+}
+MBKeyboardCompiledState;
+
+typedef struct MBKeyboardCompiled
+{
+  const char                      *base;
+  const MBKeyboardCompiledHeader  *header;
+  const MBKeyboardCompiledSource  *sources;
+  const MBKeyboardCompiledLayout  *layouts;
+  const MBKeyboardCompiledRow     *rows;
+  const MBKeyboardCompiledKey     *keys;
+  const MBKeyboardCompiledState   *states;
+  const char                      *strings;
+}
+MBKeyboardCompiled;
+
+/* <config>.xml is compiled into <config>.mbk */
+char*
+mb_kbd_config_compiled_path(const char *config_path)
+{
+  char *path;
+  int   n = strlen(config_path);
+
+  if (n > 4 && streq(config_path + n - 4, ".xml"))
+    n -= 4;
+
+  path = malloc(n + sizeof(".mbk"));
+  memcpy(path, config_path, n);
+  strcpy(path + n, ".mbk");
+
+  return path;
+}
+
+static const char*
+compiled_str (MBKeyboardCompiled *c, unsigned int offset)
+{
+  if (offset == MB_KBD_COMPILED_NONE)
+    return NULL;
+
+  return c->strings + offset;
+}
+
+static boolean
+compiled_str_valid (MBKeyboardCompiled *c, unsigned int offset)
+{
+  return (offset == MB_KBD_COMPILED_NONE
+	  || offset < c->header->strings_size);
+}
+
+static boolean
+compiled_table_valid (const MBKeyboardCompiledHeader *h,
+		      unsigned int n, unsigned int offset, int rec_size)
+{
+  return (offset % 8 == 0
+	  && offset >= sizeof(MBKeyboardCompiledHeader)
+	  && offset <= h->size
+	  && n <= (h->size - offset) / rec_size);
+}
+
+/* checks every index and offset once, so the build needs no checks */
+static boolean
+compiled_valid (MBKeyboardCompiled *c, unsigned int size)
+{
+  const MBKeyboardCompiledHeader *h = c->header;
+  unsigned int                    i;
+
+  if (size < sizeof(MBKeyboardCompiledHeader)
+      || h->magic   != MB_KBD_COMPILED_MAGIC
+      || h->version != MB_KBD_COMPILED_VERSION
+      || h->size    != size)
+    return False;
+
+  if (!compiled_table_valid(h, h->n_sources, h->sources,
+			    sizeof(MBKeyboardCompiledSource))
+      || !compiled_table_valid(h, h->n_layouts, h->layouts,
+			       sizeof(MBKeyboardCompiledLayout))
+      || !compiled_table_valid(h, h->n_rows, h->rows,
+			       sizeof(MBKeyboardCompiledRow))
+      || !compiled_table_valid(h, h->n_keys, h->keys,
+			       sizeof(MBKeyboardCompiledKey))
+      || !compiled_table_valid(h, h->n_states, h->states,
+			       sizeof(MBKeyboardCompiledState))
+      || !compiled_table_valid(h, h->strings_size, h->strings, 1))
+    return False;
+
+  c->sources = (const void *)(c->base + h->sources);
+  c->layouts = (const void *)(c->base + h->layouts);
+  c->rows    = (const void *)(c->base + h->rows);
+  c->keys    = (const void *)(c->base + h->keys);
+  c->states  = (const void *)(c->base + h->states);
+  c->strings = c->base + h->strings;
+
+  /* so any offset in it is a terminated string */
+  if (h->strings_size == 0 || c->strings[h->strings_size - 1] != '\0')
+    return False;
+
+  if (h->n_sources == 0 || h->n_layouts == 0 || c->layouts[0].is_page)
+    return False;
+
+  for (i = 0; i < h->n_sources; i++)
+    if (!compiled_str_valid(c, c->sources[i].name)
+	|| c->sources[i].path == MB_KBD_COMPILED_NONE
+	|| !compiled_str_valid(c, c->sources[i].path))
+      return False;
+
+  for (i = 0; i < h->n_layouts; i++)
+    if (c->layouts[i].id == MB_KBD_COMPILED_NONE
+	|| !compiled_str_valid(c, c->layouts[i].id)
+	|| c->layouts[i].first_row > h->n_rows
+	|| c->layouts[i].n_rows > h->n_rows - c->layouts[i].first_row)
+      return False;
+
+  for (i = 0; i < h->n_rows; i++)
+    if (c->rows[i].first_key > h->n_keys
+	|| c->rows[i].n_keys > h->n_keys - c->rows[i].first_key)
+      return False;
+
+  for (i = 0; i < h->n_keys; i++)
+    if (c->keys[i].first_state > h->n_states
+	|| c->keys[i].n_states > h->n_states - c->keys[i].first_state)
+      return False;
+
+  for (i = 0; i < h->n_states; i++)
+    {
+      const MBKeyboardCompiledState *s = &c->states[i];
+
+      if (s->state < 0 || s->state >= N_MBKeyboardKeyStateTypes
+	  || !compiled_str_valid(c, s->layout))
+	return False;
+
+      if ((s->face_type == MBKeyboardKeyFaceGlyph
+	   || s->face_type == MBKeyboardKeyFaceImage)
+	  && (s->face == MB_KBD_COMPILED_NONE || !compiled_str_valid(c, s->face)))
+	return False;
+
+      if (s->action_type == MBKeyboardKeyActionGlyph
+	  && (s->action == MB_KBD_COMPILED_NONE
+	      || !compiled_str_valid(c, s->action)))
+	return False;
+    }
+
+  return True;
+}
+
+static boolean
+compiled_source_current (const MBKeyboardCompiledSource *source,
+			 const char                     *path)
+{
+  struct stat st;
+
+  return (stat(path, &st) == 0
+	  && source->mtime == (long long)st.st_mtime
+	  && source->size  == (long long)st.st_size);
+}
+
+/*
+ * The files the config was made from must all still be the ones the
+ * lookup finds now, unchanged.
+ */
+static boolean
+compiled_sources_current (MBKeyboardCompiled *c,
+			  const char         *config_path,
+			  char               *lang)
+{
+  char         path[1024];
+  unsigned int i;
+
+  if (!streq(compiled_str(c, c->sources[0].path), config_path)
+      || !compiled_source_current(&c->sources[0], config_path))
+    return False;
+
+  for (i = 1; i < c->header->n_sources; i++)
+    {
+      const MBKeyboardCompiledSource *source = &c->sources[i];
+
+      if (source->name == MB_KBD_COMPILED_NONE
+	  || !mb_kbd_config_find_file(compiled_str(c, source->name), NULL,
+				      lang, lang ? 0 : source->autolocale,
+				      path, sizeof(path))
+	  || !streq(compiled_str(c, source->path), path)
+	  || !compiled_source_current(source, path))
+	return False;
+    }
+
+  return True;
+}
+
+static MBKeyboardKey*
+compiled_build_key (MBKeyboard                  *kbd,
+		    MBKeyboardCompiled          *c,
+		    const MBKeyboardCompiledKey *k)
+{
+  MBKeyboardKey *key = mb_kbd_key_new(kbd);
+  unsigned int   i;
+
+  if (k->flags & MB_KBD_COMPILED_KEY_OBEY_CAPS)
+    mb_kbd_key_set_obey_caps(key, True);
+
+  if (k->flags & MB_KBD_COMPILED_KEY_EXTENDED)
+    mb_kbd_key_set_extended(key, True);
+
+  if (k->flags & MB_KBD_COMPILED_KEY_FILL)
+    mb_kbd_key_set_fill(key, True);
+
+  if (k->flags & MB_KBD_COMPILED_KEY_BLANK)
+    mb_kbd_key_set_blank(key, True);
+
+  if (k->req_uwidth > 0)
+    mb_kbd_key_set_req_uwidth(key, k->req_uwidth);
+
+  for (i = 0; i < k->n_states; i++)
+    {
+      const MBKeyboardCompiledState *s = &c->states[k->first_state + i];
+      MBKeyboardImage               *img;
+
+      switch (s->face_type)
+	{
+	case MBKeyboardKeyFaceGlyph:
+	  mb_kbd_key_set_glyph_face(key, s->state, compiled_str(c, s->face));
+	  break;
+	case MBKeyboardKeyFaceImage:
+	  /* same as the parser, no image support means no face */
+	  if (kbd->frontend && kbd->frontend->image_new)
+	    {
+	      if (!(img = kbd->frontend->image_new(kbd,
+						   compiled_str(c, s->face))))
+		{
+		  fprintf(stderr, "matchbox-keyboard: Failed to load '%s'\n",
+			  compiled_str(c, s->face));
+		  mb_kbd_key_destroy(key);
+		  return NULL;
+		}
+	      mb_kbd_key_set_image_face(key, s->state, img);
+	    }
+	  break;
+	default:
+	  break;
+	}
+
+      switch (s->action_type)
+	{
+	case MBKeyboardKeyActionGlyph:
+	  mb_kbd_key_set_char_action(key, s->state, compiled_str(c, s->action));
+	  break;
+	case MBKeyboardKeyActionXKeySym:
+	  mb_kbd_key_set_keysym_action(key, s->state, (KeySym)s->action);
+	  break;
+	case MBKeyboardKeyActionModifier:
+	  if (s->action == MBKeyboardKeyModLayout)
+	    mb_kbd_key_set_layout_action(key, s->state,
+					 compiled_str(c, s->layout));
+	  else
+	    mb_kbd_key_set_modifer_action(key, s->state, s->action);
+	  break;
+	default:
+	  break;
+	}
+    }
+
+  return key;
+}
+
+static boolean
+compiled_build_rows (MBKeyboard                     *kbd,
+		     MBKeyboardCompiled             *c,
+		     const MBKeyboardCompiledLayout *l,
+		     MBKeyboardLayout               *layout)
+{
+  unsigned int r, k;
+
+  for (r = 0; r < l->n_rows; r++)
+    {
+      const MBKeyboardCompiledRow *cr  = &c->rows[l->first_row + r];
+      MBKeyboardRow               *row = mb_kbd_row_new(kbd);
+
+      /* owned by the layout from here, even if a key fails */
+      mb_kbd_layout_append_row(layout, row);
+
+      for (k = 0; k < cr->n_keys; k++)
+	{
+	  MBKeyboardKey *key;
+
+	  if (!(key = compiled_build_key(kbd, c, &c->keys[cr->first_key + k])))
+	    return False;
+
+	  mb_kbd_row_append_key(row, key);
+	}
+    }
+
+  return True;
+}
+
+/*
+ * Sets up kbd from the compiled copy of the config at config_path, if
+ * there is one and it is up to date. Nothing is added to kbd otherwise.
+ */
+boolean
+mb_kbd_config_load_compiled (MBKeyboard *kbd,
+			     const char *config_path,
+			     char       *lang)
+{
+  MBKeyboardCompiled  c;
+  MBKeyboardLayout   *layout = NULL;
+  List               *layouts = NULL;
+  struct stat         st;
+  char               *path;
+  void               *map = MAP_FAILED;
+  int                 fd;
+  unsigned int        i;
+  boolean             retval = False;
+
+  if (getenv("MB_KBD_NO_COMPILED"))
+    return False;
+
+  /* built in, nothing to map */
+  if (mb_kbd_embedded_file(config_path, NULL))
+    return False;
+
+  path = mb_kbd_config_compiled_path(config_path);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    goto out;
+
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < (1 << 30))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED)
+    goto out;
+
+  memset(&c, 0, sizeof(c));
+  c.base   = map;
+  c.header = map;
+
+  if (!compiled_valid(&c, st.st_size))
+    {
+      fprintf(stderr, "matchbox-keyboard: ignoring broken %s\n", path);
+      goto out;
+    }
+
+  if (!compiled_sources_current(&c, config_path, lang))
+    {
+      DBG("%s is out of date", path);
+      goto out;
+    }
+
+  for (i = 0; i < c.header->n_layouts; i++)
+    {
+      const MBKeyboardCompiledLayout *l = &c.layouts[i];
+
+      if (l->is_page)
+	layout = mb_kbd_layout_append_page(layout);
+      else
+	{
+	  layout  = mb_kbd_layout_new(kbd, compiled_str(&c, l->id));
+	  layouts = util_list_append(layouts, layout);
+
+	  if (l->page_rows > 0)
+	    mb_kbd_layout_set_page_rows(layout, l->page_rows);
+	}
+
+      if (!compiled_build_rows(kbd, &c, l, layout))
+	goto out;
+    }
+
+  while (layouts)
+    {
+      mb_kbd_add_layout(kbd, layouts->data);
+      layouts = util_list_remove(layouts, layouts->data);
+    }
+
+  /* the includes, as parsing would have left them, for --watch */
+  for (i = 1; i < c.header->n_sources; i++)
+    {
+      MBKeyboardConfigInclude *inc;
+
+      inc = util_malloc0(sizeof(MBKeyboardConfigInclude));
+      inc->name       = strdup(compiled_str(&c, c.sources[i].name));
+      inc->path       = strdup(compiled_str(&c, c.sources[i].path));
+      inc->autolocale = c.sources[i].autolocale;
+
+      kbd->config_includes = util_list_append(kbd->config_includes, inc);
+    }
+
+  DBG("loaded compiled config %s", path);
+  retval = True;
+
+ out:
+  while (layouts)
+    {
+      layout  = layouts->data;
+      layouts = util_list_remove(layouts, layout);
+      mb_kbd_layout_destroy(layout);
+    }
+
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+
+  free(path);
+
+  return retval;
+}
+
+/* Writing */
+
+typedef struct MBKeyboardCompiledTable
+{
+  char *data;
+  int   len, alloc;
+}
+MBKeyboardCompiledTable;
+
+/* appends a zeroed record and returns it */
+static void*
+compiled_table_add (MBKeyboardCompiledTable *t, int size)
+{
+  void *rec;
+
+  if (t->len + size > t->alloc)
+    {
+      t->alloc = (t->len + size) * 2;
+      t->data  = realloc(t->data, t->alloc);
+    }
+
+  rec = t->data + t->len;
+  memset(rec, 0, size);
+  t->len += size;
+
+  return rec;
+}
+
+static unsigned int
+compiled_add_str (MBKeyboardCompiledTable *strings, const char *str)
+{
+  unsigned int offset = strings->len;
+
+  if (str == NULL)
+    return MB_KBD_COMPILED_NONE;
+
+  if (*str == '\0')
+    return 0;
+
+  memcpy(compiled_table_add(strings, strlen(str) + 1), str, strlen(str) + 1);
+
+  return offset;
+}
+
+static boolean
+compiled_add_source (MBKeyboardCompiledTable *sources,
+		     MBKeyboardCompiledTable *strings,
+		     const char              *name,
+		     const char              *path,
+		     boolean                  autolocale)
+{
+  MBKeyboardCompiledSource *s;
+  struct stat               st;
+
+  if (stat(path, &st))
+    return False;
+
+  s = compiled_table_add(sources, sizeof(MBKeyboardCompiledSource));
+
+  s->name       = compiled_add_str(strings, name);
+  s->path       = compiled_add_str(strings, path);
+  s->autolocale = autolocale;
+  s->mtime      = st.st_mtime;
+  s->size       = st.st_size;
+
+  return True;
+}
+
+static void
+compiled_add_layout (MBKeyboardCompiledTable  *tables,
+		     MBKeyboardLayout         *layout,
+		     boolean                   is_page,
+		     const char*             (*image_path) (MBKeyboardImage *img))
+{
+  MBKeyboardCompiledTable  *layouts = &tables[1], *rows = &tables[2];
+  MBKeyboardCompiledTable  *keys = &tables[3], *states = &tables[4];
+  MBKeyboardCompiledTable  *strings = &tables[5];
+  MBKeyboardCompiledLayout *cl;
+  List                     *r, *k;
+  int                       s;
+
+  cl = compiled_table_add(layouts, sizeof(MBKeyboardCompiledLayout));
+
+  cl->id        = compiled_add_str(strings, mb_kbd_layout_id(layout));
+  cl->page_rows = is_page ? 0 : mb_kbd_layout_page_rows(layout);
+  cl->is_page   = is_page;
+  cl->first_row = rows->len / sizeof(MBKeyboardCompiledRow);
+
+  for (r = mb_kbd_layout_rows(layout); r != NULL; r = util_list_next(r))
+    {
+      MBKeyboardCompiledRow *cr;
+
+      cr = compiled_table_add(rows, sizeof(MBKeyboardCompiledRow));
+      cr->first_key = keys->len / sizeof(MBKeyboardCompiledKey);
+      cl->n_rows++;
+
+      mb_kbd_row_for_each_key(r->data, k)
+	{
+	  MBKeyboardKey         *key = k->data;
+	  MBKeyboardCompiledKey *ck;
+
+	  ck = compiled_table_add(keys, sizeof(MBKeyboardCompiledKey));
+	  cr->n_keys++;
+
+	  if (mb_kbd_key_get_obey_caps(key))
+	    ck->flags |= MB_KBD_COMPILED_KEY_OBEY_CAPS;
+	  if (mb_kbd_key_get_fill(key))
+	    ck->flags |= MB_KBD_COMPILED_KEY_FILL;
+	  if (mb_kbd_key_is_blank(key))
+	    ck->flags |= MB_KBD_COMPILED_KEY_BLANK;
+	  if (mb_kbd_key_get_extended(key))
+	    ck->flags |= MB_KBD_COMPILED_KEY_EXTENDED;
+
+	  ck->req_uwidth  = mb_kbd_key_get_req_uwidth(key);
+	  ck->first_state = states->len / sizeof(MBKeyboardCompiledState);
+
+	  mb_kdb_key_foreach_state(key, s)
+	    {
+	      MBKeyboardCompiledState *cs;
+	      MBKeyboardImage         *img;
+
+	      cs = compiled_table_add(states, sizeof(MBKeyboardCompiledState));
+	      ck->n_states++;
+
+	      cs->state       = s;
+	      cs->face_type   = mb_kbd_key_get_face_type(key, s);
+	      cs->face        = MB_KBD_COMPILED_NONE;
+	      cs->action_type = mb_kbd_key_get_action_type(key, s);
+	      cs->layout      = MB_KBD_COMPILED_NONE;
+
+	      if (cs->face_type == MBKeyboardKeyFaceGlyph)
+		cs->face = compiled_add_str(strings,
+					    mb_kbd_key_get_glyph_face(key, s));
+	      else if (cs->face_type == MBKeyboardKeyFaceImage)
+		{
+		  img = mb_kbd_key_get_image_face(key, s);
+		  cs->face = compiled_add_str(strings, image_path(img));
+		}
+
+	      switch (cs->action_type)
+		{
+		case MBKeyboardKeyActionGlyph:
+		  cs->action
+		    = compiled_add_str(strings,
+				       mb_kbd_key_get_char_action(key, s));
+		  break;
+		case MBKeyboardKeyActionXKeySym:
+		  cs->action = mb_kbd_key_get_keysym_action(key, s);
+		  break;
+		case MBKeyboardKeyActionModifier:
+		  cs->action = mb_kbd_key_get_modifer_action(key, s);
+		  cs->layout
+		    = compiled_add_str(strings,
+				       mb_kbd_key_get_layout_action(key, s));
+		  break;
+		default:
+		  break;
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * Writes out kbd, as loaded by mb_kbd_config_load(). image_path gives the
+ * file each image face was loaded from.
+ */
+boolean
+mb_kbd_config_save_compiled (MBKeyboard  *kbd,
+			     const char  *path,
+			     const char* (*image_path) (MBKeyboardImage *img))
+{
+  MBKeyboardCompiledHeader header;
+  MBKeyboardCompiledTable  tables[6]; /* sources, layouts .. strings */
+  unsigned int            *counts[6], *offsets[6];
+  int                      sizes[6];
+  List                    *l, *p;
+  FILE                    *fp;
+  char                    *tmp;
+  int                      i, n;
+  unsigned int             offset;
+  boolean                  retval = False;
+
+  if (!kbd->config_file || !kbd->layouts)
+    return False;
+
+  memset(tables, 0, sizeof(tables));
+  memset(&header, 0, sizeof(header));
+
+  /* offset 0 is the empty string */
+  compiled_table_add(&tables[5], 1);
+
+  if (!compiled_add_source(&tables[0], &tables[5],
+			   NULL, kbd->config_file, False))
+    goto out;
+
+  for (l = kbd->config_includes; l != NULL; l = util_list_next(l))
+    {
+      MBKeyboardConfigInclude *inc = l->data;
+
+      if (!compiled_add_source(&tables[0], &tables[5],
+			       inc->name, inc->path, inc->autolocale))
+	goto out;
+    }
+
+  for (l = kbd->layouts; l != NULL; l = util_list_next(l))
+    {
+      compiled_add_layout(tables, l->data, False, image_path);
+
+      for (p = mb_kbd_layout_pages(l->data); p != NULL; p = util_list_next(p))
+	compiled_add_layout(tables, p->data, True, image_path);
+    }
+
+  header.magic   = MB_KBD_COMPILED_MAGIC;
+  header.version = MB_KBD_COMPILED_VERSION;
+
+  counts[0] = &header.n_sources;    offsets[0] = &header.sources;
+  counts[1] = &header.n_layouts;    offsets[1] = &header.layouts;
+  counts[2] = &header.n_rows;       offsets[2] = &header.rows;
+  counts[3] = &header.n_keys;       offsets[3] = &header.keys;
+  counts[4] = &header.n_states;     offsets[4] = &header.states;
+  counts[5] = &header.strings_size; offsets[5] = &header.strings;
+
+  sizes[0] = sizeof(MBKeyboardCompiledSource);
+  sizes[1] = sizeof(MBKeyboardCompiledLayout);
+  sizes[2] = sizeof(MBKeyboardCompiledRow);
+  sizes[3] = sizeof(MBKeyboardCompiledKey);
+  sizes[4] = sizeof(MBKeyboardCompiledState);
+  sizes[5] = 1;
+
+  offset = sizeof(header);
+
+  for (i = 0; i < 6; i++)
+    {
+      *counts[i]  = tables[i].len / sizes[i];
+      *offsets[i] = offset;
+      offset += (tables[i].len + 7) & ~7;
+    }
+
+  header.size = offset;
+
+  /* written aside and renamed, so a running keyboard never sees half */
+  n   = strlen(path) + sizeof(".tmp");
+  tmp = alloca(n);
+  snprintf(tmp, n, "%s.tmp", path);
+
+  if ((fp = fopen(tmp, "wb")) == NULL)
+    goto out;
+
+  retval = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+  for (i = 0; i < 6 && retval; i++)
+    {
+      static const char zeros[8];
+      int               len = tables[i].len;
+
+      if (len && fwrite(tables[i].data, len, 1, fp) != 1)
+	retval = False;
+
+      if (((len + 7) & ~7) != len
+	  && fwrite(zeros, ((len + 7) & ~7) - len, 1, fp) != 1)
+	retval = False;
+    }
+
+  if (fclose(fp) != 0)
+    retval = False;
+
+  if (retval && rename(tmp, path) != 0)
+    retval = False;
+
+  if (!retval)
+    unlink(tmp);
+
+ out:
+  for (i = 0; i < 6; i++)
+    free(tables[i].data);
+
+  return retval;
+}
@@ -0,0 +1,101 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Copyright (c) 2012 Vernier Software & Technology
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * Built in layouts. With --enable-embedded-layouts the installed layouts
+ * and their images are compiled into the binary too, see
+ * layouts/embed-files.sh, and stand in for the files in PKGDATADIR: the
+ * config search, the parser and the image loader find them here, by the
+ * path they would have been installed to, and never look at PKGDATADIR
+ * itself. ~/.matchbox and MB_KBD_CONFIG still override them.
+ */
+
+#include "matchbox-keyboard-core.h"
+
+#ifdef WANT_EMBEDDED_LAYOUTS
+/* sorted by name, ends with a NULL name */
+extern const MBKeyboardEmbeddedFile mb_kbd_embedded_files[];
+
+static const MBKeyboardEmbeddedFile *EmbeddedFiles = mb_kbd_embedded_files;
+#else
+static const MBKeyboardEmbeddedFile *EmbeddedFiles = NULL;
+#endif
+
+static int EmbeddedNFiles = -1;
+
+static int
+embedded_file_cmp (const void *key, const void *file)
+{
+  return strcmp(key, ((const MBKeyboardEmbeddedFile *)file)->name);
+}
+
+#ifdef WANT_FUZZING
+/*
+ * Puts files, sorted by name and ending with a NULL name, in place of the
+ * built in files, or puts those back for NULL. The fuzzing harness feeds
+ * the parser its input this way, see src/fuzz/fuzz-config.c; files has to
+ * stay around until it is replaced.
+ */
+void
+mb_kbd_embedded_set_files (const MBKeyboardEmbeddedFile *files)
+{
+#ifdef WANT_EMBEDDED_LAYOUTS
+  EmbeddedFiles  = files ? files : mb_kbd_embedded_files;
+#else
+  EmbeddedFiles  = files;
+#endif
+  EmbeddedNFiles = -1;
+}
+#endif
+
+/* whether any files stand in for those in PKGDATADIR */
+boolean
+mb_kbd_embedded_have_files (void)
+{
+  return (EmbeddedFiles != NULL);
+}
+
+/*
+ * The contents of the file at path if it is built in, NULL otherwise. The
+ * data is not NUL terminated.
+ */
+const unsigned char*
+mb_kbd_embedded_file (const char *path, int *size)
+{
+  const MBKeyboardEmbeddedFile *file;
+  int                           len = strlen(PKGDATADIR);
+
+  if (EmbeddedFiles == NULL)
+    return NULL;
+
+  if (strncmp(path, PKGDATADIR, len) || path[len] != '/')
+    return NULL;
+
+  if (EmbeddedNFiles < 0)
+    for (EmbeddedNFiles = 0; EmbeddedFiles[EmbeddedNFiles].name;
+	 EmbeddedNFiles++)
+      ;
+
+  file = bsearch(path + len + 1, EmbeddedFiles, EmbeddedNFiles,
+		 sizeof(MBKeyboardEmbeddedFile), embedded_file_cmp);
+  if (file == NULL)
+    return NULL;
+
+  if (size)
+    *size = file->size;
+
+  return file->data;
+}
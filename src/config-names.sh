@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# config-names.sh LIST
+#
+# Writes the perfect hash tables config-parser.c looks names up in, from
+# the TABLE NAME VALUE lines of LIST. For each table a seed is searched for
+# under which no two names land in the same slot; the hash is the one
+# config_name_slot() computes, kept to what awk can do exactly.
+
+LC_ALL=C awk '
+BEGIN {
+    for (i = 1; i < 128; i++)
+        ord[sprintf("%c", i)] = i
+}
+
+/^#/ || NF < 3 { next }
+
+{
+    t = $1
+    if (!(t in count)) {
+        order[n_tables++] = t
+        count[t] = 0
+    }
+    value = $0
+    sub(/^[^ \t]+[ \t]+[^ \t]+[ \t]+/, "", value)
+    names[t, count[t]] = $2
+    values[t, count[t]] = value
+    count[t]++
+}
+
+function slot(name, seed, size,    h, i, c) {
+    h = seed
+    for (i = 1; i <= length(name); i++) {
+        c = substr(name, i, 1)
+        if (!(c in ord)) {
+            print "config-names.sh: " name " is not ascii" > "/dev/stderr"
+            exit 1
+        }
+        h = (h * 33 + ord[c]) % 4294967296
+    }
+    return (h + int(h / 65536)) % size
+}
+
+END {
+    print "/* Generated by config-names.sh from config-names.list, do not edit */"
+
+    for (k = 0; k < n_tables; k++) {
+        t = order[k]
+        n = count[t]
+
+        # half full; slots hold an index + 1 in an unsigned char
+        size = 4
+        while (size < 2 * n)
+            size *= 2
+        if (n > 255) {
+            print "config-names.sh: too many " t " names" > "/dev/stderr"
+            exit 1
+        }
+
+        for (seed = 5381; ; seed++) {
+            split("", used)
+            for (i = 0; i < n; i++) {
+                s = slot(names[t, i], seed, size)
+                if (s in used)
+                    break
+                used[s] = i + 1
+            }
+            if (i == n)
+                break
+            if (seed > 5381 + 1000000) {
+                print "config-names.sh: no seed for " t > "/dev/stderr"
+                exit 1
+            }
+        }
+
+        print ""
+        print "static const ConfigName " t "Names[] ="
+        print "{"
+        for (i = 0; i < n; i++)
+            printf " { \"%s\", %s },\n", names[t, i], values[t, i]
+        print "};"
+        print ""
+        print "static const unsigned char " t "Slots[" size "] ="
+        print "{"
+        line = ""
+        for (s = 0; s < size; s++) {
+            line = line sprintf(" %i,", (s in used) ? used[s] : 0)
+            if (s % 16 == 15 || s == size - 1) {
+                print line
+                line = ""
+            }
+        }
+        print "};"
+        print ""
+        printf "static const ConfigNameTable %sTable =\n", t
+        printf "  { %sNames, %sSlots, %uu, %i };\n", t, t, seed, size - 1
+    }
+}' "$1"
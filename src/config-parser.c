@@ -18,7 +18,10 @@
  *
  */
 
-#include "matchbox-keyboard.h"
+#include "matchbox-keyboard-core.h"
+
+#include <errno.h>
+#include <dirent.h>
 
 /*
     <keyboard>
@@ -29,7 +32,9 @@
        <padding>
     </options>
 
-    <layout id="name">
+    <layout id="name"
+            page-rows="4"  // optional, split into pages of this many rows
+            >
       <row>
         <key id="optional-id" obey-caps='true|false'
 	     width="1000"   // 1/1000's of a unit key size
@@ -41,7 +46,8 @@
 	     display="image:"
 	     action="utf8char"     // optional, action defaults to this
 	     action="string"       // from lookup below
-	     action="modifier:Shift|Alt|ctrl|mod1|mod2|mod3|caps"
+	     action="modifier:Shift|Alt|ctrl|mod1|mod2|mod3|caps|layout"
+	     action="layout:id"    // switch to the layout with that id
 	     action="xkeysym:XK_BLAH"
 	  <shifted
 	     ...... >
@@ -59,63 +65,67 @@
     </keyboard>
 */
 
-struct _keysymlookup
-{
-  KeySym keysym;   char *name;
-}
-MBKeyboardKeysymLookup[] =
-{
- { XK_BackSpace,   "backspace" },
- { XK_Tab,	   "tab"       },
- { XK_Linefeed,    "linefeed"  },
- { XK_Clear,       "clear"     },
- { XK_Return,      "return"    },
- { XK_Pause,       "pause" },
- { XK_Scroll_Lock, "scrolllock" },
- { XK_Sys_Req,     "sysreq" },
- { XK_Escape,      "escape" },
- { XK_Delete,      "delete" },
- { XK_Home,        "home" },
- { XK_Left,        "left" },
- { XK_Up,          "up"   },
- { XK_Right,       "right" },
- { XK_Down,        "down"  },
- { XK_Prior,       "prior" },
- { XK_Page_Up,     "pageup" },
- { XK_Next,        "next"   },
- { XK_Page_Down,   "pagedown" },
- { XK_End,         "end" },
- { XK_Begin,	   "begin" },
- { XK_space,        "space" },
- { XK_F1,          "f1" },
- { XK_F2,          "f2" },
- { XK_F3,          "f3" },
- { XK_F4,          "f4" },
- { XK_F5,          "f5" },
- { XK_F6,          "f6" },
- { XK_F7,          "f7" },
- { XK_F8,          "f8" },
- { XK_F9,          "f9" },
- { XK_F10,         "f10" },
- { XK_F11,         "f11" },
- { XK_F12,         "f12" }
-};
-
-struct _modlookup
-{
-  char *name; MBKeyboardKeyModType type;
-}
-ModLookup[] =
-{
-  { "shift",   MBKeyboardKeyModShift },
-  { "alt",     MBKeyboardKeyModAlt },
-  { "ctrl",    MBKeyboardKeyModControl },
-  { "control", MBKeyboardKeyModControl },
-  { "mod1",    MBKeyboardKeyModMod1 },
-  { "mod2",    MBKeyboardKeyModMod2 },
-  { "mod3",    MBKeyboardKeyModMod3 },
-  { "caps",    MBKeyboardKeyModCaps }
-};
+/*
+ * The names the parser looks up, each in a table perfectly hashed at build
+ * time by config-names.sh, from config-names.list: under the table's seed
+ * no two names land in the same slot, so a lookup is one hash and one
+ * strcmp.
+ */
+typedef struct ConfigName
+{
+  const char *name;
+  int         value;
+}
+ConfigName;
+
+typedef struct ConfigNameTable
+{
+  const ConfigName    *names;
+  const unsigned char *slots; /* index into names + 1, 0 for an empty slot */
+  unsigned int         seed;
+  unsigned int         mask;
+}
+ConfigNameTable;
+
+typedef enum
+{
+  ConfigTagUnknown = 0,
+  ConfigTagLayout,
+  ConfigTagRow,
+  ConfigTagKey,
+  ConfigTagSpace,
+  ConfigTagInclude,
+  ConfigTagFragment,
+  ConfigTagKeyState  /* + MBKeyboardKeyStateType, for the key subtags */
+}
+ConfigTag;
+
+#include "config-names.h"
+
+/* must stay the hash config-names.sh computes */
+static unsigned int
+config_name_slot (const ConfigNameTable *table, const char *name)
+{
+  unsigned int h = table->seed;
+
+  while (*name)
+    h = h * 33 + (unsigned char)*name++;
+
+  return (h + (h >> 16)) & table->mask;
+}
+
+/* the value name maps to in table, 0 if it is not there */
+static int
+config_name_lookup (const ConfigNameTable *table, const char *name)
+{
+  int i;
+
+  if ((i = table->slots[config_name_slot(table, name)]) == 0
+      || !streq(table->names[i - 1].name, name))
+    return 0;
+
+  return table->names[i - 1].value;
+}
 
 typedef struct MBKeyboardConfigState
 {
@@ -123,77 +133,215 @@ typedef struct MBKeyboardConfigState
   MBKeyboardLayout *current_layout;
   MBKeyboardRow    *current_row;
   MBKeyboardKey    *current_key;
-  Bool              error;
+  boolean           error;
   char             *error_msg;
   int               error_lineno;
   char             *lang;
-  XML_Parser        parser;
+  XML_Parser        parser;   /* NULL while a fragment is replayed */
+  int               lineno;   /* of the element replayed */
+  int               include_depth;
 }
 MBKeyboardConfigState;
 
+/* deep enough for any real layout, and stops include cycles */
+#define CONFIG_MAX_INCLUDE_DEPTH 8
+
+/*
+ * Include fragments are parsed once per process, into the elements they
+ * start, and replayed from those for every config that includes them.
+ * Entries are checked against the file on each use.
+ */
+typedef struct ConfigElement
+{
+  char  *tag;
+  char **attr;
+  int    lineno;
+}
+ConfigElement;
+
+typedef struct ConfigFragment
+{
+  char          *path;
+  long long      mtime;
+  long long      size;
+  ConfigElement *elements;
+  int            n_elements;
+  int            alloc;
+  XML_Parser     parser;      /* while recording */
+  int            replaying;   /* load_include()s going through elements */
+  boolean        stale;       /* off the list, freed when the last is done */
+}
+ConfigFragment;
+
+static List *ConfigFragments = NULL;
+
 static int load_include (MBKeyboardConfigState *state,
-                         const char            *include,
+                         char                  *include,
                          int                    autolocale);
 
 void
 set_error(MBKeyboardConfigState *state, char *msg)
 {
   state->error = True;
-  state->error_lineno = XML_GetCurrentLineNumber(state->parser);
+  state->error_lineno = state->parser
+    ? XML_GetCurrentLineNumber(state->parser) : state->lineno;
   state->error_msg = msg;
 }
 
 KeySym
 config_str_to_keysym(const char* str)
 {
-  int i;
+  DBG("checking %s", str);
+
+  return config_name_lookup(&KeysymTable, str);
+}
 
+MBKeyboardKeyModType
+config_str_to_modtype(const char* str)
+{
   DBG("checking %s", str);
 
-  for (i=0; i<sizeof(MBKeyboardKeysymLookup)/sizeof(struct _keysymlookup); i++)
-    if (streq(str, MBKeyboardKeysymLookup[i].name))
-      return MBKeyboardKeysymLookup[i].keysym;
+  return config_name_lookup(&ModTable, str);
+}
+
+/*
+ * The names in each directory configs are looked for in, read once, so
+ * finding a config and its includes is a handful of lookups in memory
+ * rather than a stat() for every name that might be there.
+ */
+typedef struct ConfigDirIndex
+{
+  char  *dir;
+  char **names;   /* sorted */
+  int    n_names;
+}
+ConfigDirIndex;
 
-  DBG("didnt find it %s", str);
+static List *ConfigDirIndexes = NULL;
 
-  return 0;
+static int
+config_dir_index_cmp (const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
 }
 
-MBKeyboardKeyModType
-config_str_to_modtype(const char* str)
+static ConfigDirIndex*
+config_dir_index_get (const char *dir)
 {
-  int i;
+  ConfigDirIndex *index;
+  struct dirent  *entry;
+  DIR            *d;
+  List           *l;
+  int             alloc = 0;
+
+  for (l = ConfigDirIndexes; l != NULL; l = util_list_next(l))
+    if (streq(((ConfigDirIndex *)l->data)->dir, dir))
+      return l->data;
+
+  DBG("indexing %s", dir);
+
+  index      = util_malloc0(sizeof(ConfigDirIndex));
+  index->dir = strdup(dir);
+
+  /* a directory that is not there is remembered as empty */
+  if ((d = opendir(dir)) != NULL)
+    {
+      while ((entry = readdir(d)) != NULL)
+	{
+#ifdef _DIRENT_HAVE_D_TYPE
+	  if (entry->d_type == DT_DIR)
+	    continue;
+#endif
+	  if (entry->d_name[0] == '.')
+	    continue;
+
+	  if (index->n_names == alloc)
+	    {
+	      alloc = alloc ? alloc * 2 : 64;
+	      index->names = realloc(index->names, alloc * sizeof(char *));
+	    }
+
+	  index->names[index->n_names++] = strdup(entry->d_name);
+	}
+
+      closedir(d);
+
+      qsort(index->names, index->n_names, sizeof(char *),
+	    config_dir_index_cmp);
+    }
+
+  ConfigDirIndexes = util_list_append(ConfigDirIndexes, index);
 
-  for (i=0; i<sizeof(ModLookup)/sizeof(struct _modlookup); i++)
+  return index;
+}
+
+/* whether dir/name is there, going by the index of dir */
+static boolean
+config_file_exists (const char *dir, const char *name)
+{
+  ConfigDirIndex *index;
+  char            path[1024];
+
+  /* the built in files stand in for those installed */
+  if (streq(dir, PKGDATADIR) && mb_kbd_embedded_have_files())
     {
-      DBG("checking '%s' vs '%s'", str, ModLookup[i].name);
-      if (streq(str, ModLookup[i].name))
-	return ModLookup[i].type;
+      snprintf(path, sizeof(path), "%s/%s", dir, name);
+      return (mb_kbd_embedded_file(path, NULL) != NULL);
     }
 
-  return 0;
+  /* only the top of each directory is indexed */
+  if (strchr(name, '/'))
+    {
+      snprintf(path, sizeof(path), "%s/%s", dir, name);
+      return util_file_readable(path);
+    }
+
+  index = config_dir_index_get(dir);
+
+  /* a missing directory has no names at all */
+  return (index->n_names > 0
+	  && bsearch(&name, index->names, index->n_names, sizeof(char *),
+		     config_dir_index_cmp) != NULL);
 }
 
-static char*
-load_config_file (const char *basename,
-                  char       *variant_in,
-                  char       *lang,
-                  int         autolocale,
-                  char      **path_out)
+/* looks for basename[suffix1][suffix2].xml in dir */
+static boolean
+config_probe (const char *dir,
+	      const char *basename,
+	      const char *suffix1,
+	      const char *suffix2,
+	      char       *path,
+	      int         path_len)
+{
+  char name[256];
+
+  /* an over long LANG or variant is simply never found */
+  if (snprintf(name, sizeof(name), "%s%s%s.xml", basename,
+	       suffix1 ? suffix1 : "", suffix2 ? suffix2 : "") >= sizeof(name))
+    return False;
+
+  DBG("checking %s/%s\n", dir, name);
+
+  if (!config_file_exists(dir, name))
+    return False;
+
+  return (snprintf(path, path_len, "%s/%s", dir, name) < path_len);
+}
+
+static boolean
+config_search_file (const char *basename,
+		    char       *variant_in,
+		    char       *lang,
+		    int         autolocale,
+		    char       *path,
+		    int         path_len)
 {
-  struct stat    stat_info;
-  FILE*          fp;
-  char          *result;
   char          *country  = NULL;
   char          *variant  = NULL;
   int            n = 0, i = 0;
-  char           path[1024]; 	/* XXX MAXPATHLEN */
 
   if (!basename)
-    return NULL;
-
-  if (path_out)
-    *path_out = NULL;
+    return False;
 
   /* basename[-country][-variant].xml */
 
@@ -201,14 +349,11 @@ load_config_file (const char *basename,
 
   if (getenv("MB_KBD_CONFIG"))
     {
-      snprintf(path, 1024, "%s", getenv("MB_KBD_CONFIG"));
+      snprintf(path, path_len, "%s", getenv("MB_KBD_CONFIG"));
 
       DBG("checking %s\n", path);
 
-      if (util_file_readable(path))
-	goto load;
-
-      return NULL;
+      return util_file_readable(path);
     }
 
   if (lang || autolocale)
@@ -247,70 +392,165 @@ load_config_file (const char *basename,
 
   if (getenv("HOME"))
     {
-      snprintf(path, 1024, "%s/.matchbox/%s.xml", getenv("HOME"), basename);
+      char *dir;
 
-      DBG("checking %s\n", path);
+      n = strlen(getenv("HOME")) + sizeof("/.matchbox");
+      dir = alloca(n);
+      snprintf(dir, n, "%s/.matchbox", getenv("HOME"));
 
-      if (util_file_readable(path))
-	goto load;
+      if (config_probe(dir, basename, NULL, NULL, path, path_len))
+	return True;
     }
 
   /* Hmmm :/ */
 
-  snprintf(path, 1024, PKGDATADIR "/%s%s%s.xml",
-           basename,
-	   country == NULL ? "" : country,
-	   variant == NULL ? "" : variant);
+  return (config_probe(PKGDATADIR, basename, country, variant, path, path_len)
+	  || config_probe(PKGDATADIR, basename, variant, NULL, path, path_len)
+	  || config_probe(PKGDATADIR, basename, country, NULL, path, path_len)
+	  || config_probe(PKGDATADIR, basename, NULL, NULL, path, path_len));
+}
+
+typedef struct ConfigPathMemo
+{
+  char *key;
+  char *path;
+}
+ConfigPathMemo;
+
+static List *ConfigPathMemos = NULL;
+
+/*
+ * Finds the config file for basename[-country][-variant].xml, the way
+ * mb_kbd_config_load() would, and puts its path into path.
+ *
+ * Where each lookup led is remembered, like the directory indexes it goes
+ * by, until mb_kbd_config_forget(); files added or removed after start up
+ * are not noticed before then.
+ */
+boolean
+mb_kbd_config_find_file (const char *basename,
+			 char       *variant,
+			 char       *lang,
+			 int         autolocale,
+			 char       *path,
+			 int         path_len)
+{
+  ConfigPathMemo *memo;
+  List           *l;
+  char           *key;
+  int             n;
+
+  if (!basename)
+    return False;
 
-  DBG("checking %s\n", path);
+#define ENV(name) (getenv(name) ? getenv(name) : "")
 
-  if (util_file_readable(path))
-    goto load;
+  /* everything the search looks at */
+  n = snprintf(NULL, 0, "%s\n%s\n%s\n%i\n%s\n%s\n%s\n%s",
+	       basename, variant ? variant : "", lang ? lang : "", autolocale,
+	       ENV("MB_KBD_CONFIG"), ENV("HOME"),
+	       ENV("MB_KBD_LANG"), ENV("LANG"));
+  key = alloca(n + 1);
+  snprintf(key, n + 1, "%s\n%s\n%s\n%i\n%s\n%s\n%s\n%s",
+	   basename, variant ? variant : "", lang ? lang : "", autolocale,
+	   ENV("MB_KBD_CONFIG"), ENV("HOME"),
+	   ENV("MB_KBD_LANG"), ENV("LANG"));
 
-  snprintf(path, 1024, PKGDATADIR "/%s%s.xml",
-           basename, variant == NULL ? "" : variant);
+#undef ENV
 
-  DBG("checking %s\n", path);
+  for (l = ConfigPathMemos; l != NULL; l = util_list_next(l))
+    {
+      memo = l->data;
 
-  if (util_file_readable(path))
-    goto load;
+      if (streq(memo->key, key))
+	{
+	  snprintf(path, path_len, "%s", memo->path);
+	  return True;
+	}
+    }
 
-  snprintf(path, 1024, PKGDATADIR "/%s%s.xml",
-           basename, country == NULL ? "" : country);
+  if (!config_search_file(basename, variant, lang, autolocale, path, path_len))
+    return False;
 
-  DBG("checking %s\n", path);
+  memo       = util_malloc0(sizeof(ConfigPathMemo));
+  memo->key  = strdup(key);
+  memo->path = strdup(path);
 
-  if (util_file_readable(path))
-    goto load;
+  ConfigPathMemos = util_list_append(ConfigPathMemos, memo);
 
-  snprintf(path, 1024, PKGDATADIR "/%s.xml", basename);
+  return True;
+}
 
-  DBG("checking %s\n", path);
+#define CONFIG_READ_CHUNK 8192
 
-  if (!util_file_readable(path))
-    goto load;
+/*
+ * Feeds the file at path to p a chunk at a time, straight into expat's
+ * own buffer.
+ */
+static boolean
+config_parse_file (XML_Parser p, const char *path)
+{
+  const unsigned char *data;
+  boolean              done = False;
+  void                *buf;
+  int                  fd, n;
 
-  return NULL;
+  if ((data = mb_kbd_embedded_file(path, &n)) != NULL)
+    {
+      DBG("loading built in config %s\n", path);
 
- load:
-  if (stat(path, &stat_info) || !(fp = fopen(path, "rb")))
-    return NULL;
+      if (XML_Parse(p, (const char *)data, n, True) == XML_STATUS_ERROR)
+	{
+	  fprintf(stderr,
+		  "matchbox-keyboard:%s:%lu: XML Parse error:%s\n",
+		  path,
+		  XML_GetCurrentLineNumber(p),
+		  XML_ErrorString(XML_GetErrorCode(p)));
+	  return False;
+	}
+
+      return True;
+    }
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    {
+      fprintf(stderr, "matchbox-keyboard: Couldn't open %s\n", path);
+      return False;
+    }
 
   DBG("loading config %s\n", path);
 
-  if (path_out)
-    *path_out = strdup (path);
+  while (!done)
+    {
+      if ((buf = XML_GetBuffer(p, CONFIG_READ_CHUNK)) == NULL)
+	break;
+
+      if ((n = read(fd, buf, CONFIG_READ_CHUNK)) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
 
-  result = malloc(stat_info.st_size + 1);
+	  fprintf(stderr, "matchbox-keyboard: Couldn't read %s\n", path);
+	  break;
+	}
 
-  n = fread(result, 1, stat_info.st_size, fp);
+      done = (n == 0);
 
-  if (n >= 0)
-    result[n] = '\0';
+      if (XML_ParseBuffer(p, n, done) == XML_STATUS_ERROR)
+	{
+	  fprintf(stderr,
+		  "matchbox-keyboard:%s:%lu: XML Parse error:%s\n",
+		  path,
+		  XML_GetCurrentLineNumber(p),
+		  XML_ErrorString(XML_GetErrorCode(p)));
+	  done = False;
+	  break;
+	}
+    }
 
-  fclose(fp);
+  close(fd);
 
-  return result;
+  return done;
 }
 
 static const char *
@@ -331,42 +571,15 @@ attr_get_val (char *key, const char **attr)
 
 static void
 config_handle_key_subtag(MBKeyboardConfigState *state,
-			 const char            *tag,
+			 MBKeyboardKeyStateType keystate,
 			 const char           **attr)
 {
-  MBKeyboardKeyStateType keystate;
   const char            *val;
   KeySym                 found_keysym;
 
-  /* TODO: Fix below with a lookup table
-   */
-  if (streq(tag, "normal") || streq(tag, "default"))
-    {
-      keystate = MBKeyboardKeyStateNormal;
-    }
-  else if (streq(tag, "shifted"))
-    {
-      keystate = MBKeyboardKeyStateShifted;
-    }
-  else if (streq(tag, "caps"))
-    {
-      keystate = MBKeyboardKeyStateCaps;
-    }
-  else if (streq(tag, "mod1"))
-    {
-      keystate = MBKeyboardKeyStateMod1;
-    }
-  else if (streq(tag, "mod2"))
-    {
-      keystate = MBKeyboardKeyStateMod2;
-    }
-  else if (streq(tag, "mod3"))
+  if (state->current_key == NULL)
     {
-      keystate = MBKeyboardKeyStateMod3;
-    }
-  else
-    {
-      set_error(state, "Unknown key subtag");
+      set_error(state, "Key states must be inside a <key>");
       return;
     }
 
@@ -378,38 +591,50 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 
   if (!strncmp(val, "image:", 6))
     {
-      MBKeyboardImage *img;
+      const MBKeyboardFrontend *frontend = state->keyboard->frontend;
+      MBKeyboardImage          *img;
 
-
-      if (val[6] != '/')
+      /* a frontend that cannot draw images just gets no face */
+      if (frontend && frontend->image_new)
 	{
-	  /* Relative, rather than absolute path, try pkddatadir and home */
-	  char buf[512];
-	  snprintf(buf, 512, "%s/%s", PKGDATADIR, &val[6]);
-
-	  if (!util_file_readable(buf))
-	    snprintf(buf, 512, "%s/.matchbox/%s", getenv("HOME"), &val[6]);
-
-#ifdef WANT_CAIRO
-          img = cairo_image_surface_create_from_png (buf);
-#else
-	  img = mb_kbd_image_new (state->keyboard, buf);
-#endif
-	}
-      else
-#ifdef WANT_CAIRO
-        img = cairo_image_surface_create_from_png (&val[6]);
-#else
-	img = mb_kbd_image_new (state->keyboard, &val[6]);
-#endif
+	  if (val[6] != '/')
+	    {
+	      /* Relative, rather than absolute path, try pkddatadir and home */
+	      char path[1024];
+	      int  len;
+
+	      if (config_file_exists(PKGDATADIR, &val[6]))
+		len = snprintf(path, sizeof(path), "%s/%s",
+			       PKGDATADIR, &val[6]);
+	      else if (getenv("HOME"))
+		len = snprintf(path, sizeof(path), "%s/.matchbox/%s",
+			       getenv("HOME"), &val[6]);
+	      else
+		{
+		  set_error(state, "Image not found, HOME is not set");
+		  return;
+		}
+
+	      if (len >= sizeof(path))
+		{
+		  set_error(state, "Image path too long");
+		  return;
+		}
+
+	      img = frontend->image_new (state->keyboard, path);
+	    }
+	  else
+	    img = frontend->image_new (state->keyboard, &val[6]);
 
-      if (!img)
-	{
-	  fprintf(stderr, "matchbox-keyboard: Failed to load '%s'\n", &val[6]);
-	  state->error = True;
-	  return;
+	  if (!img)
+	    {
+	      fprintf(stderr, "matchbox-keyboard: Failed to load '%s'\n",
+		      &val[6]);
+	      set_error(state, "Failed to load image");
+	      return;
+	    }
+	  mb_kbd_key_set_image_face(state->current_key, keystate, img);
 	}
-      mb_kbd_key_set_image_face(state->current_key, keystate, img);
     }
   else
     {
@@ -421,7 +646,8 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
     {
       /*
 	     action="utf8char"     // optional, action defulats to this
-	     action="modifier:Shift|Alt|ctrl|mod1|mod2|mod3|caps"
+	     action="modifier:Shift|Alt|ctrl|mod1|mod2|mod3|caps|layout"
+	     action="layout:id"
 	     action="xkeysym:XK_BLAH"
 	     action="control:">    // return etc - not needed use lookup
       */
@@ -447,11 +673,22 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 	    }
 
 	}
+      else if (!strncmp(val, "layout:", 7))
+	{
+	  /* the layout may well come later in the file, so looked up on use */
+	  mb_kbd_key_set_layout_action(state->current_key, keystate, &val[7]);
+	}
       else if (!strncmp(val, "xkeysym:", 8))
 	{
 	  DBG("Checking %s\n", &val[8]);
 
-	  found_keysym = XStringToKeysym(&val[8]);
+	  found_keysym = NoSymbol;
+
+	  if (state->keyboard->frontend
+	      && state->keyboard->frontend->lookup_keysym)
+	    found_keysym
+	      = state->keyboard->frontend->lookup_keysym(state->keyboard,
+							 &val[8]);
 
 	  if (found_keysym)
 	    {
@@ -513,21 +750,123 @@ config_handle_layout_tag(MBKeyboardConfigState *state, const char **attr)
   state->current_layout = mb_kbd_layout_new(state->keyboard, val);
 
   mb_kbd_add_layout(state->keyboard, state->current_layout);
+
+  if ((val = attr_get_val("page-rows", attr)) != NULL)
+    {
+      if (atoi(val) > 0)
+	mb_kbd_layout_set_page_rows(state->current_layout, atoi(val));
+    }
 }
 
 static void
 config_handle_row_tag(MBKeyboardConfigState *state, const char **attr)
 {
+  int page_rows;
+
+  if (state->current_layout == NULL)
+    {
+      set_error(state, "Rows must be inside a <layout>");
+      return;
+    }
+
+  page_rows = mb_kbd_layout_page_rows(state->current_layout);
+
+  if (page_rows
+      && util_list_length(mb_kbd_layout_rows(state->current_layout))
+         >= page_rows)
+    state->current_layout = mb_kbd_layout_append_page(state->current_layout);
+
   state->current_row = mb_kbd_row_new(state->keyboard);
   mb_kbd_layout_append_row(state->current_layout, state->current_row);
 }
 
+/* layout_id NULL makes a key that moves on to the next layout */
+static void
+config_add_page_key(MBKeyboard    *kbd,
+		    MBKeyboardRow *row,
+		    const char    *display,
+		    const char    *layout_id)
+{
+  MBKeyboardKey *key = mb_kbd_key_new(kbd);
+
+  mb_kbd_key_set_glyph_face(key, MBKeyboardKeyStateNormal, display);
+  mb_kbd_key_set_layout_action(key, MBKeyboardKeyStateNormal, layout_id);
+
+  if (layout_id == NULL)
+    mb_kbd_key_set_fill(key, True);
+
+  mb_kbd_row_append_key(row, key);
+}
+
+/*
+ * Gives every page of the paged layouts a bottom row to flip through the
+ * pages with, and to get back out to the other layouts.
+ */
+static void
+config_add_page_rows(MBKeyboard *kbd)
+{
+  List *l, *p;
+
+  for (l = kbd->layouts; l != NULL; l = util_list_next(l))
+    {
+      MBKeyboardLayout *layout = l->data;
+      List             *pages;
+      int               n_pages, i;
+
+      if ((pages = mb_kbd_layout_pages(layout)) == NULL)
+	continue;
+
+      /* the first page is the layout itself */
+      pages   = util_list_append(NULL, layout);
+      for (p = mb_kbd_layout_pages(layout); p != NULL; p = util_list_next(p))
+	pages = util_list_append(pages, p->data);
+
+      n_pages = util_list_length(pages);
+
+      for (i = 0, p = pages; p != NULL; i++, p = util_list_next(p))
+	{
+	  MBKeyboardLayout *prev, *next;
+	  MBKeyboardRow    *row = mb_kbd_row_new(kbd);
+
+	  prev = util_list_get_nth_data(pages, (i + n_pages - 1) % n_pages);
+	  next = util_list_get_nth_data(pages, (i + 1) % n_pages);
+
+	  /* U+25C0 and U+25B6, the black left and right pointing triangles */
+	  config_add_page_key(kbd, row, "\xe2\x97\x80", mb_kbd_layout_id(prev));
+
+	  if (util_list_length(kbd->layouts) > 1)
+	    config_add_page_key(kbd, row, "ABC", NULL);
+	  else
+	    {
+	      MBKeyboardKey *space = mb_kbd_key_new(kbd);
+
+	      mb_kbd_key_set_blank(space, True);
+	      mb_kbd_key_set_fill(space, True);
+	      mb_kbd_row_append_key(row, space);
+	    }
+
+	  config_add_page_key(kbd, row, "\xe2\x96\xb6", mb_kbd_layout_id(next));
+
+	  mb_kbd_layout_append_row(p->data, row);
+	}
+
+      while (pages)
+	pages = util_list_remove(pages, pages->data);
+    }
+}
+
 static void
 config_handle_key_tag(MBKeyboardConfigState *state, const char **attr)
 {
   const char *val;
   DBG("got key");
 
+  if (state->current_row == NULL)
+    {
+      set_error(state, "Keys must be inside a <row>");
+      return;
+    }
+
   state->current_key = mb_kbd_key_new(state->keyboard);
 
   if ((val = attr_get_val("obey-caps", attr)) != NULL)
@@ -561,128 +900,304 @@ static void
 config_xml_start_cb(void *data, const char *tag, const char **attr)
 {
   MBKeyboardConfigState *state = (MBKeyboardConfigState *)data;
+  int                    tag_type = config_name_lookup(&TagTable, tag);
 
-  if (streq(tag, "layout"))
+  switch (tag_type)
     {
+    case ConfigTagLayout:
       config_handle_layout_tag(state, attr);
+      break;
+    case ConfigTagRow:
+      config_handle_row_tag(state, attr);
+      break;
+    case ConfigTagKey:
+      config_handle_key_tag(state, attr);
+      break;
+    case ConfigTagSpace:
+      config_handle_key_tag(state, attr);
+      if (!state->error)
+        mb_kbd_key_set_blank(state->current_key, True);
+      break;
+    case ConfigTagInclude:
+      {
+        const char *val;
+        const char *loc;
+        char       *inc;
+        int         autoloc = 1;
+
+        if (!(val = attr_get_val("file", attr)))
+          return;
+        else
+          {
+            char *p;
+
+            inc = strdup (val);
+            if ((p = strstr (inc, ".xml")))
+              *p = 0;
+          }
+
+        if ((loc = attr_get_val("auto-locale", attr)) && streq(loc, "no"))
+          autoloc = 0;
+
+        if (!load_include (state, inc, autoloc) && !state->error)
+          set_error (state, "Failed to load include");
+      }
+      break;
+    case ConfigTagFragment:
+      /* Do nothing; the fragment element is needed so that the fragments
+         are a valid xml */
+      break;
+    default:
+      if (tag_type >= ConfigTagKeyState)
+        config_handle_key_subtag(state, tag_type - ConfigTagKeyState, attr);
+      break;
     }
-  else if (streq(tag, "row"))
+
+  /* reported once, from the config itself rather than each include */
+  if (state->error && state->parser)
     {
-      config_handle_row_tag(state, attr);
+      fprintf(stderr, "matchbox-keyboard:%s:%d: %s\n", state->keyboard->config_file,
+                                              state->error_lineno, state->error_msg);
+      XML_StopParser(state->parser, 0);
     }
-  else if (streq(tag, "key"))
+}
+
+static void
+config_fragment_record_cb(void *data, const char *tag, const char **attr)
+{
+  ConfigFragment *frag = data;
+  ConfigElement  *element;
+  int             n = 0, i;
+
+  if (frag->n_elements == frag->alloc)
     {
-      config_handle_key_tag(state, attr);
+      frag->alloc    = frag->alloc ? frag->alloc * 2 : 64;
+      frag->elements = realloc(frag->elements,
+			       frag->alloc * sizeof(ConfigElement));
     }
-  else  if (streq(tag, "space"))
+
+  element = &frag->elements[frag->n_elements++];
+
+  while (attr[n] != NULL)
+    n++;
+
+  element->tag    = strdup(tag);
+  element->attr   = malloc((n + 1) * sizeof(char *));
+  element->lineno = XML_GetCurrentLineNumber(frag->parser);
+
+  for (i = 0; i < n; i++)
+    element->attr[i] = strdup(attr[i]);
+
+  element->attr[n] = NULL;
+}
+
+static void
+config_fragment_clear (ConfigFragment *frag)
+{
+  int i;
+
+  for (i = 0; i < frag->n_elements; i++)
     {
-      config_handle_key_tag(state, attr);
-      mb_kbd_key_set_blank(state->current_key, True);
+      char **a;
+
+      for (a = frag->elements[i].attr; *a != NULL; a++)
+	free(*a);
+
+      free(frag->elements[i].attr);
+      free(frag->elements[i].tag);
     }
-  else if (streq(tag, "normal")
-	   || streq(tag, "default")
-	   || streq(tag, "shifted")
-	   || streq(tag, "caps")
-	   || streq(tag, "mod1")
-	   || streq(tag, "mod2")
-	   || streq(tag, "mod3"))
+
+  free(frag->elements);
+
+  frag->elements   = NULL;
+  frag->n_elements = 0;
+  frag->alloc      = 0;
+}
+
+static void
+config_fragment_free (ConfigFragment *frag)
+{
+  config_fragment_clear(frag);
+  free(frag->path);
+  free(frag);
+}
+
+/* the parsed fragment at path, NULL if it cannot be read or parsed */
+static ConfigFragment*
+config_fragment_get (const char *path)
+{
+  ConfigFragment *frag = NULL;
+  struct stat     st;
+  List           *l;
+  boolean         ok;
+  int             size;
+
+  if (mb_kbd_embedded_file(path, &size))
     {
-      config_handle_key_subtag(state, tag, attr);
+      memset(&st, 0, sizeof(st));
+      st.st_size = size;
     }
-  else  if (streq(tag, "include"))
+  else if (stat(path, &st))
+    return NULL;
+
+  for (l = ConfigFragments; l != NULL; l = util_list_next(l))
+    if (streq(((ConfigFragment *)l->data)->path, path))
+      {
+	frag = l->data;
+	break;
+      }
+
+  if (frag && frag->mtime == (long long)st.st_mtime
+      && frag->size == (long long)st.st_size)
+    return frag;
+
+  if (frag && frag->replaying)
     {
-      const char *val;
-      const char *loc;
-      char       *inc;
-      int         autoloc = 1;
+      /*
+       * Changed while an include further up still goes through its
+       * elements, so those stay and it is parsed into a new entry.
+       */
+      ConfigFragments = util_list_remove(ConfigFragments, frag);
+      frag->stale = True;
+      frag = NULL;
+    }
 
-      if (!(val = attr_get_val("file", attr)))
-        return;
-      else
-        {
-          char *p;
+  if (frag)
+    config_fragment_clear(frag);
+  else
+    {
+      frag       = util_malloc0(sizeof(ConfigFragment));
+      frag->path = strdup(path);
+      ConfigFragments = util_list_append(ConfigFragments, frag);
+    }
 
-          inc = strdup (val);
-          if ((p = strstr (inc, ".xml")))
-            *p = 0;
-        }
+  /* until it has parsed it is never current */
+  frag->mtime = -1;
+
+  if (!(frag->parser = XML_ParserCreate(NULL)))
+    return NULL;
+
+  XML_SetElementHandler(frag->parser, config_fragment_record_cb, NULL);
+  XML_SetUserData(frag->parser, (void *)frag);
+
+  ok = config_parse_file(frag->parser, path);
 
-      if (state->lang || ((loc = attr_get_val("auto-locale", attr)) &&
-                          streq(loc, "no")))
-        autoloc = 0;
+  XML_ParserFree(frag->parser);
+  frag->parser = NULL;
+
+  if (!ok)
+    return NULL;
+
+  frag->mtime = st.st_mtime;
+  frag->size  = st.st_size;
+
+  return frag;
+}
+
+/*
+ * Drops the directory indexes, remembered lookups and parsed fragments, so
+ * the next load searches and reads everything afresh, see
+ * mb_kbd_config_reload().
+ */
+void
+mb_kbd_config_forget (void)
+{
+  while (ConfigPathMemos)
+    {
+      ConfigPathMemo *memo = ConfigPathMemos->data;
 
-      if (!load_include (state, inc, autoloc))
-        set_error (state, "Failed to load include");
+      ConfigPathMemos = util_list_remove(ConfigPathMemos, memo);
+      free(memo->key);
+      free(memo->path);
+      free(memo);
     }
-  else  if (streq(tag, "fragment"))
+
+  while (ConfigDirIndexes)
     {
-      /* Do nothing; the fragment element is needed so that the fragments
-         are a valid xml */
+      ConfigDirIndex *index = ConfigDirIndexes->data;
+
+      ConfigDirIndexes = util_list_remove(ConfigDirIndexes, index);
+
+      while (index->n_names)
+	free(index->names[--index->n_names]);
+
+      free(index->names);
+      free(index->dir);
+      free(index);
     }
 
-  if (state->error)
+  while (ConfigFragments)
     {
-      fprintf(stderr, "matchbox-keyboard:%s:%d: %s\n", state->keyboard->config_file,
-                                              state->error_lineno, state->error_msg);
-      if (!state->keyboard->is_widget)
-        util_fatal_error("Error parsing\n");
-      else
-        XML_StopParser(state->parser, 0);
+      ConfigFragment *frag = ConfigFragments->data;
+
+      ConfigFragments = util_list_remove(ConfigFragments, frag);
+      config_fragment_free(frag);
     }
 }
 
+/* include is taken over; it ends up on kbd->config_includes */
 static int
 load_include (MBKeyboardConfigState *state,
-              const char            *include,
+              char                  *include,
               int                    autolocale)
 {
-  XML_Parser  p, old_p;
-  char        *data;
-  int          retval = 1;
-
-  if (!(data = load_config_file (include, NULL, state->lang, autolocale, NULL)))
+  MBKeyboardConfigInclude *inc;
+  ConfigFragment *frag;
+  XML_Parser      old_p;
+  int             old_lineno;
+  char            path[1024];
+  int             i, retval = 1;
+
+  if (state->include_depth >= CONFIG_MAX_INCLUDE_DEPTH)
     {
-      if (!state->keyboard->is_widget)
-        util_fatal_error("Couldn't find a keyboard config file\n");
-      else
-        return 0;
+      free (include);
+      set_error (state, "Includes nested too deeply");
+      return 0;
     }
 
-  p = XML_ParserCreate(NULL);
-
-  if (!p)
+  if (!mb_kbd_config_find_file (include, NULL, state->lang,
+                                state->lang ? 0 : autolocale,
+                                path, sizeof(path)))
     {
-      if (!state->keyboard->is_widget)
-        util_fatal_error("Couldn't allocate memory for XML subparser\n");
-      else
-        return 0;
+      free (include);
+      return 0;
     }
 
-  old_p = state->parser;
-  state->parser = p;
+  /* remembered so a compiled config can tell when it is out of date */
+  inc = util_malloc0(sizeof(MBKeyboardConfigInclude));
+  inc->name       = include;
+  inc->path       = strdup (path);
+  inc->autolocale = autolocale;
 
-  XML_SetElementHandler(p, config_xml_start_cb, NULL);
-  XML_SetUserData(p, (void *)state);
+  state->keyboard->config_includes
+    = util_list_append(state->keyboard->config_includes, inc);
 
-  if (! XML_Parse(p, data, strlen(data), 1)) {
-    fprintf(stderr,
-	    "matchbox-keyboard:%s:%d: XML Parse error:%s\n",
-	    include,
-	    (int)XML_GetCurrentLineNumber(p),
-	    XML_ErrorString(XML_GetErrorCode(p)));
+  if (!(frag = config_fragment_get (path)))
+    return 0;
+
+  old_p      = state->parser;
+  old_lineno = state->lineno;
+  state->parser = NULL;
+  state->include_depth++;
+  frag->replaying++;
+
+  for (i = 0; i < frag->n_elements && !state->error; i++)
+    {
+      state->lineno = frag->elements[i].lineno;
+      config_xml_start_cb(state, frag->elements[i].tag,
+                          (const char **)frag->elements[i].attr);
+    }
+
+  if (--frag->replaying == 0 && frag->stale)
+    config_fragment_free(frag);
 
-    if (!state->keyboard->is_widget)
-      util_fatal_error("XML Parse failed.\n");
-    else
-      retval = 0;
-  }
+  state->include_depth--;
 
   if (state->error)
     retval = 0;
 
   state->parser = old_p;
-
-  XML_ParserFree (p);
+  state->lineno = old_lineno;
 
   return retval;
 }
@@ -690,28 +1205,30 @@ load_include (MBKeyboardConfigState *state,
 int
 mb_kbd_config_load(MBKeyboard *kbd, char *variant, char *lang)
 {
-  char                  *data;
   XML_Parser             p;
   MBKeyboardConfigState *state;
   int                    retval = 1;
+  char                   path[1024];
 
-  if (!(data = load_config_file ("keyboard", variant, lang, lang ? 0 : 1,
-                                 &kbd->config_file)))
+  if (!mb_kbd_config_find_file ("keyboard", variant, lang, lang ? 0 : 1,
+                                path, sizeof(path)))
     {
-      if (!state->keyboard->is_widget)
-        util_fatal_error("Couldn't find a keyboard config file\n");
-      else
-        return 0;
+      fprintf(stderr, "matchbox-keyboard: Couldn't find a keyboard config file\n");
+      return 0;
     }
 
+  kbd->config_file = strdup (path);
+
+  /* an up to date compiled copy saves parsing, see config-compiled.c */
+  if (mb_kbd_config_load_compiled (kbd, path, lang))
+    return 1;
+
   p = XML_ParserCreate(NULL);
 
   if (!p)
     {
-      if (!state->keyboard->is_widget)
-        util_fatal_error("Couldn't allocate memory for XML parser\n");
-      else
-        return 0;
+      fprintf(stderr, "matchbox-keyboard: Couldn't allocate memory for XML parser\n");
+      return 0;
     }
 
   if (variant && !strstr(kbd->config_file, variant))
@@ -732,24 +1249,14 @@ mb_kbd_config_load(MBKeyboard *kbd, char *variant, char *lang)
 
   XML_SetUserData(p, (void *)state);
 
-  if (! XML_Parse(p, data, strlen(data), 1)) {
-    fprintf(stderr,
-	    "matchbox-keyboard:%s:%lu: XML Parse error:%s\n",
-	    kbd->config_file,
-	    XML_GetCurrentLineNumber(p),
-	    XML_ErrorString(XML_GetErrorCode(p)));
-
-    if (!state->keyboard->is_widget)
-      util_fatal_error("XML Parse failed.\n");
-    else
-      retval = 0;
-  }
-
-  if (state->error)
+  if (!config_parse_file(p, kbd->config_file) || state->error)
     retval = 0;
 
   XML_ParserFree (p);
+  free (state);
+
+  if (retval)
+    config_add_page_rows(kbd);
 
   return retval;
 }
-
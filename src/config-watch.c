@@ -0,0 +1,425 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Copyright (c) 2012 Vernier Software & Technology
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * Reloading the config while running, for --watch. The config is parsed
+ * afresh next to the live model and the two compared: if the layouts, rows
+ * and keys are all still there with the same sizes, the new faces and
+ * actions are swapped into the live keys and only those keys redrawn;
+ * the keys only get laid out again if the unit key size has changed with
+ * them. Anything else replaces the layouts outright.
+ *
+ * With inotify the directories holding the config and its includes are
+ * watched, directories rather than files so that editors which save by
+ * renaming a new file over the old one are caught too.
+ */
+
+#include "matchbox-keyboard-core.h"
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+typedef struct ConfigWatchDir
+{
+  int   wd;
+  char *dir;
+}
+ConfigWatchDir;
+
+static void
+config_reload_free_layouts (List *layouts)
+{
+  while (layouts)
+    {
+      MBKeyboardLayout *layout = layouts->data;
+
+      layouts = util_list_remove(layouts, layout);
+      mb_kbd_layout_destroy (layout);
+    }
+}
+
+static void
+config_reload_free_includes (List *includes)
+{
+  while (includes)
+    {
+      MBKeyboardConfigInclude *inc = includes->data;
+
+      includes = util_list_remove(includes, inc);
+      free (inc->name);
+      free (inc->path);
+      free (inc);
+    }
+}
+
+/* whether two keys take up the same space */
+static boolean
+config_reload_same_key_size (MBKeyboardKey *a, MBKeyboardKey *b)
+{
+  return (mb_kbd_key_get_req_uwidth(a) == mb_kbd_key_get_req_uwidth(b)
+	  && mb_kbd_key_get_fill(a) == mb_kbd_key_get_fill(b)
+	  && mb_kbd_key_get_extended(a) == mb_kbd_key_get_extended(b)
+	  && mb_kbd_key_is_blank(a) == mb_kbd_key_is_blank(b));
+}
+
+/* whether the two lists of layouts (or pages) only differ in their faces */
+static boolean
+config_reload_same_shape (List *a, List *b)
+{
+  List *ra, *rb, *ka, *kb;
+
+  for (; a != NULL && b != NULL; a = util_list_next(a), b = util_list_next(b))
+    {
+      if (!streq(mb_kbd_layout_id(a->data), mb_kbd_layout_id(b->data))
+	  || mb_kbd_layout_page_rows(a->data) != mb_kbd_layout_page_rows(b->data))
+	return False;
+
+      for (ra = mb_kbd_layout_rows(a->data), rb = mb_kbd_layout_rows(b->data);
+	   ra != NULL && rb != NULL;
+	   ra = util_list_next(ra), rb = util_list_next(rb))
+	{
+	  for (ka = mb_kdb_row_keys(ra->data), kb = mb_kdb_row_keys(rb->data);
+	       ka != NULL && kb != NULL;
+	       ka = util_list_next(ka), kb = util_list_next(kb))
+	    if (!config_reload_same_key_size(ka->data, kb->data))
+	      return False;
+
+	  if (ka != NULL || kb != NULL)
+	    return False;
+	}
+
+      if (ra != NULL || rb != NULL)
+	return False;
+
+      if (!config_reload_same_shape(mb_kbd_layout_pages(a->data),
+				    mb_kbd_layout_pages(b->data)))
+	return False;
+    }
+
+  return (a == NULL && b == NULL);
+}
+
+/*
+ * Moves the faces and actions of the new keys that differ over to the live
+ * ones, whose layouts have the same shape. Returns whether any layout's
+ * unit key size changed, and the changed keys in the selected layout in
+ * redraw.
+ */
+static boolean
+config_reload_apply (MBKeyboard *kbd,
+		     List       *live,
+		     List       *fresh,
+		     List      **redraw)
+{
+  List    *ra, *rb, *ka, *kb;
+  boolean  relayout = False;
+  int      set, w[2], h[2];
+
+  for (; live != NULL; live = util_list_next(live), fresh = util_list_next(fresh))
+    {
+      for (set = 0; set < 2; set++)
+	{
+	  mb_kbd_layout_unit_key_size(kbd, live->data, set, &w[0], &h[0]);
+	  mb_kbd_layout_unit_key_size(kbd, fresh->data, set, &w[1], &h[1]);
+
+	  if (w[0] != w[1] || h[0] != h[1])
+	    relayout = True;
+	}
+
+      for (ra = mb_kbd_layout_rows(live->data), rb = mb_kbd_layout_rows(fresh->data);
+	   ra != NULL;
+	   ra = util_list_next(ra), rb = util_list_next(rb))
+	for (ka = mb_kdb_row_keys(ra->data), kb = mb_kdb_row_keys(rb->data);
+	     ka != NULL;
+	     ka = util_list_next(ka), kb = util_list_next(kb))
+	  {
+	    if (mb_kbd_key_states_equal(ka->data, kb->data))
+	      continue;
+
+	    mb_kbd_key_swap_states(ka->data, kb->data);
+
+	    if (live->data == kbd->selected_layout)
+	      *redraw = util_list_append(*redraw, ka->data);
+	  }
+
+      if (config_reload_apply(kbd, mb_kbd_layout_pages(live->data),
+			      mb_kbd_layout_pages(fresh->data), redraw))
+	relayout = True;
+    }
+
+  return relayout;
+}
+
+/*
+ * Parses the config again, the way it was first loaded, and brings the
+ * live model in line with it. If the config is broken, or gone, the
+ * keyboard carries on as it was.
+ */
+boolean
+mb_kbd_config_reload (MBKeyboard *kbd)
+{
+  List             *layouts  = kbd->layouts;
+  List             *includes = kbd->config_includes;
+  char             *file     = kbd->config_file;
+  List             *redraw   = NULL;
+  MBKeyboardLayout *selected;
+  boolean           ok, relayout;
+
+  kbd->layouts         = NULL;
+  kbd->config_includes = NULL;
+  kbd->config_file     = NULL;
+
+  /* the files may have changed since they were last looked up and read */
+  mb_kbd_config_forget ();
+
+  ok = mb_kbd_config_load(kbd, kbd->config_variant, kbd->config_lang);
+
+  if (!ok || kbd->layouts == NULL)
+    {
+      fprintf(stderr, "matchbox-keyboard: %s failed to load, "
+	      "keeping the current layouts\n", file);
+
+      config_reload_free_layouts (kbd->layouts);
+      config_reload_free_includes (kbd->config_includes);
+      free (kbd->config_file);
+
+      kbd->layouts         = layouts;
+      kbd->config_includes = includes;
+      kbd->config_file     = file;
+
+      return False;
+    }
+
+  config_reload_free_includes (includes);
+  free (file);
+
+  if (config_reload_same_shape(layouts, kbd->layouts))
+    {
+      DBG("same shape, updating keys in place");
+
+      relayout = config_reload_apply(kbd, layouts, kbd->layouts, &redraw);
+
+      config_reload_free_layouts (kbd->layouts);
+      kbd->layouts = layouts;
+    }
+  else
+    {
+      DBG("layouts changed shape, replacing them");
+
+      /* nothing may point at the old keys */
+      mb_kbd_key_release (kbd, True);
+
+      selected = mb_kbd_find_layout(kbd,
+				    mb_kbd_layout_id(kbd->selected_layout));
+      if (selected == NULL)
+	selected = kbd->layouts->data;
+
+      kbd->selected_layout = selected;
+
+      config_reload_free_layouts (layouts);
+      relayout = True;
+    }
+
+  if (kbd->frontend && kbd->frontend->config_reloaded)
+    kbd->frontend->config_reloaded(kbd, relayout);
+
+  while (redraw)
+    {
+      MBKeyboardKey *key = redraw->data;
+
+      redraw = util_list_remove(redraw, key);
+
+      if (!relayout)
+	mb_kbd_redraw_key (kbd, key);
+    }
+
+  return True;
+}
+
+#ifdef HAVE_INOTIFY
+
+static void
+config_watch_add (MBKeyboard *kbd, const char *path)
+{
+  ConfigWatchDir *watch;
+  List           *l;
+  char           *dir, *p;
+  int             wd;
+
+  dir = strdup(path);
+
+  if ((p = strrchr(dir, '/')) == NULL)
+    {
+      free (dir);
+      dir = strdup(".");
+    }
+  else if (p == dir)
+    p[1] = '\0';
+  else
+    *p = '\0';
+
+  for (l = kbd->watch_dirs; l != NULL; l = util_list_next(l))
+    if (streq(((ConfigWatchDir *)l->data)->dir, dir))
+      {
+	free (dir);
+	return;
+      }
+
+  wd = inotify_add_watch(kbd->watch_fd, dir,
+			 IN_CLOSE_WRITE|IN_MOVED_TO|IN_DELETE);
+  if (wd < 0)
+    {
+      fprintf(stderr, "matchbox-keyboard: unable to watch %s\n", dir);
+      free (dir);
+      return;
+    }
+
+  DBG("watching %s", dir);
+
+  watch      = util_malloc0(sizeof(ConfigWatchDir));
+  watch->wd  = wd;
+  watch->dir = dir;
+
+  kbd->watch_dirs = util_list_append(kbd->watch_dirs, watch);
+}
+
+static void
+config_watch_add_sources (MBKeyboard *kbd)
+{
+  List *l;
+
+  /* built in files never change */
+  if (!mb_kbd_embedded_file(kbd->config_file, NULL))
+    config_watch_add (kbd, kbd->config_file);
+
+  for (l = kbd->config_includes; l != NULL; l = util_list_next(l))
+    {
+      MBKeyboardConfigInclude *inc = l->data;
+
+      if (!mb_kbd_embedded_file(inc->path, NULL))
+	config_watch_add (kbd, inc->path);
+    }
+}
+
+/* whether name, in the directory watched as wd, is one the config came from */
+static boolean
+config_watch_is_source (MBKeyboard *kbd, int wd, const char *name)
+{
+  ConfigWatchDir *watch = NULL;
+  List           *l;
+  char            path[1024];
+
+  for (l = kbd->watch_dirs; l != NULL; l = util_list_next(l))
+    if (((ConfigWatchDir *)l->data)->wd == wd)
+      {
+	watch = l->data;
+	break;
+      }
+
+  if (watch == NULL)
+    return False;
+
+  if (streq(watch->dir, "/"))
+    snprintf(path, sizeof(path), "/%s", name);
+  else
+    snprintf(path, sizeof(path), "%s/%s", watch->dir, name);
+
+  if (streq(path, kbd->config_file))
+    return True;
+
+  for (l = kbd->config_includes; l != NULL; l = util_list_next(l))
+    if (streq(path, ((MBKeyboardConfigInclude *)l->data)->path))
+      return True;
+
+  return False;
+}
+
+#endif
+
+/*
+ * Starts watching the config and its includes; once kbd->watch_fd turns
+ * readable, mb_kbd_config_watch_process() needs to be called.
+ */
+boolean
+mb_kbd_config_watch (MBKeyboard *kbd)
+{
+#ifdef HAVE_INOTIFY
+  if (kbd->watch_fd < 0
+      && (kbd->watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
+    {
+      fprintf(stderr, "matchbox-keyboard: unable to set up inotify\n");
+      return False;
+    }
+
+  config_watch_add_sources (kbd);
+
+  return True;
+#else
+  fprintf(stderr, "matchbox-keyboard: built without inotify, "
+	  "not watching %s\n", kbd->config_file);
+  return False;
+#endif
+}
+
+/* reads what has happened to the watched files, reloading once if need be */
+void
+mb_kbd_config_watch_process (MBKeyboard *kbd)
+{
+#ifdef HAVE_INOTIFY
+  char                  buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  boolean               reload = False;
+  char                 *p;
+  ssize_t               len;
+
+  if (kbd->watch_fd < 0)
+    return;
+
+  while ((len = read(kbd->watch_fd, buf, sizeof(buf))) > 0)
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+      {
+	ev = (struct inotify_event *)p;
+
+	if ((ev->mask & IN_Q_OVERFLOW)
+	    || (ev->len && config_watch_is_source(kbd, ev->wd, ev->name)))
+	  reload = True;
+      }
+
+  if (reload && mb_kbd_config_reload (kbd))
+    config_watch_add_sources (kbd); /* includes may have come and gone */
+#endif
+}
+
+void
+mb_kbd_config_unwatch (MBKeyboard *kbd)
+{
+  while (kbd->watch_dirs)
+    {
+      ConfigWatchDir *watch = kbd->watch_dirs->data;
+
+      kbd->watch_dirs = util_list_remove(kbd->watch_dirs, watch);
+      free (watch->dir);
+      free (watch);
+    }
+
+  if (kbd->watch_fd >= 0)
+    {
+      close (kbd->watch_fd);
+      kbd->watch_fd = -1;
+    }
+}
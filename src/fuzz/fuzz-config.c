@@ -0,0 +1,157 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * fuzz-config: feeds the config parser from memory. An input is
+ * keyboard.xml, followed by any number of other files, each after a NUL
+ * byte and named by its first line:
+ *
+ *   <keyboard>...<include file="base-fragment" />...</keyboard>\0
+ *   base-fragment.xml\n<fragment>...</fragment>
+ *
+ * The files are put in place of the installed ones, see
+ * mb_kbd_embedded_set_files(), so the config, its includes and its images
+ * are all found among them and nothing is read from disk; an image that
+ * is not a PNG fails to load, see stub-frontend.h. What loads is then laid
+ * out and scaled, like the keyboard does.
+ *
+ * With a libFuzzer style engine this is the fuzzer, e.g.
+ *
+ *   CC=clang CFLAGS="-g -fsanitize=fuzzer-no-link,address" \
+ *     LIB_FUZZING_ENGINE=-fsanitize=fuzzer ./configure --enable-fuzzing
+ *
+ * Otherwise it runs each file it is given once, to reproduce a crash or
+ * under AFL.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stub-frontend.h"
+
+#include <stdint.h>
+
+#define FUZZ_MAX_FILES 16
+
+static int
+fuzz_file_cmp (const void *a, const void *b)
+{
+  const MBKeyboardEmbeddedFile *fa = a, *fb = b;
+
+  return strcmp(fa->name, fb->name);
+}
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  static boolean         init = False;
+  MBKeyboardEmbeddedFile files[FUZZ_MAX_FILES + 1];
+  MBKeyboard            *kb;
+  char                  *buf, *p, *end;
+  int                    n_files = 0, width, height;
+
+  if (!init)
+    {
+      /* only the files of the input are looked at */
+      stub_environment(NULL);
+      init = True;
+    }
+
+  /* a copy, so the names can be NUL terminated in place */
+  buf = malloc(size + 1);
+  memcpy(buf, data, size);
+  buf[size] = '\0';
+
+  end = buf + size;
+
+  for (p = buf; p <= end && n_files < FUZZ_MAX_FILES; p += strlen(p) + 1)
+    {
+      char *name = "keyboard.xml", *nl;
+
+      if (n_files > 0)
+	{
+	  if ((nl = strchr(p, '\n')) == NULL)
+	    continue;
+
+	  *nl  = '\0';
+	  name = p;
+	  p    = nl + 1;
+	}
+
+      files[n_files].name = name;
+      files[n_files].data = (const unsigned char *)p;
+      files[n_files].size = strlen(p);
+      n_files++;
+    }
+
+  qsort(files, n_files, sizeof(MBKeyboardEmbeddedFile), fuzz_file_cmp);
+  files[n_files].name = NULL;
+
+  mb_kbd_embedded_set_files(files);
+
+  kb = mb_kbd_core_new(&stub_frontend, NULL);
+
+  if (mb_kbd_load(kb, NULL, NULL))
+    {
+      mb_kbd_allocate_layout(kb, 800, 480, &width, &height);
+      mb_kbd_scale_layout(kb, width, height, 640, 240);
+    }
+
+  mb_kbd_core_destroy(kb);
+
+  /* nothing of this input may be remembered for the next */
+  mb_kbd_embedded_set_files(NULL);
+  mb_kbd_config_forget();
+
+  free(buf);
+
+  return 0;
+}
+
+#ifndef HAVE_FUZZING_ENGINE
+int
+main (int argc, char **argv)
+{
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      FILE          *f;
+      unsigned char *data = NULL;
+      size_t         size = 0, n;
+
+      if ((f = fopen(argv[i], "r")) == NULL)
+	{
+	  perror(argv[i]);
+	  return 1;
+	}
+
+      do
+	{
+	  data  = realloc(data, size + 4096);
+	  n     = fread(data + size, 1, 4096, f);
+	  size += n;
+	}
+      while (n > 0);
+
+      fclose(f);
+
+      LLVMFuzzerTestOneInput(data, size);
+      free(data);
+    }
+
+  return 0;
+}
+#endif
@@ -47,12 +47,12 @@ mb_keyboard_new (Display *xdpy, Window parent,
 
   kb = mb_kbd_new (argc, argv, True, parent, x, y, width, height);
 
-  if (!mb_kbd_ui_realize(kb->ui))
+  if (kb == NULL || !mb_kbd_ui_realize(mb_kbd_get_ui(kb)))
     return NULL;
 
 #if 0
-  mb_kbd_ui_show(kb->ui);
-  mb_kbd_ui_redraw(kb->ui);
+  mb_kbd_ui_show(mb_kbd_get_ui(kb));
+  mb_kbd_ui_redraw(mb_kbd_get_ui(kb));
 #endif
 
   return kb;
@@ -67,11 +67,11 @@ mb_keyboard_destroy (MBKeyboard *kb)
 Window
 mb_keyboard_get_xwindow (MBKeyboard *kb)
 {
-  return mb_kbd_ui_x_win (kb->ui);
+  return mb_kbd_ui_x_win (mb_kbd_get_ui(kb));
 }
 
 void
 mb_keyboard_handle_xevent (MBKeyboard *kb, XEvent *xev)
 {
-  mb_kbd_ui_handle_widget_xevent (kb->ui, xev);
+  mb_kbd_ui_handle_widget_xevent (mb_kbd_get_ui(kb), xev);
 }
@@ -22,6 +22,8 @@
 
 #include "matchbox-keyboard.h"
 
+#include <sys/time.h>
+
 /*
  * These are located in matchbox-keyboard.c
  */
@@ -29,13 +31,22 @@ extern Display *mb_xdpy;
 extern int      mb_xscreen;
 extern Window   mb_xroot;
 
+#if (WANT_DEBUG)
+/* for timing start up, up to the keyboard first being mapped */
+static struct timeval mb_kbd_start_time;
+#endif
+
 /*
- * X Event processing.
+ * X Event processing. With --watch the config files are looked after while
+ * waiting, see mb_kbd_config_watch_process().
  */
 static boolean
-get_xevent_timed (Display *dpy, XEvent *event_return, struct timeval *tv)
+get_xevent_timed (Display *dpy, MBKeyboard *kbd,
+                  XEvent *event_return, struct timeval *tv)
 {
-  if (tv->tv_usec == 0 && tv->tv_sec == 0)
+  int watch_fd = kbd->watch_fd;
+
+  if (tv->tv_usec == 0 && tv->tv_sec == 0 && watch_fd < 0)
     {
       XNextEvent(dpy, event_return);
       return True;
@@ -43,7 +54,7 @@ get_xevent_timed (Display *dpy, XEvent *event_return, struct timeval *tv)
 
   XFlush(dpy);
 
-  if (XPending(dpy) == 0)
+  while (XPending(dpy) == 0)
     {
       int fd = ConnectionNumber(dpy);
 
@@ -51,17 +62,23 @@ get_xevent_timed (Display *dpy, XEvent *event_return, struct timeval *tv)
       FD_ZERO(&readset);
       FD_SET(fd, &readset);
 
-      if (select(fd+1, &readset, NULL, NULL, tv) == 0)
+      if (watch_fd >= 0)
+        FD_SET(watch_fd, &readset);
+
+      /* a zero timeout means none, as above */
+      if (select((fd > watch_fd ? fd : watch_fd) + 1, &readset, NULL, NULL,
+                 (tv->tv_usec || tv->tv_sec) ? tv : NULL) == 0)
         return False;
-      else
-        {
-          XNextEvent(dpy, event_return);
-          return True;
-        }
-    } else {
-    XNextEvent(dpy, event_return);
-    return True;
-  }
+
+      if (watch_fd < 0 || !FD_ISSET(watch_fd, &readset))
+        break;
+
+      mb_kbd_config_watch_process (kbd);
+      XFlush(dpy);
+    }
+
+  XNextEvent(dpy, event_return);
+  return True;
 }
 
 static void
@@ -71,10 +88,7 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
   struct timeval tvt;
   Display *xdpy = mb_kbd_ui_x_display (ui);
   MBKeyboard* kbd = mb_kbd_ui_kbd (ui);
-  Window xroot = mb_kbd_ui_x_win_root (ui);
   Window xwin = mb_kbd_ui_x_win (ui);
-  int xwin_height = mb_kbd_ui_x_win_height (ui);
-  int xwin_width = mb_kbd_ui_x_win_width (ui);
 
   /* Key repeat - values for standard xorg install ( xset q) */
   int repeat_delay = 100 * 10000;
@@ -91,7 +105,7 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
     {
       XEvent xev;
 
-      if (get_xevent_timed (xdpy, &xev, &tvt))
+      if (get_xevent_timed (xdpy, kbd, &xev, &tvt))
         {
           switch (xev.type)
             {
@@ -106,6 +120,7 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
                   /* Hack if we never get a release event */
                   if (key != mb_kbd_get_held_key(kbd))
                     {
+                      mb_kbd_hide_popup (kbd);
                       mb_kbd_key_release(kbd, True);
                       tvt.tv_usec = repeat_delay;
                     }
@@ -132,6 +147,7 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
                   if (key != mb_kbd_get_held_key(kbd))
                     cancel = True;
 
+                  mb_kbd_hide_popup (kbd);
                   mb_kbd_key_release (kbd, cancel);
                   tvt.tv_usec = repeat_delay;
 
@@ -160,22 +176,35 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
                 }
               break;
             case ConfigureNotify:
-              if (xev.xconfigure.window == xwin
-                  &&  (xev.xconfigure.width != xwin_width
-                       || xev.xconfigure.height != xwin_height))
+              /* relayout once the burst is over, see below */
+              if (xev.xconfigure.window == xwin)
+                mb_kbd_ui_queue_configure(ui,
+                                          xev.xconfigure.width,
+                                          xev.xconfigure.height);
+              mb_kbd_ui_handle_display_event(ui, &xev);
+              break;
+#if (WANT_DEBUG)
+            case MapNotify:
+              if (xev.xmap.window == xwin && mb_kbd_start_time.tv_sec)
                 {
-                  mb_kbd_ui_handle_configure(ui,
-                                             xev.xconfigure.width,
-                                             xev.xconfigure.height);
+                  struct timeval now;
+
+                  gettimeofday (&now, NULL);
+                  DBG("first mapped %li ms after start",
+                      (now.tv_sec - mb_kbd_start_time.tv_sec) * 1000
+                      + (now.tv_usec - mb_kbd_start_time.tv_usec) / 1000);
+                  mb_kbd_start_time.tv_sec = 0;
                 }
-              if (xev.xconfigure.window == xroot)
-                mb_kbd_ui_update_display_size(ui);
+              mb_kbd_ui_handle_display_event(ui, &xev);
               break;
+#endif
             case MappingNotify:
               fakekey_reload_keysyms(mb_kbd_ui_get_fakekey (ui));
               XRefreshKeyboardMapping(&xev.xmapping);
               break;
             default:
+              /* RandR screen and CRTC changes */
+              mb_kbd_ui_handle_display_event(ui, &xev);
               break;
             }
           if (mb_kbd_ui_embeded (ui))
@@ -205,6 +234,25 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
                   else
                     mb_kbd_ui_show(ui);
                   break;
+                case MBKeyboardRemoteNextLayout:
+                  mb_kbd_select_next_layout(kbd);
+                  break;
+                case MBKeyboardRemoteSelectLayout:
+                  {
+                    long n = xev.xclient.data.l[1];
+
+                    if (n < 0 || n >= util_list_length(kbd->layouts))
+                      {
+                        fprintf(stderr, "matchbox-keyboard: no layout %li\n",
+                                n);
+                        break;
+                      }
+
+                    mb_kbd_select_layout(kbd,
+                                         util_list_get_nth_data(kbd->layouts,
+                                                                n));
+                  }
+                  break;
                 case MBKeyboardRemoteNone:
                   if (to_hide == 1) {
                     mb_kbd_ui_hide(ui);
@@ -214,6 +262,9 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
                   break;
                 }
             }
+
+          if (!XPending(xdpy))
+            mb_kbd_ui_flush_configure(ui);
         }
       else
         {
@@ -239,7 +290,12 @@ mb_kbd_event_loop (MBKeyboardUI *ui)
 int
 main(int argc, char **argv)
 {
-  MBKeyboard *kb;
+  MBKeyboard   *kb;
+  MBKeyboardUI *ui;
+
+#if (WANT_DEBUG)
+  gettimeofday (&mb_kbd_start_time, NULL);
+#endif
 
   if ((mb_xdpy = XOpenDisplay(getenv("DISPLAY"))) == NULL)
     {
@@ -252,30 +308,32 @@ main(int argc, char **argv)
 
   kb = mb_kbd_new (argc, argv, False, None, 0, 0, 0, 0);
 
-  if (!mb_kbd_ui_realize(kb->ui))
+  if (kb == NULL || !mb_kbd_ui_realize(mb_kbd_get_ui(kb)))
     exit (1);
 
-  unless (mb_kbd_ui_embeded(kb->ui))
+  ui = mb_kbd_get_ui(kb);
+
+  unless (mb_kbd_ui_embeded(ui))
     {
-      if (mb_kbd_ui_is_daemon (kb->ui))
+      if (mb_kbd_ui_is_daemon (ui))
         {
           /* Dont map daemon to begin with */
-          mb_kbd_remote_init (kb->ui);
+          mb_kbd_remote_init (ui);
         }
       else
         {
-          mb_kbd_ui_show(kb->ui);
-          mb_kbd_ui_redraw(kb->ui);
+          mb_kbd_ui_show(ui);
+          mb_kbd_ui_redraw(ui);
         }
     }
   else
     {
-      mb_kbd_xembed_init (kb->ui);
-      mb_kbd_ui_print_window (kb->ui);
+      mb_kbd_xembed_init (ui);
+      mb_kbd_ui_print_window (ui);
     }
 
   if (kb)
-    mb_kbd_event_loop (kb->ui);
+    mb_kbd_event_loop (ui);
 
   mb_kbd_destroy (kb);
 
@@ -0,0 +1,219 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Authored By Matthew Allum <mallum@o-hand.com>
+ *
+ *  Copyright (c) 2005-2012 Intel Corp
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * On-disk cache of computed layout geometry. Each layout of a config file
+ * gets one small file under $XDG_CACHE_HOME/matchbox-keyboard holding an
+ * opaque array of ints; the UI decides what goes in it and supplies a hash
+ * of everything the result depends on. Entries are also dropped when the
+ * config file has been touched since they were written.
+ */
+
+#include "matchbox-keyboard-core.h"
+
+#include <errno.h>
+
+#define MB_KBD_CACHE_MAGIC   0x474b424d /* "MBKG" */
+#define MB_KBD_CACHE_VERSION 1
+
+typedef struct MBKeyboardCacheHeader
+{
+  unsigned int magic;
+  unsigned int version;
+  unsigned int hash;
+  long long    mtime;
+  long long    size;
+  int          n_ints;
+}
+MBKeyboardCacheHeader;
+
+static char*
+mb_kbd_cache_dir (void)
+{
+  const char *base;
+  char       *dir;
+  int         n;
+
+  if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base)
+    {
+      n   = strlen(base) + sizeof("/matchbox-keyboard");
+      dir = malloc(n);
+      snprintf(dir, n, "%s/matchbox-keyboard", base);
+    }
+  else if ((base = getenv("HOME")) != NULL)
+    {
+      n   = strlen(base) + sizeof("/.cache/matchbox-keyboard");
+      dir = malloc(n);
+      snprintf(dir, n, "%s/.cache/matchbox-keyboard", base);
+    }
+  else
+    return NULL;
+
+  return dir;
+}
+
+static char*
+mb_kbd_cache_path (MBKeyboard *kbd, const char *layout_id)
+{
+  char         *dir, *path;
+  unsigned int  key;
+  int           n;
+
+  if (!kbd->config_file || !(dir = mb_kbd_cache_dir()))
+    return NULL;
+
+  key = util_str_hash(kbd->config_file);
+  key = util_hash_update(key, layout_id, strlen(layout_id));
+
+  n    = strlen(dir) + sizeof("/01234567.geometry");
+  path = malloc(n);
+  snprintf(path, n, "%s/%08x.geometry", dir, key);
+
+  free(dir);
+
+  return path;
+}
+
+static boolean
+mb_kbd_cache_config_stat (MBKeyboard *kbd, struct stat *st)
+{
+  return (kbd->config_file && stat(kbd->config_file, st) == 0);
+}
+
+/*
+ * Returns a malloc'ed copy of the cached ints for the layout, or NULL if
+ * there is no entry, or it does not match hash and n_ints.
+ */
+int*
+mb_kbd_cache_load (MBKeyboard *kbd,
+		   const char *layout_id,
+		   unsigned int hash,
+		   int         n_ints)
+{
+  MBKeyboardCacheHeader  header;
+  struct stat            st;
+  char                  *path;
+  FILE                  *fp;
+  int                   *data = NULL;
+
+  if (!mb_kbd_cache_config_stat(kbd, &st))
+    return NULL;
+
+  if (!(path = mb_kbd_cache_path(kbd, layout_id)))
+    return NULL;
+
+  if ((fp = fopen(path, "rb")) == NULL)
+    goto out;
+
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || header.magic   != MB_KBD_CACHE_MAGIC
+      || header.version != MB_KBD_CACHE_VERSION
+      || header.mtime   != (long long)st.st_mtime
+      || header.size    != (long long)st.st_size
+      || header.hash    != hash
+      || header.n_ints  != n_ints)
+    {
+      DBG("stale geometry cache %s", path);
+      goto out;
+    }
+
+  data = malloc(n_ints * sizeof(int));
+
+  if (fread(data, sizeof(int), n_ints, fp) != (size_t)n_ints)
+    {
+      free(data);
+      data = NULL;
+    }
+
+ out:
+  if (fp)
+    fclose(fp);
+
+  DBG("geometry cache %s for %s", data ? "hit" : "miss", layout_id);
+
+  free(path);
+  return data;
+}
+
+/*
+ * Stores the ints for the layout. Failures are not fatal; we just get to
+ * lay the keyboard out again next time.
+ */
+void
+mb_kbd_cache_save (MBKeyboard *kbd,
+		   const char *layout_id,
+		   unsigned int hash,
+		   const int  *data,
+		   int         n_ints)
+{
+  MBKeyboardCacheHeader  header;
+  struct stat            st;
+  char                  *dir, *path, *tmp;
+  FILE                  *fp;
+  int                    n;
+  boolean                ok;
+
+  if (!mb_kbd_cache_config_stat(kbd, &st))
+    return;
+
+  if (!(path = mb_kbd_cache_path(kbd, layout_id)))
+    return;
+
+  /* make sure both $XDG_CACHE_HOME and our directory in it exist */
+  dir = mb_kbd_cache_dir();
+  *strrchr(dir, '/') = '\0';
+  mkdir(dir, 0700);
+  dir[strlen(dir)] = '/';
+  mkdir(dir, 0700);
+  free(dir);
+
+  n   = strlen(path) + sizeof(".XXXXXX");
+  tmp = malloc(n);
+  snprintf(tmp, n, "%s.XXXXXX", path);
+
+  memset(&header, 0, sizeof(header));
+  header.magic   = MB_KBD_CACHE_MAGIC;
+  header.version = MB_KBD_CACHE_VERSION;
+  header.hash    = hash;
+  header.mtime   = st.st_mtime;
+  header.size    = st.st_size;
+  header.n_ints  = n_ints;
+
+  /* write aside and rename, so a concurrent reader never sees half a file */
+  if ((n = mkstemp(tmp)) < 0 || (fp = fdopen(n, "wb")) == NULL)
+    {
+      DBG("unable to write geometry cache %s: %s", tmp, strerror(errno));
+
+      if (n >= 0)
+	{
+	  close(n);
+	  unlink(tmp);
+	}
+      goto out;
+    }
+
+  ok = (fwrite(&header, sizeof(header), 1, fp) == 1
+	&& fwrite(data, sizeof(int), n_ints, fp) == (size_t)n_ints);
+
+  if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+    unlink(tmp);
+
+ out:
+  free(tmp);
+  free(path);
+}
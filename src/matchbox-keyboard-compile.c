@@ -0,0 +1,167 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Copyright (c) 2012 Vernier Software & Technology
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * matchbox-keyboard-compile: parses a keyboard config the way the keyboard
+ * would and writes the compiled copy it loads instead, see
+ * config-compiled.c. Needs no display; keysym names are looked up with
+ * XStringToKeysym and images only have their path recorded.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "matchbox-keyboard-core.h"
+
+#include <X11/Xlib.h>
+
+struct MBKeyboardImage
+{
+  char *path;
+};
+
+static KeySym
+compile_lookup_keysym (MBKeyboard *kbd, const char *name)
+{
+  return XStringToKeysym(name);
+}
+
+static MBKeyboardImage*
+compile_image_new (MBKeyboard *kbd, const char *path)
+{
+  MBKeyboardImage *img;
+
+  if (!util_file_readable((char *)path))
+    return NULL;
+
+  img = util_malloc0(sizeof(MBKeyboardImage));
+  img->path = strdup(path);
+
+  return img;
+}
+
+static void
+compile_image_destroy (MBKeyboardImage *img)
+{
+  free(img->path);
+  free(img);
+}
+
+static const char*
+compile_image_path (MBKeyboardImage *img)
+{
+  return img->path;
+}
+
+static const MBKeyboardFrontend compile_frontend =
+{
+  NULL,				/* text_extents */
+  compile_lookup_keysym,
+  compile_image_new,
+  NULL,				/* image_size */
+  compile_image_destroy,
+  NULL, NULL, NULL,		/* send_* */
+  NULL, NULL, NULL,		/* redraw, redraw_key, layout_changed */
+  NULL				/* config_reloaded */
+};
+
+static void
+usage (char *progname)
+{
+  fprintf(stderr, "Usage:\n   %s [Options ] [ Layout Variant ]\n", progname);
+  fprintf(stderr, "\nOptions are;\n"
+	  "   --lang <locale string>\n"
+	  "                         Force given locale when choosing layout.\n"
+	  "   -o,--output <file>\n"
+	  "                         Where to write the compiled layout, by\n"
+	  "                         default next to the config file.\n"
+	  "\nThe config file is looked up the way matchbox-keyboard does,\n"
+	  "so MB_KBD_CONFIG, MB_KBD_LANG and LANG apply.\n");
+  exit(-1);
+}
+
+int
+main(int argc, char **argv)
+{
+  MBKeyboard *kb;
+  char       *variant = NULL;
+  char       *lang = NULL;
+  char       *output = NULL;
+  int         i;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (!strcmp ("--lang", argv[i]))
+	{
+	  char *p;
+
+	  if (++i>=argc)
+	    usage (argv[0]);
+
+	  lang = argv[i];
+
+	  /* remove any encoding part */
+	  if ((p = strchr (lang, '.')))
+	    *p = 0;
+	  continue;
+	}
+
+      if (!strcmp ("-o", argv[i]) || !strcmp ("--output", argv[i]))
+	{
+	  if (++i>=argc)
+	    usage (argv[0]);
+
+	  output = argv[i];
+	  continue;
+	}
+
+      if (i == (argc-1) && argv[i][0] != '-')
+	variant = argv[i];
+      else
+	usage (argv[0]);
+    }
+
+  if (variant == NULL)
+    variant = getenv("MB_KBD_VARIANT");
+
+  kb = mb_kbd_core_new(&compile_frontend, NULL);
+
+  /* the compiled copy itself must not stand in for the xml */
+  setenv("MB_KBD_NO_COMPILED", "1", 1);
+
+  if (!mb_kbd_load(kb, variant, lang))
+    {
+      fprintf(stderr, "matchbox-keyboard-compile: no layouts loaded\n");
+      return 1;
+    }
+
+  if (output == NULL)
+    output = mb_kbd_config_compiled_path(kb->config_file);
+
+  if (!mb_kbd_config_save_compiled(kb, output, compile_image_path))
+    {
+      fprintf(stderr, "matchbox-keyboard-compile: failed to write %s\n",
+	      output);
+      return 1;
+    }
+
+  printf("%s -> %s\n", kb->config_file, output);
+
+  mb_kbd_core_destroy(kb);
+
+  return 0;
+}
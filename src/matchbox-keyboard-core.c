@@ -0,0 +1,800 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Authored By Matthew Allum <mallum@o-hand.com>
+ *
+ *  Copyright (c) 2005-2012 Intel Corp
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * The display independent part of MBKeyboard; see matchbox-keyboard.c for
+ * the X one.
+ */
+
+#include "matchbox-keyboard-core.h"
+
+/* scaling arithmetic is done in 1/256ths of a pixel */
+#define MB_KBD_FP_SHIFT                 8
+#define MB_KBD_FP_ROUND(x)              ((int)(((x) + (1 << (MB_KBD_FP_SHIFT - 1))) >> MB_KBD_FP_SHIFT))
+
+MBKeyboard*
+mb_kbd_core_new (const MBKeyboardFrontend *frontend, void *data)
+{
+  MBKeyboard *kb;
+
+  kb = util_malloc0(sizeof(MBKeyboard));
+
+  kb->key_border = 1;
+  kb->key_pad    = 0;
+  kb->key_margin = 0;
+
+  kb->col_spacing = 0;
+  kb->row_spacing = 0;
+
+  kb->font_family  = strdup("sans");
+  kb->font_pt_size = 8;
+  kb->font_variant = strdup("bold");
+
+  kb->watch_fd = -1;
+
+  mb_kbd_set_frontend (kb, frontend, data);
+
+  return kb;
+}
+
+void
+mb_kbd_core_destroy (MBKeyboard *kb)
+{
+  if (kb->font_family)
+    free (kb->font_family);
+
+  if (kb->font_variant)
+    free (kb->font_variant);
+
+  mb_kbd_config_unwatch (kb);
+
+  if (kb->config_file)
+    free (kb->config_file);
+
+  if (kb->config_variant)
+    free (kb->config_variant);
+
+  if (kb->config_lang)
+    free (kb->config_lang);
+
+  while (kb->config_includes)
+    {
+      MBKeyboardConfigInclude *inc = kb->config_includes->data;
+
+      kb->config_includes = util_list_remove(kb->config_includes, inc);
+      free (inc->name);
+      free (inc->path);
+      free (inc);
+    }
+
+  if (kb->layouts)
+    {
+      List *l;
+
+      l = kb->layouts;
+      while (l)
+        {
+          List             *n = l->next;
+          MBKeyboardLayout *c = l->data;
+
+          n = l->next;
+          mb_kbd_layout_destroy (c);
+          free (l);
+          l = n;
+        }
+    }
+
+  free (kb);
+}
+
+void
+mb_kbd_set_frontend (MBKeyboard               *kb,
+		     const MBKeyboardFrontend *frontend,
+		     void                     *data)
+{
+  kb->frontend      = frontend;
+  kb->frontend_data = data;
+}
+
+void*
+mb_kbd_frontend_data (MBKeyboard *kb)
+{
+  return kb->frontend_data;
+}
+
+/*
+ * Loads the config and selects its first layout. The frontend needs to be
+ * set by now, image faces and keysym names are resolved through it.
+ */
+boolean
+mb_kbd_load (MBKeyboard *kb, char *variant, char *lang)
+{
+  if (!mb_kbd_config_load(kb, variant, lang))
+    return False;
+
+  /* for mb_kbd_config_reload() */
+  kb->config_variant = variant ? strdup(variant) : NULL;
+  kb->config_lang    = lang ? strdup(lang) : NULL;
+
+  kb->selected_layout
+    = (MBKeyboardLayout *)util_list_get_nth_data(kb->layouts, 0);
+
+  return (kb->selected_layout != NULL);
+}
+
+int
+mb_kbd_row_spacing(MBKeyboard *kb)
+{
+  return kb->row_spacing;
+}
+
+int
+mb_kbd_col_spacing(MBKeyboard *kb)
+{
+  return kb->col_spacing;
+}
+
+int
+mb_kbd_keys_border(MBKeyboard *kb)
+{
+  return kb->key_border;
+}
+
+int
+mb_kbd_keys_pad(MBKeyboard *kb)
+{
+  return kb->key_pad;
+}
+
+int
+mb_kbd_keys_margin(MBKeyboard *kb)
+{
+  return kb->key_margin;
+}
+
+void
+mb_kbd_add_state(MBKeyboard *kbd, MBKeyboardStateType state)
+{
+  kbd->keys_state |= state;
+}
+
+void
+mb_kbd_toggle_state(MBKeyboard *kbd, MBKeyboardStateType state)
+{
+  kbd->keys_state ^= state;
+}
+
+boolean
+mb_kbd_has_state(MBKeyboard *kbd, MBKeyboardStateType state)
+{
+  return (kbd->keys_state & state);
+}
+
+boolean
+mb_kbd_has_any_state(MBKeyboard *kbd)
+{
+  return  (kbd->keys_state > 0);
+}
+
+void
+mb_kbd_remove_state(MBKeyboard *kbd, MBKeyboardStateType state)
+{
+  kbd->keys_state &= ~(state);
+}
+
+MBKeyboardKeyStateType
+mb_kbd_keys_current_state(MBKeyboard *kbd)
+{
+  if (mb_kbd_has_state(kbd, MBKeyboardStateShifted))
+    return MBKeyboardKeyStateShifted;
+
+  if (mb_kbd_has_state(kbd, MBKeyboardStateMod1))
+    return MBKeyboardKeyStateMod1;
+
+  if (mb_kbd_has_state(kbd, MBKeyboardStateMod2))
+    return MBKeyboardKeyStateMod2;
+
+  if (mb_kbd_has_state(kbd, MBKeyboardStateMod3))
+    return MBKeyboardKeyStateMod3;
+
+  return MBKeyboardKeyStateNormal;
+}
+
+void
+mb_kbd_redraw(MBKeyboard *kb)
+{
+  if (kb->frontend && kb->frontend->redraw)
+    kb->frontend->redraw(kb);
+}
+
+void
+mb_kbd_redraw_key(MBKeyboard *kb, MBKeyboardKey *key)
+{
+  if (kb->frontend && kb->frontend->redraw_key)
+    kb->frontend->redraw_key(kb, key);
+}
+
+void
+mb_kbd_send_press(MBKeyboard *kb, const char *utf8_char, int modifiers)
+{
+  DBG("Sending '%s'", utf8_char);
+
+  if (kb->frontend && kb->frontend->send_press)
+    kb->frontend->send_press(kb, utf8_char, modifiers);
+}
+
+void
+mb_kbd_send_keysym_press(MBKeyboard *kb, KeySym ks, int modifiers)
+{
+  if (kb->frontend && kb->frontend->send_keysym_press)
+    kb->frontend->send_keysym_press(kb, ks, modifiers);
+}
+
+void
+mb_kbd_send_release(MBKeyboard *kb)
+{
+  if (kb->frontend && kb->frontend->send_release)
+    kb->frontend->send_release(kb);
+}
+
+MBKeyboardKey*
+mb_kbd_locate_key(MBKeyboard *kb, int x, int y)
+{
+  MBKeyboardLayout *layout;
+  List             *row_item, *key_item;
+
+  layout = mb_kbd_get_selected_layout(kb);
+
+  row_item = mb_kbd_layout_rows(layout);
+
+  while (row_item != NULL)
+    {
+      MBKeyboardRow *row = row_item->data;
+
+      if (x >= mb_kbd_row_x(row)
+          && x <= mb_kbd_row_x(row) + mb_kbd_row_width(row)
+          && y >= mb_kbd_row_y(row)
+          && y <= mb_kbd_row_y(row) + mb_kbd_row_height(row) )
+        {
+          mb_kbd_row_for_each_key(row, key_item)
+            {
+              MBKeyboardKey *key = key_item->data;
+
+              if (!mb_kbd_is_extended(kb)
+                  && mb_kbd_key_get_extended(key))
+                continue;
+
+              if (!mb_kbd_key_is_blank(key)
+                  && x >= mb_kbd_key_abs_x(key)
+                  && x <= mb_kbd_key_abs_x(key) + mb_kbd_key_width(key))
+                return key;
+
+            }
+
+          return NULL;
+        }
+
+      row_item = util_list_next(row_item);
+    }
+  return NULL;
+}
+
+void
+mb_kbd_add_layout(MBKeyboard *kb, MBKeyboardLayout *layout)
+{
+  kb->layouts = util_list_append(kb->layouts, (pointer)layout);
+}
+
+MBKeyboardLayout*
+mb_kbd_get_selected_layout(MBKeyboard *kb)
+{
+  return kb->selected_layout;
+}
+
+MBKeyboardLayout*
+mb_kbd_find_layout(MBKeyboard *kb, const char *id)
+{
+  List *l, *p;
+
+  for (l = kb->layouts; l != NULL; l = util_list_next(l))
+    {
+      if (streq(mb_kbd_layout_id(l->data), id))
+	return l->data;
+
+      for (p = mb_kbd_layout_pages(l->data); p != NULL; p = util_list_next(p))
+	if (streq(mb_kbd_layout_id(p->data), id))
+	  return p->data;
+    }
+
+  return NULL;
+}
+
+void
+mb_kbd_select_layout(MBKeyboard *kb, MBKeyboardLayout *layout)
+{
+  if (layout == NULL || layout == kb->selected_layout)
+    return;
+
+  DBG("switching to layout '%s'", mb_kbd_layout_id(layout));
+
+  kb->selected_layout = layout;
+
+  if (kb->frontend && kb->frontend->layout_changed)
+    kb->frontend->layout_changed(kb);
+}
+
+/*
+ * cycles through the layouts in the order the config file has them; the
+ * pages of a paged layout are left to its page keys.
+ */
+void
+mb_kbd_select_next_layout(MBKeyboard *kb)
+{
+  MBKeyboardLayout *current = mb_kbd_layout_parent(kb->selected_layout);
+  List             *l;
+
+  for (l = kb->layouts; l != NULL; l = util_list_next(l))
+    if (l->data == current)
+      break;
+
+  if (l == NULL || util_list_next(l) == NULL)
+    l = kb->layouts;
+  else
+    l = util_list_next(l);
+
+  mb_kbd_select_layout(kb, l->data);
+}
+
+void
+mb_kbd_set_held_key(MBKeyboard *kb, MBKeyboardKey *key)
+{
+  kb->held_key = key;
+}
+
+MBKeyboardKey *
+mb_kbd_get_held_key(MBKeyboard *kb)
+{
+  return kb->held_key;
+}
+
+void
+mb_kbd_set_extended(MBKeyboard *kb, boolean extend)
+{
+  kb->extended = extend;
+}
+
+boolean
+mb_kbd_is_extended(MBKeyboard *kb)
+{
+  return kb->extended;
+}
+
+/*
+ * The size of a 'regular' single glyph key in layout, going by the widest
+ * and tallest such label, with or without the extended keys.
+ */
+void
+mb_kbd_layout_unit_key_size(MBKeyboard       *kb,
+			    MBKeyboardLayout *layout,
+			    boolean           extended,
+			    int              *width,
+			    int              *height)
+{
+  List                   *row_item, *key_item;
+  MBKeyboardKeyStateType  state;
+  const char             *face_str;
+
+  *width = 0; *height = 0;
+
+  row_item = mb_kbd_layout_rows(layout);
+
+  /*
+   * Figure out the base size of a 'regular' single glyph key.
+   */
+
+  while (row_item != NULL)
+    {
+      mb_kbd_row_for_each_key(row_item->data, key_item)
+	{
+	  MBKeyboardKey *key = key_item->data;
+
+          if (!extended && mb_kbd_key_get_extended(key))
+            continue;
+
+	  /* Ignore keys whose width is forced */
+	  if (mb_kbd_key_get_req_uwidth(key))
+	    continue;
+
+	  mb_kdb_key_foreach_state(key, state)
+	    {
+	      if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceGlyph)
+		{
+		  face_str = mb_kbd_key_get_glyph_face(key, state);
+
+		  if (util_utf8_char_cnt(face_str) == 1)
+		    {
+		      int str_w =0, str_h = 0;
+
+                      if (kb->frontend && kb->frontend->text_extents)
+                        kb->frontend->text_extents(kb, face_str,
+                                                   &str_w, &str_h);
+
+                      if (str_w > *width) *width = str_w;
+                      if (str_h > *height) *height = str_h;
+
+		    }
+		}
+	      else if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceImage)
+		{
+		  int img_w = 0, img_h = 0;
+
+                  if (kb->frontend && kb->frontend->image_size)
+                    kb->frontend->image_size(mb_kbd_key_get_image_face(key,
+                                                                       state),
+                                             &img_w, &img_h);
+
+                  if (img_w > *width)
+                    *width = img_w;
+
+                  if (img_h > *height)
+                    *height = img_h;
+                }
+            }
+        }
+      row_item = util_list_next(row_item);
+    }
+}
+
+static void
+mb_kbd_unit_key_size(MBKeyboard *kb, int display_height,
+		     int *width, int *height)
+{
+  mb_kbd_layout_unit_key_size(kb, mb_kbd_get_selected_layout(kb),
+			      mb_kbd_is_extended(kb), width, height);
+
+  /* FIXME: hack for small displays */
+  if (display_height <= 320)
+    {
+      *height += 4;
+    }
+
+}
+
+static void
+mb_kbd_min_key_size(MBKeyboard    *kb,
+		    MBKeyboardKey *key,
+		    int           *width,
+		    int           *height)
+{
+  /*
+   * Figure out how small a key can really be UI wise. Longer labels do
+   * not get to widen their key; the frontend fits them to it when
+   * drawing, so all that matters is the unit key.
+  */
+
+  if (mb_kbd_key_get_req_uwidth(key) || mb_kbd_key_is_blank(key))
+    {
+      *width = (kb->key_uwidth * mb_kbd_key_get_req_uwidth(key)) / 1000 ;
+      *height = kb->key_uheight;
+      return;
+    }
+
+  *width  = kb->key_uwidth;
+  *height = kb->key_uheight;
+}
+
+/*
+ * Widens every fill key (every key, with all_fill) by extra, in a single
+ * pass; each key is moved along by however much the fillers before it
+ * have grown.
+ */
+static void
+mb_kbd_distribute_fill(MBKeyboard    *kb,
+                       MBKeyboardRow *row,
+                       int            extra,
+                       boolean        all_fill)
+{
+  List *key_item;
+  int   shift = 0;
+
+  mb_kbd_row_for_each_key(row, key_item)
+    {
+      MBKeyboardKey *key = key_item->data;
+
+      if (!mb_kbd_is_extended(kb) && mb_kbd_key_get_extended(key))
+        continue;
+
+      if (shift)
+        mb_kbd_key_set_geometry(key, mb_kbd_key_x(key) + shift, -1, -1, -1);
+
+      if (all_fill || mb_kbd_key_get_fill(key))
+        {
+          mb_kbd_key_set_geometry(key, -1, -1,
+                                  mb_kbd_key_width(key) + extra, -1);
+          shift += extra;
+        }
+    }
+}
+
+/*
+ * Lays the selected layout out at its natural size for the given display
+ * size, and returns that size. Keys are sized off the widest single glyph
+ * label, as measured by the frontend.
+ */
+void
+mb_kbd_allocate_layout(MBKeyboard *kb,
+		       int         display_width,
+		       int         display_height,
+		       int        *width,
+		       int        *height)
+{
+  MBKeyboardLayout *layout;
+  List             *row_item, *key_item;
+  int               key_y = 0, key_x = 0;
+  int               row_y, max_row_key_height, max_row_width;
+
+  layout = mb_kbd_get_selected_layout(kb);
+
+  /* Do an initial run to figure out a 'base' size for single glyph keys */
+  mb_kbd_unit_key_size(kb, display_height, &kb->key_uwidth, &kb->key_uheight);
+
+  row_item = mb_kbd_layout_rows(layout);
+
+  row_y = mb_kbd_row_spacing(kb);
+
+  max_row_width = 0;
+
+  /*
+   * First of entire keyboard, basically get the minimum space needed
+  */
+  while (row_item != NULL)
+    {
+      MBKeyboardRow *row = row_item->data;
+
+      key_x = mb_kbd_col_spacing(kb);
+
+      max_row_key_height = 0;
+
+      mb_kbd_row_for_each_key(row, key_item)
+        {
+          int            key_w = 0, key_h = 0;
+          MBKeyboardKey *key = key_item->data;
+
+	  mb_kbd_key_set_extra_height_pad(key, 0);
+	  mb_kbd_key_set_extra_width_pad(key, 0);
+	  mb_kbd_key_set_geometry(key, 0, 0, 0, 0);
+
+	  if (!mb_kbd_is_extended(kb) && mb_kbd_key_get_extended(key))
+	    continue;
+
+	  mb_kbd_min_key_size(kb, key, &key_w, &key_h);
+
+	  if (!mb_kbd_key_get_req_uwidth(key)
+	      && key_w < kb->key_uwidth)
+	    key_w = kb->key_uwidth;
+
+          if (key_h < kb->key_uheight)
+            key_h = kb->key_uheight;
+
+	  key_y = 0;
+
+          key_w += 2 * ( mb_kbd_keys_border(kb)
+                         + mb_kbd_keys_margin(kb)
+                         + mb_kbd_keys_pad(kb) );
+
+          key_h += 2 * ( mb_kbd_keys_border(kb)
+                         + mb_kbd_keys_margin(kb)
+                         + mb_kbd_keys_pad(kb) );
+
+          if (key_h > max_row_key_height)
+            max_row_key_height = key_h;
+
+          mb_kbd_key_set_geometry(key, key_x, key_y, key_w, key_h);
+
+          key_x += (mb_kbd_col_spacing(kb) + key_w);
+        }
+
+      if (key_x > max_row_width) /* key_x now represents row width */
+	max_row_width = key_x;
+
+      mb_kbd_row_set_y(row, row_y);
+
+      row_y += max_row_key_height + mb_kbd_row_spacing(kb);
+
+      row_item = util_list_next(row_item);
+    }
+
+  *height = row_y;
+
+  row_item = mb_kbd_layout_rows(layout);
+
+  /* Now pass again allocating any extra space with have left over */
+
+  while (row_item != NULL)
+    {
+      MBKeyboardRow *row        = row_item->data;
+      int            n_fillers  = 0, free_space = 0;
+
+      mb_kbd_row_for_each_key(row,key_item)
+        {
+          if (!mb_kbd_is_extended(kb)
+              && mb_kbd_key_get_extended(key_item->data))
+            continue;
+
+          if (mb_kbd_key_get_fill(key_item->data)
+              || display_height <= 320
+              || display_width <= 320 )
+            n_fillers++;
+        }
+
+      if (!n_fillers)
+	goto next_row;
+
+      free_space = max_row_width - mb_kbd_row_width(row);
+
+      mb_kbd_distribute_fill(kb, row, free_space / n_fillers,
+                             display_height <= 320 || display_width <= 320);
+
+    next_row:
+      row_item = util_list_next(row_item);
+    }
+
+
+  /* Now center the rows */
+
+  row_item = mb_kbd_layout_rows(layout);
+
+  while (row_item != NULL)
+    {
+      MBKeyboardRow *row = row_item->data;
+
+      mb_kbd_row_set_x(row, (max_row_width - mb_kbd_row_width(row))/2);
+
+      row_item = util_list_next(row_item);
+    }
+
+  *width = max_row_width;
+}
+
+/*
+ * Scales the selected layout, as laid out by mb_kbd_allocate_layout() at
+ * base_width x base_height, to fill width x height.
+ */
+void
+mb_kbd_scale_layout(MBKeyboard *kbd,
+		    int         base_width,
+		    int         base_height,
+		    int         width,
+		    int         height)
+{
+  List      *row_item, *key_item;
+  int        n_rows;
+  long long  row_top, extra_row_height;
+
+  row_item = mb_kbd_layout_rows(mb_kbd_get_selected_layout(kbd));
+
+  /* an empty layout or page, or rows with no keys, have nothing to scale */
+  if ((n_rows = util_list_length(row_item)) == 0 || base_width <= 0)
+    return;
+
+  /*
+   * Every row gets an equal share of the extra height, every key a share
+   * of the extra width in proportion to its base width (plus the spacing
+   * after it). All of it is worked out in fixed point and only the edges
+   * are rounded, so neighbours always meet exactly and nothing is left
+   * over for another pass.
+   */
+  extra_row_height = (((long long)(height - base_height) << MB_KBD_FP_SHIFT)
+		      / n_rows);
+
+  row_top = (long long)mb_kbd_row_spacing(kbd) << MB_KBD_FP_SHIFT;
+
+  while (row_item != NULL)
+    {
+      MBKeyboardRow *row = row_item->data;
+      long long      spacing, scaled_width, fill_width = 0, fill = 0;
+      long long      units = 0, left, right;
+      int            row_base_width, row_base_height = 0, n_fillers = 0;
+      int            row_y, extra_key_height;
+
+      spacing        = (long long)mb_kbd_col_spacing(kbd) << MB_KBD_FP_SHIFT;
+      row_base_width = mb_kbd_row_base_width(row);
+      right          = spacing;
+
+      mb_kbd_row_for_each_key(row, key_item)
+	{
+	  MBKeyboardKey *key = key_item->data;
+	  int            key_base_height;
+
+	  if (!mb_kbd_is_extended(kbd) && mb_kbd_key_get_extended(key))
+	    continue;
+
+	  key_base_height = (mb_kbd_key_height(key)
+			     - mb_kbd_key_get_extra_height_pad(key));
+
+	  if (key_base_height > row_base_height)
+	    row_base_height = key_base_height;
+
+	  if (mb_kbd_key_get_fill(key))
+	    n_fillers++;
+	}
+
+      /* the row scales with the window; fill keys stretch it to full width */
+      scaled_width = (((long long)(row_base_width - mb_kbd_col_spacing(kbd))
+		       * width) << MB_KBD_FP_SHIFT) / base_width;
+
+      if (n_fillers)
+	fill_width = (((long long)width << MB_KBD_FP_SHIFT)
+		      - spacing - scaled_width) / n_fillers;
+
+      row_y            = MB_KBD_FP_ROUND(row_top);
+      extra_key_height = (MB_KBD_FP_ROUND(row_top
+					  + ((long long)row_base_height
+					     << MB_KBD_FP_SHIFT)
+					  + extra_row_height)
+			  - row_y - row_base_height);
+
+      mb_kbd_row_for_each_key(row, key_item)
+	{
+	  MBKeyboardKey *key = key_item->data;
+	  int            key_base_width, key_x;
+
+	  if (!mb_kbd_is_extended(kbd) && mb_kbd_key_get_extended(key))
+	    continue;
+
+	  key_base_width = (mb_kbd_key_width(key)
+			    - mb_kbd_key_get_extra_width_pad(key));
+
+	  left = spacing + fill
+	    + ((units * width) << MB_KBD_FP_SHIFT) / base_width;
+
+	  units += key_base_width + mb_kbd_col_spacing(kbd);
+
+	  if (mb_kbd_key_get_fill(key))
+	    fill += fill_width;
+
+	  right = spacing + fill
+	    + ((units * width) << MB_KBD_FP_SHIFT) / base_width;
+
+	  /* right is where the next key starts, after our spacing */
+	  key_x = MB_KBD_FP_ROUND(left);
+
+	  mb_kbd_key_set_extra_width_pad (key,
+					  MB_KBD_FP_ROUND(right - spacing)
+					  - key_x - key_base_width);
+	  mb_kbd_key_set_extra_height_pad (key, extra_key_height);
+
+	  mb_kbd_key_set_geometry(key, key_x, -1, -1, -1);
+	}
+
+      /* center row */
+
+      mb_kbd_row_set_x(row, (width - MB_KBD_FP_ROUND(right)) / 2);
+
+      /* and position down */
+
+      mb_kbd_row_set_y(row, row_y);
+
+      row_top += (((long long)(row_base_height + mb_kbd_row_spacing(kbd))
+		   << MB_KBD_FP_SHIFT)
+		  + extra_row_height);
+
+      row_item = util_list_next(row_item);
+    }
+}
+
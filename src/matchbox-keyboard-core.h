@@ -0,0 +1,730 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Authored By Matthew Allum <mallum@o-hand.com>
+ *              Tomas Frydrych <tomas@sleepfive.com>
+ *
+ *  Copyright (c) 2005-2012 Intel Corp
+ *  Copyright (c) 2012 Vernier Software & Technology
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * The keyboard core: the model, config loading, layout, hit testing and
+ * the key press state machine. None of it needs a display; whatever shows
+ * the keyboard plugs in through an MBKeyboardFrontend. The only X headers
+ * used are the protocol ones, for keysym values.
+ */
+
+#ifndef HAVE_MB_KEYBOARD_CORE_H
+#define HAVE_MB_KEYBOARD_CORE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <locale.h>
+
+#include <expat.h>
+
+#include <X11/X.h>
+#include <X11/keysym.h>
+
+#if (WANT_DEBUG)
+#define DBG(x, a...) \
+ fprintf (stderr,  __FILE__ ":%d,%s() " x "\n", __LINE__, __func__, ##a)
+#else
+#define DBG(x, a...) do {} while (0)
+#endif
+
+#define MARK() DBG("mark")
+
+#ifndef True
+#define True  1
+#define False 0
+#endif
+
+typedef void*         pointer;
+typedef unsigned char uchar ;
+typedef int           boolean ;
+
+typedef struct Pixbuf Pixbuf;
+typedef struct List List;
+
+typedef void (*ListForEachCB) (void *data, void *userdata);
+
+struct List
+{
+  List *next, *prev;
+  void *data;
+};
+
+#ifndef _LIBMATCHBOX_KEYBOARD_H
+typedef struct MBKeyboard MBKeyboard;
+#endif
+
+typedef struct MBKeyboardLayout MBKeyboardLayout;
+typedef struct MBKeyboardRow    MBKeyboardRow;
+typedef struct MBKeyboardKey    MBKeyboardKey;
+typedef struct MBKeyboardUI     MBKeyboardUI;
+typedef struct MBKeyboardPopup  MBKeyboardPopup;
+
+typedef struct MBKeyboardImage  MBKeyboardImage;
+typedef struct MBKeyboardImageAtlas MBKeyboardImageAtlas;
+typedef struct MBKeyboardFrontend MBKeyboardFrontend;
+typedef struct MBKeyboardConfigInclude MBKeyboardConfigInclude;
+
+typedef enum
+{
+  MBKeyboardKeyActionNone  = 0,
+  MBKeyboardKeyActionGlyph,
+  MBKeyboardKeyActionXKeySym, 	/* 'specials' be converted into this */
+  MBKeyboardKeyActionModifier,
+
+} MBKeyboardKeyActionType;
+
+typedef enum
+{
+  MBKeyboardKeyModUnknown,
+  MBKeyboardKeyModShift,
+  MBKeyboardKeyModMod1,
+  MBKeyboardKeyModMod2,
+  MBKeyboardKeyModMod3,
+  MBKeyboardKeyModCaps,
+  MBKeyboardKeyModControl,
+  MBKeyboardKeyModAlt,
+  MBKeyboardKeyModLayout
+
+} MBKeyboardKeyModType;
+
+typedef enum
+{
+  MBKeyboardKeyFaceNone  = 0,
+  MBKeyboardKeyFaceGlyph = 1,
+  MBKeyboardKeyFaceImage = 2,
+
+} MBKeyboardKeyFaceType;
+
+typedef enum
+{
+  MBKeyboardKeyStateNormal = 0,
+  MBKeyboardKeyStateShifted,
+  MBKeyboardKeyStateCaps,
+  MBKeyboardKeyStateMod1,
+  MBKeyboardKeyStateMod2,
+  MBKeyboardKeyStateMod3,
+  N_MBKeyboardKeyStateTypes
+}
+MBKeyboardKeyStateType;
+
+typedef enum
+{
+  MBKeyboardStateNormal = 0,
+  MBKeyboardStateShifted = (1<<1),
+  MBKeyboardStateMod1    = (1<<2),
+  MBKeyboardStateMod2    = (1<<3),
+  MBKeyboardStateMod3    = (1<<4),
+  MBKeyboardStateCaps    = (1<<5),
+  MBKeyboardStateControl = (1<<6),
+  MBKeyboardStateAlt     = (1<<7),
+  N_MBKeyboardStateTypes
+}
+MBKeyboardStateType;
+
+struct MBKeyboard
+{
+  boolean                is_widget;
+  char                  *font_family;
+  int                    font_pt_size;
+  char                  *font_variant;
+  char                  *config_file;
+  List                  *config_includes; /* MBKeyboardConfigInclude's */
+  char                  *config_variant, *config_lang; /* as loaded with */
+  int                    watch_fd;        /* -1 unless watching, see --watch */
+  List                  *watch_dirs;
+  List                  *layouts;
+  MBKeyboardLayout      *selected_layout;
+  int                    key_border, key_pad, key_margin;
+  int                    row_spacing, col_spacing;
+  int                    req_x, req_y;
+  int                    req_width, req_height;
+  boolean                extended; /* are we showing extended keys ? */
+  MBKeyboardKey         *held_key;
+  MBKeyboardStateType    keys_state;
+  int                    key_uwidth, key_uheight; /* from the last layout */
+  const MBKeyboardFrontend *frontend;
+  void                  *frontend_data;
+};
+
+/**** Frontend ****/
+
+/*
+ * Everything the core needs from whatever shows the keyboard. Any of the
+ * hooks may be NULL; without text_extents labels take no space, without
+ * image_new image faces are left out. Modifiers passed to the send hooks
+ * are MBKeyboardStateShifted, Control, Alt and Mod1 bits.
+ */
+struct MBKeyboardFrontend
+{
+  void  (*text_extents) (MBKeyboard *kbd,
+			 const char *str,
+			 int        *width,
+			 int        *height);
+  KeySym (*lookup_keysym) (MBKeyboard *kbd, const char *name);
+  MBKeyboardImage* (*image_new) (MBKeyboard *kbd, const char *path);
+  void  (*image_size) (MBKeyboardImage *img, int *width, int *height);
+  void  (*image_destroy) (MBKeyboardImage *img);
+  void  (*send_press) (MBKeyboard *kbd, const char *utf8_char, int modifiers);
+  void  (*send_keysym_press) (MBKeyboard *kbd, KeySym ks, int modifiers);
+  void  (*send_release) (MBKeyboard *kbd);
+  void  (*redraw) (MBKeyboard *kbd);
+  void  (*redraw_key) (MBKeyboard *kbd, MBKeyboardKey *key);
+  void  (*layout_changed) (MBKeyboard *kbd);
+  void  (*config_reloaded) (MBKeyboard *kbd, boolean relayout);
+};
+
+MBKeyboard*
+mb_kbd_core_new (const MBKeyboardFrontend *frontend, void *data);
+
+void
+mb_kbd_core_destroy (MBKeyboard *kb);
+
+void
+mb_kbd_set_frontend (MBKeyboard               *kb,
+		     const MBKeyboardFrontend *frontend,
+		     void                     *data);
+
+void*
+mb_kbd_frontend_data (MBKeyboard *kb);
+
+boolean
+mb_kbd_load (MBKeyboard *kb, char *variant, char *lang);
+
+void
+mb_kbd_allocate_layout (MBKeyboard *kb,
+			int         display_width,
+			int         display_height,
+			int        *width,
+			int        *height);
+
+void
+mb_kbd_scale_layout (MBKeyboard *kb,
+		     int         base_width,
+		     int         base_height,
+		     int         width,
+		     int         height);
+
+void
+mb_kbd_send_press (MBKeyboard *kb, const char *utf8_char, int modifiers);
+
+void
+mb_kbd_send_keysym_press (MBKeyboard *kb, KeySym ks, int modifiers);
+
+void
+mb_kbd_send_release (MBKeyboard *kb);
+
+/**** Keyboard ****/
+
+int
+mb_kbd_row_spacing(MBKeyboard *kb);
+
+int
+mb_kbd_col_spacing(MBKeyboard *kb);
+
+int
+mb_kbd_keys_border(MBKeyboard *kb);
+
+int
+mb_kbd_keys_pad(MBKeyboard *kb);
+
+int
+mb_kbd_keys_margin(MBKeyboard *kb);
+
+void
+mb_kbd_add_state(MBKeyboard *kbd, MBKeyboardStateType state);
+
+void
+mb_kbd_toggle_state(MBKeyboard *kbd, MBKeyboardStateType state);
+
+boolean
+mb_kbd_has_state(MBKeyboard *kbd, MBKeyboardStateType state);
+
+boolean
+mb_kbd_has_any_state(MBKeyboard *kbd);
+
+void
+mb_kbd_remove_state(MBKeyboard *kbd, MBKeyboardStateType state);
+
+MBKeyboardKeyStateType
+mb_kbd_keys_current_state(MBKeyboard *kbd);
+
+void
+mb_kbd_set_extended(MBKeyboard *kb, boolean extend);
+
+boolean
+mb_kbd_is_extended(MBKeyboard *kb);
+
+void
+mb_kbd_add_layout(MBKeyboard *kb, MBKeyboardLayout *layout);
+
+MBKeyboardLayout*
+mb_kbd_get_selected_layout(MBKeyboard *kb);
+
+MBKeyboardLayout*
+mb_kbd_find_layout(MBKeyboard *kb, const char *id);
+
+void
+mb_kbd_select_layout(MBKeyboard *kb, MBKeyboardLayout *layout);
+
+void
+mb_kbd_select_next_layout(MBKeyboard *kb);
+
+MBKeyboardKey*
+mb_kbd_locate_key(MBKeyboard *kb, int x, int y);
+
+void
+mb_kbd_layout_unit_key_size(MBKeyboard       *kb,
+			    MBKeyboardLayout *layout,
+			    boolean           extended,
+			    int              *width,
+			    int              *height);
+
+void
+mb_kbd_set_held_key(MBKeyboard *kb, MBKeyboardKey *key);
+
+MBKeyboardKey *
+mb_kbd_get_held_key(MBKeyboard *kb);
+
+void
+mb_kbd_redraw(MBKeyboard *kb);
+
+void
+mb_kbd_redraw_key(MBKeyboard *kb, MBKeyboardKey *key);
+
+/**** Layout ****/
+
+MBKeyboardLayout*
+mb_kbd_layout_new(MBKeyboard *kbd, const char *id);
+
+void
+mb_kbd_layout_destroy (MBKeyboardLayout *layout);
+
+void
+mb_kbd_layout_append_row(MBKeyboardLayout *layout,
+			 MBKeyboardRow    *row);
+
+const char*
+mb_kbd_layout_id(MBKeyboardLayout *layout);
+
+List*
+mb_kbd_layout_rows(MBKeyboardLayout *layout);
+
+void
+mb_kbd_layout_set_page_rows(MBKeyboardLayout *layout, int rows);
+
+int
+mb_kbd_layout_page_rows(MBKeyboardLayout *layout);
+
+MBKeyboardLayout*
+mb_kbd_layout_append_page(MBKeyboardLayout *layout);
+
+MBKeyboardLayout*
+mb_kbd_layout_parent(MBKeyboardLayout *layout);
+
+List*
+mb_kbd_layout_pages(MBKeyboardLayout *layout);
+
+
+/**** Rows ******/
+
+MBKeyboardRow*
+mb_kbd_row_new(MBKeyboard *kbd);
+
+void
+mb_kbd_row_destroy (MBKeyboardRow *row);
+
+void
+mb_kbd_row_set_x(MBKeyboardRow *row, int x);
+
+void
+mb_kbd_row_set_y(MBKeyboardRow *row, int y);
+
+int
+mb_kbd_row_x (MBKeyboardRow *row) ;
+
+int
+mb_kbd_row_y(MBKeyboardRow *row) ;
+
+int
+mb_kbd_row_height(MBKeyboardRow *row);
+
+int
+mb_kbd_row_width(MBKeyboardRow *row);
+
+int
+mb_kbd_row_base_width(MBKeyboardRow *row);
+
+void
+mb_kbd_row_save_base_geometry(MBKeyboardRow *row, boolean extended);
+
+void
+mb_kbd_row_restore_base_geometry(MBKeyboardRow *row, boolean extended);
+
+void
+mb_kbd_row_get_base_position(MBKeyboardRow *row, boolean extended,
+			     int *x, int *y);
+
+void
+mb_kbd_row_set_base_position(MBKeyboardRow *row, boolean extended,
+			     int x, int y);
+
+void
+mb_kbd_row_append_key(MBKeyboardRow *row, MBKeyboardKey *key);
+
+List*
+mb_kdb_row_keys(MBKeyboardRow *row);
+
+#define mb_kbd_row_for_each_key(r,k)            \
+      for ((k) = mb_kdb_row_keys((r));          \
+	   (k) != NULL;                         \
+	   (k) = util_list_next((k)))
+
+
+/**** Keys ******/
+
+MBKeyboardKey*
+mb_kbd_key_new(MBKeyboard *kbd);
+
+void
+mb_kbd_key_destroy (MBKeyboardKey *key);
+
+void
+mb_kbd_key_set_obey_caps(MBKeyboardKey  *key, boolean obey);
+
+boolean
+mb_kbd_key_get_obey_caps(MBKeyboardKey  *key);
+
+void
+mb_kbd_key_set_req_uwidth(MBKeyboardKey  *key, int uwidth);
+
+int
+mb_kbd_key_get_req_uwidth(MBKeyboardKey  *key);
+
+void
+mb_kbd_key_set_fill(MBKeyboardKey  *key, boolean fill);
+
+boolean
+mb_kbd_key_get_fill(MBKeyboardKey  *key);
+
+void
+mb_kbd_key_set_blank(MBKeyboardKey  *key, boolean blank);
+
+boolean
+mb_kbd_key_is_blank(MBKeyboardKey  *key);
+
+void
+mb_kbd_key_set_row(MBKeyboardKey *key, MBKeyboardRow *row);
+
+void
+mb_kbd_key_set_geometry(MBKeyboardKey  *key,
+			int x,
+			int y,
+			int width,
+			int height);
+int
+mb_kbd_key_abs_x(MBKeyboardKey *key) ;
+
+int
+mb_kbd_key_abs_y(MBKeyboardKey *key) ;
+
+int
+mb_kbd_key_x(MBKeyboardKey *key) ;
+
+int
+mb_kbd_key_y(MBKeyboardKey *key);
+
+int
+mb_kbd_key_width(MBKeyboardKey *key) ;
+
+int
+mb_kbd_key_height(MBKeyboardKey *key);
+
+void
+mb_kbd_key_set_extended(MBKeyboardKey  *key, boolean extend);
+
+boolean
+mb_kbd_key_get_extended(MBKeyboardKey  *key);
+
+void
+mb_kbd_key_set_extra_width_pad(MBKeyboardKey  *key, int pad);
+
+void
+mb_kbd_key_set_extra_height_pad(MBKeyboardKey  *key, int pad);
+
+int
+mb_kbd_key_get_extra_height_pad(MBKeyboardKey  *key);
+
+int
+mb_kbd_key_get_extra_width_pad(MBKeyboardKey  *key);
+
+void
+mb_kbd_key_save_base_geometry(MBKeyboardKey *key, boolean extended);
+
+void
+mb_kbd_key_restore_base_geometry(MBKeyboardKey *key, boolean extended);
+
+void
+mb_kbd_key_get_base_geometry(MBKeyboardKey *key, boolean extended, int *geom);
+
+void
+mb_kbd_key_set_base_geometry(MBKeyboardKey *key, boolean extended,
+			     const int *geom);
+
+boolean
+mb_kdb_key_has_state(MBKeyboardKey           *key,
+		     MBKeyboardKeyStateType   state);
+
+void
+mb_kbd_key_set_glyph_face(MBKeyboardKey           *key,
+			  MBKeyboardKeyStateType   state,
+			  const  char             *glyph);
+
+const char*
+mb_kbd_key_get_glyph_face(MBKeyboardKey           *key,
+			  MBKeyboardKeyStateType   state);
+
+void
+mb_kbd_key_set_image_face(MBKeyboardKey           *key,
+			  MBKeyboardKeyStateType   state,
+			  MBKeyboardImage         *image);
+
+MBKeyboardImage*
+mb_kbd_key_get_image_face(MBKeyboardKey           *key,
+			  MBKeyboardKeyStateType   state);
+
+
+MBKeyboardKeyFaceType
+mb_kbd_key_get_face_type(MBKeyboardKey           *key,
+			 MBKeyboardKeyStateType   state);
+
+void
+mb_kbd_key_set_char_action(MBKeyboardKey           *key,
+			   MBKeyboardKeyStateType   state,
+			   const char              *glyphs);
+
+void
+mb_kbd_key_set_keysym_action(MBKeyboardKey           *key,
+			     MBKeyboardKeyStateType   state,
+			     KeySym                   keysym);
+
+const char*
+mb_kbd_key_get_char_action(MBKeyboardKey           *key,
+			   MBKeyboardKeyStateType   state);
+
+KeySym
+mb_kbd_key_get_keysym_action(MBKeyboardKey           *key,
+			     MBKeyboardKeyStateType   state);
+
+void
+mb_kbd_key_set_modifer_action(MBKeyboardKey          *key,
+			      MBKeyboardKeyStateType  state,
+			      MBKeyboardKeyModType    type);
+
+MBKeyboardKeyModType
+mb_kbd_key_get_modifer_action(MBKeyboardKey          *key,
+			      MBKeyboardKeyStateType  state);
+
+void
+mb_kbd_key_set_layout_action(MBKeyboardKey          *key,
+			     MBKeyboardKeyStateType  state,
+			     const char             *layout_id);
+
+const char*
+mb_kbd_key_get_layout_action(MBKeyboardKey          *key,
+			     MBKeyboardKeyStateType  state);
+
+MBKeyboardKeyActionType
+mb_kbd_key_get_action_type(MBKeyboardKey           *key,
+			   MBKeyboardKeyStateType   state);
+
+boolean
+mb_kbd_key_is_held(MBKeyboard *kbd, MBKeyboardKey *key);
+
+void
+mb_kbd_key_press(MBKeyboardKey *key);
+
+void
+mb_kbd_key_release(MBKeyboard *kbd, boolean cancel);
+
+boolean
+mb_kbd_key_states_equal(MBKeyboardKey *a, MBKeyboardKey *b);
+
+void
+mb_kbd_key_swap_states(MBKeyboardKey *a, MBKeyboardKey *b);
+
+void
+mb_kbd_key_dump_key(MBKeyboardKey *key);
+
+#define mb_kdb_key_foreach_state(k,s)                     \
+       for((s)=0; (s) < N_MBKeyboardKeyStateTypes; (s)++) \
+            if (mb_kdb_key_has_state((k), (s)))
+
+/*** Config *****/
+
+/* a file pulled in with <include>, as found when the config was parsed */
+struct MBKeyboardConfigInclude
+{
+  char    *name;
+  char    *path;
+  boolean  autolocale; /* the auto-locale attribute, lang overrides it */
+};
+
+int
+mb_kbd_config_load(MBKeyboard *kbd, char *varient, char *lang);
+
+boolean
+mb_kbd_config_find_file(const char *basename,
+			char       *variant,
+			char       *lang,
+			int         autolocale,
+			char       *path,
+			int         path_len);
+
+char*
+mb_kbd_config_compiled_path(const char *config_path);
+
+boolean
+mb_kbd_config_load_compiled(MBKeyboard *kbd,
+			    const char *config_path,
+			    char       *lang);
+
+boolean
+mb_kbd_config_save_compiled(MBKeyboard  *kbd,
+			    const char  *path,
+			    const char* (*image_path) (MBKeyboardImage *img));
+
+void
+mb_kbd_config_forget(void);
+
+/* a file built into the binary, see config-embedded.c */
+typedef struct MBKeyboardEmbeddedFile
+{
+  const char          *name;
+  const unsigned char *data;
+  unsigned int         size;
+}
+MBKeyboardEmbeddedFile;
+
+const unsigned char*
+mb_kbd_embedded_file(const char *path, int *size);
+
+#ifdef WANT_FUZZING
+void
+mb_kbd_embedded_set_files(const MBKeyboardEmbeddedFile *files);
+#endif
+
+boolean
+mb_kbd_embedded_have_files(void);
+
+boolean
+mb_kbd_config_reload(MBKeyboard *kbd);
+
+boolean
+mb_kbd_config_watch(MBKeyboard *kbd);
+
+void
+mb_kbd_config_watch_process(MBKeyboard *kbd);
+
+void
+mb_kbd_config_unwatch(MBKeyboard *kbd);
+
+
+/**** Util *****/
+
+#define streq(a,b)      (strcmp(a,b) == 0)
+#define strcaseeq(a,b)  (strcasecmp(a,b) == 0)
+#define unless(x)       if (!(x))
+#define util_abs(x)     ((x) > 0) ? (x) : -1*(x)
+
+void*
+util_malloc0(int size);
+
+void
+util_fatal_error(char *msg);
+
+int
+util_utf8_char_cnt(const char *str);
+
+boolean
+util_file_readable(char *path);
+
+unsigned int
+util_hash_update(unsigned int h, const void *data, int len);
+
+unsigned int
+util_str_hash(const char *str);
+
+/* Util list */
+
+#define util_list_next(l) (l)->next
+#define util_list_previous(l) (l)->prev
+
+List*
+util_list_alloc_item(void);
+
+int
+util_list_length(List *list);
+
+List*
+util_list_get_last(List *list);
+
+List*
+util_list_get_first(List *list);
+
+void*
+util_list_get_nth_data(List *list, int n);
+
+List*
+util_list_append(List *list, void *data);
+
+List*
+util_list_remove(List *list, void *data);
+
+void
+util_list_foreach(List *list, ListForEachCB func, void *userdata);
+
+/*** Geometry cache ***/
+
+int*
+mb_kbd_cache_load (MBKeyboard *kbd,
+		   const char *layout_id,
+		   unsigned int hash,
+		   int         n_ints);
+
+void
+mb_kbd_cache_save (MBKeyboard *kbd,
+		   const char *layout_id,
+		   unsigned int hash,
+		   const int  *data,
+		   int         n_ints);
+
+#endif
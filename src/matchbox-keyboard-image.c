@@ -18,22 +18,205 @@
 
 
 #include "matchbox-keyboard.h"
+
+#ifndef WANT_CAIRO
 #include <X11/extensions/Xrender.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#define MB_KBD_IMAGE_MAX_THREADS 4
+#define MB_KBD_IMAGE_MAX_SCALE   3
 
+/*
+ * Images are shared; every key face referencing the same file gets the
+ * same MBKeyboardImage, looked up by path in the keyboard's image cache.
+ * The image is freed when the last face referencing it is destroyed.
+ *
+ * Creating an image only reads its size; the pixels are decoded the first
+ * time the image is actually drawn.
+ *
+ * For bigger keyboards an image can have pre-scaled variants, either from
+ * 'name@2x.png' style files or downscaled once from a larger one. Variants
+ * are images in their own right, keyed by their '@Nx' path.
+ */
 struct MBKeyboardImage
 {
   MBKeyboard            *kbd;
+  char                  *path;
+  char                  *source;      /* file to decode, if not path */
+  int                    refcount;
+  int                    width, height;
+  MBKeyboardImage       *scaled[MB_KBD_IMAGE_MAX_SCALE + 1];
+  boolean                loaded;      /* pixels decoded (or failed to) */
+  boolean                failed;
+  boolean                queued;      /* picked up by the current prefetch */
+#ifdef WANT_CAIRO
+  cairo_surface_t       *surface;
+#else
+  unsigned char         *data;        /* decoded by prefetch, not uploaded */
+  int                    atlas_x, atlas_y;
+  boolean                in_atlas;
+#endif
+};
+
+#ifndef WANT_CAIRO
+/*
+ * All image faces live in one server side picture, and are drawn with
+ * sub-rectangle composites from it.
+ */
+#define MB_KBD_IMAGE_ATLAS_WIDTH 256
+
+struct MBKeyboardImageAtlas
+{
   int                    width, height;
   Pixmap                 xdraw;
   Picture                xpic;
+  GC                     gc;
+  boolean                dirty;       /* holds images not yet packed */
 };
+#endif
+
+static MBKeyboardImage*
+mb_kbd_image_cache_lookup (MBKeyboard *kbd, const char *filename)
+{
+  List *l;
+
+  for (l = mb_kbd_x(kbd)->images; l != NULL; l = util_list_next(l))
+    {
+      MBKeyboardImage *img = l->data;
+
+      if (streq(img->path, filename))
+	return img;
+    }
+
+  return NULL;
+}
+
+static void
+mb_kbd_image_cache_add (MBKeyboard *kbd, MBKeyboardImage *img)
+{
+  MBKeyboardX *x = mb_kbd_x(kbd);
+
+  x->images = util_list_append(x->images, (pointer)img);
+}
+
+static void
+mb_kbd_image_cache_remove (MBKeyboard *kbd, MBKeyboardImage *img)
+{
+  MBKeyboardX *x = mb_kbd_x(kbd);
+
+  x->images = util_list_remove(x->images, (pointer)img);
+
+  if (img->loaded && !img->failed)
+    x->image_bytes -= img->width * img->height * 4;
+}
+
+static void
+mb_kbd_image_set_loaded (MBKeyboardImage *img, boolean ok)
+{
+  MBKeyboard *kbd = img->kbd;
+
+  img->loaded = True;
+  img->failed = !ok;
+
+  if (img->failed)
+    {
+      fprintf(stderr, "matchbox-keyboard: Failed to load '%s'\n", img->path);
+      return;
+    }
+
+  mb_kbd_x(kbd)->image_bytes += img->width * img->height * 4;
+
+  DBG("loaded '%s' (%ix%i), %i bytes resident",
+      img->path, img->width, img->height, mb_kbd_x(kbd)->image_bytes);
+}
+
+/*
+ * PNG requires IHDR to be the first chunk, so the size can be read
+ * straight out of the first 24 bytes without touching libpng.
+ */
+static const unsigned char png_signature[8] =
+  { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static boolean
+png_file_size (const char *file, int *width, int *height)
+{
+  const unsigned char *data;
+  FILE                *fd;
+  unsigned char        header[24];
+  boolean              ok;
+  int                  size;
+
+  if ((data = mb_kbd_embedded_file(file, &size)) != NULL)
+    {
+      if (size < 24)
+	return False;
+
+      memcpy(header, data, 24);
+    }
+  else
+    {
+      if ((fd = fopen(file, "rb")) == NULL)
+	return False;
+
+      ok = (fread(header, 1, 24, fd) == 24);
+
+      fclose(fd);
+
+      if (!ok)
+	return False;
+    }
+
+  ok = (memcmp(header, png_signature, 8) == 0
+	&& memcmp(header + 12, "IHDR", 4) == 0);
+
+  if (!ok)
+    return False;
+
+  *width  = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+  *height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+
+  return (*width > 0 && *height > 0);
+}
+
+static const char*
+mb_kbd_image_source (MBKeyboardImage *img)
+{
+  return img->source ? img->source : img->path;
+}
+
+/* a built in image being decoded, see mb_kbd_embedded_file() */
+typedef struct PngMemory
+{
+  const unsigned char *data;
+  int                  size, pos;
+}
+PngMemory;
+
+#ifndef WANT_CAIRO
+
+static void
+png_memory_read (png_structp png_ptr, png_bytep out, png_size_t len)
+{
+  PngMemory *mem = png_get_io_ptr(png_ptr);
+
+  if (len > (png_size_t)(mem->size - mem->pos))
+    png_error(png_ptr, "truncated");
+
+  memcpy(out, mem->data + mem->pos, len);
+  mem->pos += len;
+}
 
 static unsigned char* 
 png_file_load (const char *file, 
 	       int        *width, 
 	       int        *height)
 {
-  FILE *fd;
+  FILE *fd = NULL;
+  PngMemory mem;
   unsigned char *data;
   unsigned char header[8];
   int  bit_depth, color_type;
@@ -43,35 +226,50 @@ png_file_load (const char *file,
   png_infop info_ptr;
   png_bytep *row_pointers;
 
-  if ((fd = fopen( file, "rb" )) == NULL) return NULL;
+  if ((mem.data = mb_kbd_embedded_file(file, &mem.size)) != NULL)
+    {
+      if (mem.size < 8)
+	return NULL;
+
+      memcpy(header, mem.data, 8);
+      mem.pos = 8;
+    }
+  else
+    {
+      if ((fd = fopen( file, "rb" )) == NULL) return NULL;
+
+      fread( header, 1, 8, fd );
+    }
 
-  fread( header, 1, 8, fd );
   if ( ! png_check_sig( header, 8 ) ) 
     {
-      fclose(fd);
+      if (fd) fclose(fd);
       return NULL;
     }
 
   png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if ( ! png_ptr ) {
-    fclose(fd);
+    if (fd) fclose(fd);
     return NULL;
   }
 
   info_ptr = png_create_info_struct(png_ptr);
   if ( ! info_ptr ) {
     png_destroy_read_struct( &png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-    fclose(fd);
+    if (fd) fclose(fd);
     return NULL;
   }
 
   if (setjmp (png_jmpbuf (png_ptr))) {
     png_destroy_read_struct( &png_ptr, &info_ptr, NULL);
-    fclose(fd);
+    if (fd) fclose(fd);
     return NULL;
   }
 
-  png_init_io( png_ptr, fd );
+  if (fd)
+    png_init_io( png_ptr, fd );
+  else
+    png_set_read_fn( png_ptr, &mem, png_memory_read );
   png_set_sig_bytes( png_ptr, 8);
   png_read_info( png_ptr, info_ptr);
   png_get_IHDR( png_ptr, info_ptr, &png_width, &png_height, &bit_depth, 
@@ -120,71 +318,136 @@ png_file_load (const char *file,
 
   free(row_pointers);
   png_destroy_read_struct( &png_ptr, &info_ptr, NULL);
-  fclose(fd);
+  if (fd) fclose(fd);
 
   return data;
 }
 
-MBKeyboardImage*
-mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
+static void
+mb_kbd_image_free_resources (MBKeyboardImage *img)
 {
-  MBKeyboardUI            *ui;
-  MBKeyboardImage         *img;
-  unsigned char           *data, *p;
-  int                      width, height, x, y;
-  XRenderPictFormat       *ren_fmt;
-  XRenderPictureAttributes ren_attr;
-  GC                       gc;
-  XImage                  *ximg;
+  /* Our space in the atlas simply goes unused until the next rebuild */
+  if (img->data)
+    free(img->data);
+}
+
+/* Box filter, RGBA in and out; only ever shrinks */
+static unsigned char*
+rgba_downscale (unsigned char *src, int sw, int sh, int dw, int dh)
+{
+  unsigned char *dst, *p;
+  int            x, y, sx, sy, c;
 
-  ui = kbd->ui;
-  
-  data = png_file_load (filename, &width, &height);
+  p = dst = malloc(dw * dh * 4);
 
-  if (data == NULL || width == 0 || height == 0)
+  for (y = 0; y < dh; y++)
     {
-      if (data) free(data);
-      return NULL;
+      int y0 = (y * sh) / dh, y1 = ((y + 1) * sh) / dh;
+
+      for (x = 0; x < dw; x++)
+	{
+	  int          x0 = (x * sw) / dw, x1 = ((x + 1) * sw) / dw;
+	  unsigned int sum[4] = { 0, 0, 0, 0 }, n = (x1 - x0) * (y1 - y0);
+
+	  for (sy = y0; sy < y1; sy++)
+	    for (sx = x0; sx < x1; sx++)
+	      for (c = 0; c < 4; c++)
+		sum[c] += src[(sy * sw + sx) * 4 + c];
+
+	  for (c = 0; c < 4; c++)
+	    *p++ = sum[c] / n;
+	}
     }
 
-  img = util_malloc0(sizeof(MBKeyboardImage));
+  return dst;
+}
 
-  img->width  = width;
-  img->height = height;
+/* Centres src in a transparent dw x dh image, cropping what sticks out */
+static unsigned char*
+rgba_fit (unsigned char *src, int sw, int sh, int dw, int dh)
+{
+  unsigned char *dst;
+  int            w = (sw < dw) ? sw : dw, h = (sh < dh) ? sh : dh, y;
+  int            sx = (sw - w) / 2, sy = (sh - h) / 2;
+  int            dx = (dw - w) / 2, dy = (dh - h) / 2;
 
-  ren_fmt = XRenderFindStandardFormat(mb_kbd_ui_x_display(ui), 
-				      PictStandardARGB32);
-  img->xdraw = XCreatePixmap(mb_kbd_ui_x_display(ui), 
-			     mb_kbd_ui_x_win_root(ui),
-			     width, height, 
-			     ren_fmt->depth);
+  dst = calloc(dw * dh, 4);
 
-  XSync(mb_kbd_ui_x_display(ui), False);
+  for (y = 0; y < h; y++)
+    memcpy(dst + ((dy + y) * dw + dx) * 4,
+	   src + ((sy + y) * sw + sx) * 4, w * 4);
 
-  ren_attr.dither          = True;
-  ren_attr.component_alpha = True;
-  ren_attr.repeat          = False;
+  return dst;
+}
+
+/*
+ * No X calls or shared state in here; it runs on the prefetch threads.
+ */
+static void
+mb_kbd_image_decode (MBKeyboardImage *img)
+{
+  unsigned char *data;
+  int            width, height;
+
+  data = png_file_load (mb_kbd_image_source (img), &width, &height);
+
+  if (data && (width != img->width || height != img->height))
+    {
+      if (width > img->width && height > img->height)
+	img->data = rgba_downscale (data, width, height,
+				    img->width, img->height);
+      else
+	{
+	  /* the file changed under us; keep its pixels in the slot we have */
+	  fprintf(stderr, "matchbox-keyboard: '%s' is %ix%i, expected %ix%i\n",
+		  mb_kbd_image_source (img), width, height,
+		  img->width, img->height);
+	  img->data = rgba_fit (data, width, height, img->width, img->height);
+	}
+      free(data);
+      return;
+    }
+
+  img->data = data;
+}
+
+/*
+ * Decodes the image, unless prefetch already did, and puts it into its
+ * (already reserved) atlas slot.
+ */
+static void
+mb_kbd_image_upload (MBKeyboardImage *img)
+{
+  MBKeyboardUI         *ui    = mb_kbd_get_ui(img->kbd);
+  MBKeyboardImageAtlas *atlas = mb_kbd_x(img->kbd)->image_atlas;
+  Display              *xdpy  = mb_kbd_ui_x_display(ui);
+  unsigned char        *data, *p;
+  int                   width = img->width, height = img->height, x, y;
+  XImage               *ximg;
+
+  if (img->data == NULL)
+    mb_kbd_image_decode (img);
+
+  data      = img->data;
+  img->data = NULL;
 
-  img->xpic = XRenderCreatePicture(mb_kbd_ui_x_display(ui), 
-				   img->xdraw, 
-				   ren_fmt, 
-				   CPRepeat|CPDither|CPComponentAlpha, 
-				   &ren_attr);
-
-  gc = XCreateGC(mb_kbd_ui_x_display(ui), img->xdraw, 0, NULL);
-
-  ximg = XCreateImage(mb_kbd_ui_x_display(ui), 
-		      DefaultVisual(mb_kbd_ui_x_display(ui), 
-				    mb_kbd_ui_x_screen(ui)), 
-		      ren_fmt->depth, 
-		      ZPixmap, 
-		      0, 
-		      NULL, 
-		      width, 
-		      height, 
-		      32, 
+  if (data == NULL)
+    {
+      mb_kbd_image_set_loaded (img, False);
+      return;
+    }
+
+  ximg = XCreateImage(xdpy,
+		      DefaultVisual(xdpy, mb_kbd_ui_x_screen(ui)),
+		      32,
+		      ZPixmap,
+		      0,
+		      NULL,
+		      width,
+		      height,
+		      32,
 		      0);
-  
+
   ximg->data = malloc(ximg->bytes_per_line * ximg->height);
 
   p = data;
@@ -193,29 +456,591 @@ mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
     for (x = 0; x < width; x++)
       {
 	unsigned char a, r, g, b;
-	r = *p++; g = *p++; b = *p++; a = *p++; 
+	r = *p++; g = *p++; b = *p++; a = *p++;
 	r = (r * (a + 1)) / 256; /* premult */
 	g = (g * (a + 1)) / 256;
 	b = (b * (a + 1)) / 256;
 	XPutPixel(ximg, x, y, (a << 24) | (r << 16) | (g << 8) | b);
       }
 
-  XPutImage(mb_kbd_ui_x_display(ui), 
-	    img->xdraw, 
-	    gc, 
-	    ximg, 
-	    0, 0, 0, 0, width, height);
+  XPutImage(xdpy, atlas->xdraw, atlas->gc, ximg,
+	    0, 0, img->atlas_x, img->atlas_y, width, height);
 
   free(ximg->data);
   ximg->data = NULL;
   XDestroyImage(ximg);
-  XFreeGC (mb_kbd_ui_x_display(ui), gc);
 
   free(data);
 
+  mb_kbd_image_set_loaded (img, True);
+}
+
+static int
+mb_kbd_image_compare_height (const void *a, const void *b)
+{
+  MBKeyboardImage *img_a = *(MBKeyboardImage **)a;
+  MBKeyboardImage *img_b = *(MBKeyboardImage **)b;
+
+  return img_b->height - img_a->height;
+}
+
+/*
+ * Shelf packer; expects the images sorted tallest first, so each shelf is
+ * as high as its first image. Returns the atlas height needed for the given
+ * width.
+ */
+static int
+mb_kbd_image_atlas_pack (MBKeyboardImage **imgs, int n_imgs, int width)
+{
+  int i, shelf_x = 0, shelf_y = 0, shelf_h = 0;
+
+  for (i = 0; i < n_imgs; i++)
+    {
+      if (shelf_x + imgs[i]->width > width)
+	{
+	  shelf_y += shelf_h;
+	  shelf_x  = 0;
+	  shelf_h  = 0;
+	}
+
+      if (shelf_h == 0)
+	shelf_h = imgs[i]->height;
+
+      imgs[i]->atlas_x = shelf_x;
+      imgs[i]->atlas_y = shelf_y;
+
+      shelf_x += imgs[i]->width;
+    }
+
+  return shelf_y + shelf_h;
+}
+
+/*
+ * Reserves space for every cached image in a single ARGB32 picture. Images
+ * which are already uploaded are copied across server side, the rest are
+ * decoded and uploaded into their slot when first drawn.
+ */
+void
+mb_kbd_image_atlas_build (MBKeyboard *kbd)
+{
+  MBKeyboardUI            *ui = mb_kbd_get_ui(kbd);
+  Display                 *xdpy = mb_kbd_ui_x_display(ui);
+  MBKeyboardImageAtlas    *old_atlas, *atlas;
+  MBKeyboardImage        **imgs;
+  XRenderPictFormat       *ren_fmt;
+  XRenderPictureAttributes ren_attr;
+  List                    *l;
+  int                      n_imgs, i, *old_x, *old_y;
+
+  old_atlas = mb_kbd_x(kbd)->image_atlas;
+
+  if (old_atlas && !old_atlas->dirty)
+    return;
+
+  if ((n_imgs = mb_kbd_image_cache_count(kbd)) == 0)
+    return;
+
+  atlas  = util_malloc0(sizeof(MBKeyboardImageAtlas));
+  imgs   = malloc(n_imgs * sizeof(MBKeyboardImage *));
+  old_x  = malloc(n_imgs * sizeof(int));
+  old_y  = malloc(n_imgs * sizeof(int));
+
+  atlas->width = MB_KBD_IMAGE_ATLAS_WIDTH;
+
+  for (i = 0, l = mb_kbd_x(kbd)->images; l != NULL; l = util_list_next(l), i++)
+    {
+      imgs[i] = l->data;
+
+      if (imgs[i]->width > atlas->width)
+	atlas->width = imgs[i]->width;
+    }
+
+  qsort(imgs, n_imgs, sizeof(MBKeyboardImage *), mb_kbd_image_compare_height);
+
+  /* remember where the uploaded images live in the old atlas */
+  for (i = 0; i < n_imgs; i++)
+    {
+      old_x[i] = imgs[i]->atlas_x;
+      old_y[i] = imgs[i]->atlas_y;
+    }
+
+  atlas->height = mb_kbd_image_atlas_pack (imgs, n_imgs, atlas->width);
+
+  DBG("packed %i images into %ix%i atlas", n_imgs, atlas->width, atlas->height);
+
+  ren_fmt = XRenderFindStandardFormat(xdpy, PictStandardARGB32);
+
+  atlas->xdraw = XCreatePixmap(xdpy,
+			       mb_kbd_ui_x_win_root(ui),
+			       atlas->width, atlas->height,
+			       ren_fmt->depth);
+
+  ren_attr.dither          = True;
+  ren_attr.component_alpha = True;
+  ren_attr.repeat          = False;
+
+  atlas->xpic = XRenderCreatePicture(xdpy,
+				     atlas->xdraw,
+				     ren_fmt,
+				     CPRepeat|CPDither|CPComponentAlpha,
+				     &ren_attr);
+
+  atlas->gc = XCreateGC(xdpy, atlas->xdraw, 0, NULL);
+
+  for (i = 0; i < n_imgs; i++)
+    {
+      if (imgs[i]->in_atlas && imgs[i]->loaded && !imgs[i]->failed)
+	XRenderComposite(xdpy, PictOpSrc,
+			 old_atlas->xpic, None, atlas->xpic,
+			 old_x[i], old_y[i], 0, 0,
+			 imgs[i]->atlas_x, imgs[i]->atlas_y,
+			 imgs[i]->width, imgs[i]->height);
+
+      imgs[i]->in_atlas = True;
+    }
+
+  mb_kbd_image_atlas_destroy (kbd);
+  mb_kbd_x(kbd)->image_atlas = atlas;
+
+  free(imgs);
+  free(old_x);
+  free(old_y);
+}
+
+void
+mb_kbd_image_atlas_destroy (MBKeyboard *kbd)
+{
+  MBKeyboardImageAtlas *atlas = mb_kbd_x(kbd)->image_atlas;
+  Display              *xdpy  = mb_kbd_ui_x_display(mb_kbd_get_ui(kbd));
+
+  if (atlas == NULL)
+    return;
+
+  util_trap_x_errors();
+
+  XFreeGC(xdpy, atlas->gc);
+  XRenderFreePicture(xdpy, atlas->xpic);
+  XFreePixmap(xdpy, atlas->xdraw);
+
+  util_untrap_x_errors();
+
+  free(atlas);
+  mb_kbd_x(kbd)->image_atlas = NULL;
+}
+
+/* Called on the main thread once a prefetch has decoded the image */
+static void
+mb_kbd_image_finish (MBKeyboardImage *img)
+{
+  if (!img->in_atlas)
+    mb_kbd_image_atlas_build (img->kbd);
+
+  mb_kbd_image_upload (img);
+}
+
+void
+mb_kbd_image_render (MBKeyboardImage *img, Picture dest, int x, int y)
+{
+  MBKeyboard *kbd = img->kbd;
+
+  if (!img->in_atlas)
+    mb_kbd_image_atlas_build (kbd);
+
+  if (!img->loaded)
+    mb_kbd_image_upload (img);
+
+  if (img->failed)
+    return;
+
+  XRenderComposite(mb_kbd_ui_x_display(mb_kbd_get_ui(kbd)),
+		   PictOpOver,
+		   mb_kbd_x(kbd)->image_atlas->xpic,
+		   None,
+		   dest,
+		   img->atlas_x, img->atlas_y, 0, 0, x, y,
+		   img->width, img->height);
+}
+
+#else  /* WANT_CAIRO */
+
+static void
+mb_kbd_image_free_resources (MBKeyboardImage *img)
+{
+  if (img->surface)
+    cairo_surface_destroy (img->surface);
+}
+
+static cairo_status_t
+png_memory_read (void *closure, unsigned char *out, unsigned int len)
+{
+  PngMemory *mem = closure;
+
+  if (len > (unsigned int)(mem->size - mem->pos))
+    return CAIRO_STATUS_READ_ERROR;
+
+  memcpy(out, mem->data + mem->pos, len);
+  mem->pos += len;
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/* Runs on the prefetch threads; surfaces are independent of each other */
+static void
+mb_kbd_image_decode (MBKeyboardImage *img)
+{
+  cairo_surface_t *surface;
+  cairo_t         *cr;
+  PngMemory        mem;
+  int              width, height;
+
+  mem.pos = 0;
+
+  if ((mem.data = mb_kbd_embedded_file (mb_kbd_image_source (img),
+					&mem.size)) != NULL)
+    surface = cairo_image_surface_create_from_png_stream (png_memory_read,
+							  &mem);
+  else
+    surface = cairo_image_surface_create_from_png (mb_kbd_image_source (img));
+
+  if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS)
+    {
+      cairo_surface_destroy (surface);
+      return;
+    }
+
+  width  = cairo_image_surface_get_width (surface);
+  height = cairo_image_surface_get_height (surface);
+
+  if (width == img->width && height == img->height)
+    {
+      img->surface = surface;
+      return;
+    }
+
+  /* a larger master; scale it down once here and never at draw time */
+  if (width > img->width && height > img->height)
+    {
+      img->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+						 img->width, img->height);
+      cr = cairo_create (img->surface);
+      cairo_scale (cr,
+		   (double)img->width / width, (double)img->height / height);
+      cairo_set_source_surface (cr, surface, 0, 0);
+      cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+      cairo_paint (cr);
+      cairo_destroy (cr);
+    }
+
+  cairo_surface_destroy (surface);
+}
+
+/*
+ * Decodes the image on first use, returns NULL if it could not be loaded.
+ */
+cairo_surface_t*
+mb_kbd_image_cairo_surface (MBKeyboardImage *img)
+{
+  if (!img->loaded)
+    {
+      if (img->surface == NULL)
+	mb_kbd_image_decode (img);
+
+      mb_kbd_image_set_loaded (img, img->surface != NULL);
+    }
+
+  return img->surface;
+}
+
+static void
+mb_kbd_image_finish (MBKeyboardImage *img)
+{
+  mb_kbd_image_cairo_surface (img);
+}
+
+#endif /* WANT_CAIRO */
+
+typedef struct MBKeyboardImageJob
+{
+  MBKeyboardImage      **imgs;
+  int                    n_imgs;
+  int                    next;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t        lock;
+#endif
+}
+MBKeyboardImageJob;
+
+static void*
+mb_kbd_image_prefetch_worker (void *data)
+{
+  MBKeyboardImageJob *job = (MBKeyboardImageJob *)data;
+  int                 i;
+
+  while (True)
+    {
+#ifdef HAVE_PTHREAD
+      pthread_mutex_lock (&job->lock);
+#endif
+      i = job->next++;
+#ifdef HAVE_PTHREAD
+      pthread_mutex_unlock (&job->lock);
+#endif
+
+      if (i >= job->n_imgs)
+	break;
+
+      mb_kbd_image_decode (job->imgs[i]);
+    }
+
+  return NULL;
+}
+
+static void
+mb_kbd_image_prefetch_run (MBKeyboardImageJob *job)
+{
+#ifdef HAVE_PTHREAD
+  pthread_t threads[MB_KBD_IMAGE_MAX_THREADS];
+  long      n_threads;
+  int       i;
+
+  n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n_threads > MB_KBD_IMAGE_MAX_THREADS)
+    n_threads = MB_KBD_IMAGE_MAX_THREADS;
+
+  if (n_threads > job->n_imgs)
+    n_threads = job->n_imgs;
+
+  if (n_threads > 1)
+    {
+      pthread_mutex_init (&job->lock, NULL);
+
+      /* the calling thread is one of the workers */
+      for (i = 1; i < n_threads; i++)
+	if (pthread_create (&threads[i], NULL,
+			    mb_kbd_image_prefetch_worker, job) != 0)
+	  break;
+
+      n_threads = i;
+
+      DBG("decoding %i images on %li threads", job->n_imgs, n_threads);
+
+      mb_kbd_image_prefetch_worker (job);
+
+      for (i = 1; i < n_threads; i++)
+	pthread_join (threads[i], NULL);
+
+      pthread_mutex_destroy (&job->lock);
+      return;
+    }
+#endif
+
+  mb_kbd_image_prefetch_worker (job);
+}
+
+/*
+ * Decodes every image the layout will draw up front, spreading the files
+ * over a few threads. Getting them onto the screen (the atlas upload for
+ * Xft) is then done here on the main thread.
+ */
+void
+mb_kbd_image_prefetch (MBKeyboard *kbd, MBKeyboardLayout *layout)
+{
+  MBKeyboardImageJob  job;
+  MBKeyboardImage    *img;
+  List               *row_item, *key_item;
+  int                 state, i, size = 0;
+
+  if (layout == NULL || mb_kbd_x(kbd)->images == NULL)
+    return;
+
+  memset(&job, 0, sizeof(job));
+
+  for (row_item = mb_kbd_layout_rows(layout);
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    {
+      mb_kbd_row_for_each_key(row_item->data, key_item)
+	{
+	  MBKeyboardKey *key = key_item->data;
+
+	  mb_kdb_key_foreach_state(key, state)
+	    {
+	      if (mb_kbd_key_get_face_type(key, state) != MBKeyboardKeyFaceImage)
+		continue;
+
+	      img = mb_kbd_image_scaled (mb_kbd_key_get_image_face(key, state));
+
+	      if (img->loaded || img->queued)
+		continue;
+
+	      if (job.n_imgs == size)
+		{
+		  size     = size ? size * 2 : 16;
+		  job.imgs = realloc(job.imgs, size * sizeof(MBKeyboardImage *));
+		}
+
+	      img->queued = True;
+	      job.imgs[job.n_imgs++] = img;
+	    }
+	}
+    }
+
+  if (job.n_imgs > 0)
+    mb_kbd_image_prefetch_run (&job);
+
+  for (i = 0; i < job.n_imgs; i++)
+    {
+      job.imgs[i]->queued = False;
+      mb_kbd_image_finish (job.imgs[i]);
+    }
+
+  if (job.imgs)
+    free(job.imgs);
+}
+
+static MBKeyboardImage*
+mb_kbd_image_create (MBKeyboard *kbd,
+		     const char *path,
+		     const char *source,
+		     int         width,
+		     int         height)
+{
+  MBKeyboardImage *img;
+
+  img = util_malloc0(sizeof(MBKeyboardImage));
+
+  img->kbd      = kbd;
+  img->path     = strdup(path);
+  img->source   = source ? strdup(source) : NULL;
+  img->refcount = 1;
+  img->width    = width;
+  img->height   = height;
+
+  mb_kbd_image_cache_add (kbd, img);
+
+#ifndef WANT_CAIRO
+  if (mb_kbd_x(kbd)->image_atlas)
+    mb_kbd_x(kbd)->image_atlas->dirty = True;
+#endif
+
+  return img;
+}
+
+MBKeyboardImage*
+mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
+{
+  MBKeyboardImage *img;
+  int              width, height;
+
+  if ((img = mb_kbd_image_cache_lookup (kbd, filename)) != NULL)
+    {
+      img->refcount++;
+      return img;
+    }
+
+  if (!png_file_size (filename, &width, &height))
+    return NULL;
+
+  return mb_kbd_image_create (kbd, filename, NULL, width, height);
+}
+
+/* foo.png -> foo@2x.png */
+static void
+mb_kbd_image_variant_path (const char *path, int scale, char *buf, int len)
+{
+  const char *ext = strrchr(path, '.');
+
+  if (ext == NULL || strchr(ext, '/'))
+    ext = path + strlen(path);
+
+  snprintf(buf, len, "%.*s@%ix%s", (int)(ext - path), path, scale, ext);
+}
+
+/*
+ * Finds the variant for the given scale; an exact '@Nx' file if there is
+ * one, otherwise the next bigger one downscaled. Falls back to the image
+ * itself.
+ */
+static MBKeyboardImage*
+mb_kbd_image_find_variant (MBKeyboardImage *img, int scale)
+{
+  MBKeyboardImage *variant;
+  char             path[1024], source[1024];
+  int              s, width, height;
+
+  mb_kbd_image_variant_path (img->path, scale, path, sizeof(path));
+
+  if ((variant = mb_kbd_image_cache_lookup (img->kbd, path)) != NULL)
+    {
+      variant->refcount++;
+      return variant;
+    }
+
+  for (s = scale; s <= MB_KBD_IMAGE_MAX_SCALE; s++)
+    {
+      mb_kbd_image_variant_path (img->path, s, source, sizeof(source));
+
+      if (!png_file_size (source, &width, &height))
+	continue;
+
+      DBG("using '%s' for %ix '%s'", source, scale, img->path);
+
+      if (s == scale)
+	return mb_kbd_image_create (img->kbd, path, NULL, width, height);
+
+      return mb_kbd_image_create (img->kbd, path, source,
+				  (width * scale) / s, (height * scale) / s);
+    }
+
   return img;
 }
 
+/*
+ * Returns the image to draw at the keyboard's current image scale.
+ */
+MBKeyboardImage*
+mb_kbd_image_scaled (MBKeyboardImage *img)
+{
+  int scale = mb_kbd_x(img->kbd)->image_scale;
+
+  if (scale <= 1)
+    return img;
+
+  if (scale > MB_KBD_IMAGE_MAX_SCALE)
+    scale = MB_KBD_IMAGE_MAX_SCALE;
+
+  if (img->scaled[scale] == NULL)
+    img->scaled[scale] = mb_kbd_image_find_variant (img, scale);
+
+  return img->scaled[scale];
+}
+
+/*
+ * Picks the image scale for keys grown by the given ratio (in percent) from
+ * their base size. Only whole steps are used, so a variant always fits.
+ */
+void
+mb_kbd_image_set_scale (MBKeyboard *kbd, int percent)
+{
+  int scale = percent / 100;
+
+  if (scale < 1)
+    scale = 1;
+
+  if (scale > MB_KBD_IMAGE_MAX_SCALE)
+    scale = MB_KBD_IMAGE_MAX_SCALE;
+
+  if (scale == mb_kbd_x(kbd)->image_scale)
+    return;
+
+  DBG("image scale now %ix", scale);
+
+  mb_kbd_x(kbd)->image_scale = scale;
+
+  mb_kbd_image_prefetch (kbd, mb_kbd_get_selected_layout(kbd));
+}
+
 int
 mb_kbd_image_width (MBKeyboardImage *img)
 {
@@ -228,16 +1053,42 @@ mb_kbd_image_height (MBKeyboardImage *img)
   return img->height;
 }
 
-Picture
-mb_kbd_image_render_picture (MBKeyboardImage *img)
+/*
+ * Drops a reference; the image is only really freed once the last key face
+ * using it goes away.
+ */
+void
+mb_kbd_image_destroy (MBKeyboardImage *img)
+{
+  int s;
+
+  if (--img->refcount > 0)
+    return;
+
+  for (s = 2; s <= MB_KBD_IMAGE_MAX_SCALE; s++)
+    if (img->scaled[s] && img->scaled[s] != img)
+      mb_kbd_image_destroy (img->scaled[s]);
+
+  mb_kbd_image_cache_remove (img->kbd, img);
+  mb_kbd_image_free_resources (img);
+
+  if (img->source)
+    free (img->source);
+
+  free (img->path);
+  free (img);
+}
+
+int
+mb_kbd_image_cache_count (MBKeyboard *kbd)
 {
-  return img->xpic;
+  return mb_kbd_x(kbd)->images ? util_list_length(mb_kbd_x(kbd)->images) : 0;
 }
 
-void
-mb_kbd_image_destroy (MBKeyboardImage *img)
+int
+mb_kbd_image_cache_bytes (MBKeyboard *kbd)
 {
-  /* ... */
+  return mb_kbd_x(kbd)->image_bytes;
 }
 
 
@@ -26,7 +26,7 @@
 #include <glib.h>
 #endif
 
-#include "matchbox-keyboard.h"
+#include "matchbox-keyboard-core.h"
 
 #define MBKB_N_KEY_STATES 5
 
@@ -51,6 +51,7 @@ typedef struct MBKeyboardKeyAction
     KeySym                 keysym;
     MBKeyboardKeyModType   type;
   } u;
+  char                    *layout; /* MBKeyboardKeyModLayout target or NULL */
 }
 MBKeyboardKeyAction;
 
@@ -75,6 +76,9 @@ struct MBKeyboardKey
   int                    extra_width_pad;  /* via win resizes */
   int                    extra_height_pad;
 
+  /* base allocation for the compact [0] and extended [1] key sets */
+  int                    base_x[2], base_y[2], base_width[2], base_height[2];
+
   boolean                obeys_caps;
   boolean                fill;	     /* width fills avialble space */
   int                    req_uwidth; /* unit width in 1/1000's */
@@ -117,6 +121,37 @@ _mb_kbd_key_init_state(MBKeyboardKey           *key,
   key->states[state] = util_malloc0(sizeof(MBKeyboardKeyState));
 }
 
+/* frees the face of a state, that is to get another or go */
+static void
+_mb_kbd_key_clear_face(MBKeyboardKey           *key,
+		       MBKeyboardKeyStateType   state)
+{
+  MBKeyboardKeyState *s = key->states[state];
+
+  if (s->face.type == MBKeyboardKeyFaceGlyph && s->face.u.str)
+    free (s->face.u.str);
+
+  /* only ever there when the frontend loaded it */
+  if (s->face.type == MBKeyboardKeyFaceImage && s->face.u.image
+      && key->kbd->frontend->image_destroy)
+    key->kbd->frontend->image_destroy (s->face.u.image);
+
+  memset (&s->face, 0, sizeof(s->face));
+}
+
+/* frees the action of a state, that is to get another or go */
+static void
+_mb_kbd_key_clear_action(MBKeyboardKey           *key,
+			 MBKeyboardKeyStateType   state)
+{
+  MBKeyboardKeyState *s = key->states[state];
+
+  if (s->action.type == MBKeyboardKeyActionGlyph && s->action.u.glyph)
+    free (s->action.u.glyph);
+
+  s->action.u.glyph = NULL;
+}
+
 MBKeyboardKey*
 mb_kbd_key_new(MBKeyboard *kbd)
 {
@@ -140,23 +175,11 @@ mb_kbd_key_destroy (MBKeyboardKey *key)
   for (i=0; i<N_MBKeyboardKeyStateTypes; i++)
     if (key->states[i])
       {
-        if (key->states[i]->action.type == MBKeyboardKeyActionGlyph &&
-            key->states[i]->action.u.glyph)
-          free (key->states[i]->action.u.glyph);
+        _mb_kbd_key_clear_action (key, i);
+        _mb_kbd_key_clear_face (key, i);
 
-        if (key->states[i]->face.type == MBKeyboardKeyFaceGlyph &&
-            key->states[i]->face.u.str)
-          free (key->states[i]->face.u.str);
-
-        if (key->states[i]->face.type == MBKeyboardKeyFaceImage &&
-            key->states[i]->face.u.image)
-          {
-#ifdef WANT_CAIRO
-            cairo_surface_destroy (key->states[i]->face.u.image);
-#else
-            mb_kbd_image_destroy (key->states[i]->face.u.image);
-#endif
-          }
+        if (key->states[i]->action.layout)
+          free (key->states[i]->action.layout);
 
         free (key->states[i]);
       }
@@ -286,6 +309,54 @@ mb_kbd_key_set_extra_height_pad(MBKeyboardKey  *key, int pad)
   key->alloc_height += key->extra_height_pad;
 }
 
+void
+mb_kbd_key_save_base_geometry(MBKeyboardKey *key, boolean extended)
+{
+  int set = extended ? 1 : 0;
+
+  key->base_x[set]      = key->alloc_x;
+  key->base_y[set]      = key->alloc_y;
+  key->base_width[set]  = key->alloc_width  - key->extra_width_pad;
+  key->base_height[set] = key->alloc_height - key->extra_height_pad;
+}
+
+void
+mb_kbd_key_restore_base_geometry(MBKeyboardKey *key, boolean extended)
+{
+  int set = extended ? 1 : 0;
+
+  key->extra_width_pad  = 0;
+  key->extra_height_pad = 0;
+
+  mb_kbd_key_set_geometry(key,
+			  key->base_x[set], key->base_y[set],
+			  key->base_width[set], key->base_height[set]);
+}
+
+/* base geometry as x, y, width, height; for the on-disk geometry cache */
+void
+mb_kbd_key_get_base_geometry(MBKeyboardKey *key, boolean extended, int *geom)
+{
+  int set = extended ? 1 : 0;
+
+  geom[0] = key->base_x[set];
+  geom[1] = key->base_y[set];
+  geom[2] = key->base_width[set];
+  geom[3] = key->base_height[set];
+}
+
+void
+mb_kbd_key_set_base_geometry(MBKeyboardKey *key, boolean extended,
+			     const int *geom)
+{
+  int set = extended ? 1 : 0;
+
+  key->base_x[set]      = geom[0];
+  key->base_y[set]      = geom[1];
+  key->base_width[set]  = geom[2];
+  key->base_height[set] = geom[3];
+}
+
 int
 mb_kbd_key_get_extra_height_pad(MBKeyboardKey  *key)
 {
@@ -333,6 +404,8 @@ mb_kbd_key_set_glyph_face(MBKeyboardKey           *key,
 {
   if (key->states[state] == NULL)
     _mb_kbd_key_init_state(key, state);
+  else
+    _mb_kbd_key_clear_face(key, state);
 
   key->states[state]->face.type    = MBKeyboardKeyFaceGlyph;
   key->states[state]->face.u.str   = strdup(glyph);
@@ -358,6 +431,8 @@ mb_kbd_key_set_image_face(MBKeyboardKey           *key,
 
   if (key->states[state] == NULL)
     _mb_kbd_key_init_state(key, state);
+  else
+    _mb_kbd_key_clear_face(key, state);
 
   key->states[state]->face.type    = MBKeyboardKeyFaceImage;
   key->states[state]->face.u.image = image;
@@ -382,6 +457,8 @@ mb_kbd_key_set_char_action(MBKeyboardKey           *key,
 {
   if (key->states[state] == NULL)
     _mb_kbd_key_init_state(key, state);
+  else
+    _mb_kbd_key_clear_action(key, state);
 
   key->states[state]->action.type = MBKeyboardKeyActionGlyph;
   key->states[state]->action.u.glyph = strdup(glyphs);
@@ -405,6 +482,8 @@ mb_kbd_key_set_keysym_action(MBKeyboardKey           *key,
 {
   if (key->states[state] == NULL)
     _mb_kbd_key_init_state(key, state);
+  else
+    _mb_kbd_key_clear_action(key, state);
 
   key->states[state]->action.type = MBKeyboardKeyActionXKeySym;
   key->states[state]->action.u.keysym = keysym;
@@ -429,6 +508,8 @@ mb_kbd_key_set_modifer_action(MBKeyboardKey          *key,
 {
   if (key->states[state] == NULL)
     _mb_kbd_key_init_state(key, state);
+  else
+    _mb_kbd_key_clear_action(key, state);
 
   key->states[state]->action.type = MBKeyboardKeyActionModifier;
   key->states[state]->action.u.type   = type;
@@ -445,6 +526,55 @@ mb_kbd_key_get_modifer_action(MBKeyboardKey          *key,
   return 0;
 }
 
+/*
+ * A layout key switches to the layout with the given id, or with a NULL id
+ * to the next one.
+ */
+void
+mb_kbd_key_set_layout_action(MBKeyboardKey          *key,
+			     MBKeyboardKeyStateType  state,
+			     const char             *layout_id)
+{
+  mb_kbd_key_set_modifer_action(key, state, MBKeyboardKeyModLayout);
+
+  if (key->states[state]->action.layout)
+    free (key->states[state]->action.layout);
+
+  key->states[state]->action.layout = layout_id ? strdup(layout_id) : NULL;
+}
+
+const char*
+mb_kbd_key_get_layout_action(MBKeyboardKey          *key,
+			     MBKeyboardKeyStateType  state)
+{
+  if (mb_kbd_key_get_modifer_action(key, state) == MBKeyboardKeyModLayout)
+    return key->states[state]->action.layout;
+
+  return NULL;
+}
+
+static void
+mb_kbd_key_switch_layout(MBKeyboardKey          *key,
+			 MBKeyboardKeyStateType  state)
+{
+  const char       *id = mb_kbd_key_get_layout_action(key, state);
+  MBKeyboardLayout *layout;
+
+  if (id == NULL)
+    {
+      mb_kbd_select_next_layout(key->kbd);
+      return;
+    }
+
+  if ((layout = mb_kbd_find_layout(key->kbd, id)) == NULL)
+    {
+      fprintf(stderr, "matchbox-keyboard: no layout with id '%s'\n", id);
+      return;
+    }
+
+  mb_kbd_select_layout(key->kbd, layout);
+}
+
 
 MBKeyboardKeyFaceType
 mb_kbd_key_get_face_type(MBKeyboardKey           *key,
@@ -468,6 +598,31 @@ mb_kbd_key_get_action_type(MBKeyboardKey           *key,
 }
 
 
+/*
+ * The modifiers a key sends with, as MBKeyboardState bits; only shift,
+ * control, alt and mod1 (meta) are passed on.
+ */
+static int
+mb_kbd_key_modifiers (MBKeyboardKey *key, MBKeyboardKeyStateType state)
+{
+  int flags = 0;
+
+  if (state == MBKeyboardKeyStateShifted ||
+      mb_kbd_has_state(key->kbd, MBKeyboardStateShifted))
+    flags |= MBKeyboardStateShifted;
+
+  if (mb_kbd_has_state(key->kbd, MBKeyboardStateControl))
+    flags |= MBKeyboardStateControl;
+
+  if (mb_kbd_has_state(key->kbd, MBKeyboardStateAlt))
+    flags |= MBKeyboardStateAlt;
+
+  if (mb_kbd_has_state(key->kbd, MBKeyboardStateMod1))
+    flags |= MBKeyboardStateMod1;
+
+  return flags;
+}
+
 void
 mb_kbd_key_press (MBKeyboardKey *key)
 {
@@ -485,19 +640,7 @@ mb_kbd_key_press (MBKeyboardKey *key)
       && mb_kbd_key_get_obey_caps(key))
     state = MBKeyboardKeyStateShifted;
 
-  /* XXX below fakekey mods probably better in ui */
-  if (state == MBKeyboardKeyStateShifted ||
-      mb_kbd_has_state(key->kbd, MBKeyboardStateShifted))
-    flags |= FAKEKEYMOD_SHIFT;
-
-  if (mb_kbd_has_state(key->kbd, MBKeyboardStateControl))
-    flags |= FAKEKEYMOD_CONTROL;
-
-  if (mb_kbd_has_state(key->kbd, MBKeyboardStateAlt))
-    flags |= FAKEKEYMOD_ALT;
-
-  if (mb_kbd_has_state(key->kbd, MBKeyboardStateMod1))
-    flags |= FAKEKEYMOD_META;
+  flags = mb_kbd_key_modifiers(key, state);
 
   if (!mb_kdb_key_has_state(key, state))
     {
@@ -532,7 +675,7 @@ mb_kbd_key_press (MBKeyboardKey *key)
             switch (ks)
               {
               case XK_BackSpace:
-                mb_kbd_ui_send_keysym_press(key->kbd->ui, ks, flags);
+                mb_kbd_send_keysym_press(key->kbd, ks, flags);
                 break;
               default:;
               }
@@ -618,6 +761,10 @@ mb_kbd_key_press (MBKeyboardKey *key)
 	    mb_kbd_toggle_state(key->kbd, MBKeyboardStateAlt);
             mb_kbd_set_held_key(key->kbd, key);
 	    break;
+	  case MBKeyboardKeyModLayout:
+	    /* switched on release, so the press can still be cancelled */
+            mb_kbd_set_held_key(key->kbd, key);
+	    break;
 	  default:
 	    DBG("unknown modifier action");
 	    break;
@@ -703,12 +850,12 @@ mb_kbd_key_is_held(MBKeyboard *kbd, MBKeyboardKey *key)
 }
 
 void
-mb_kbd_key_release(MBKeyboard *kbd, Bool cancel)
+mb_kbd_key_release(MBKeyboard *kbd, boolean cancel)
 {
   MBKeyboardKey *key   = mb_kbd_get_held_key (kbd);
+  boolean        layout_changed = False;
 
   mb_kbd_set_held_key (kbd, NULL);
-  mb_kbd_hide_popup (kbd);
 
   if (key && !cancel)
     {
@@ -721,18 +868,7 @@ mb_kbd_key_release(MBKeyboard *kbd, Bool cancel)
           && mb_kbd_key_get_obey_caps (key))
         state = MBKeyboardKeyStateShifted;
 
-      if (state == MBKeyboardKeyStateShifted ||
-          mb_kbd_has_state (key->kbd, MBKeyboardStateShifted))
-        flags |= FAKEKEYMOD_SHIFT;
-
-      if (mb_kbd_has_state (key->kbd, MBKeyboardStateControl))
-        flags |= FAKEKEYMOD_CONTROL;
-
-      if (mb_kbd_has_state (key->kbd, MBKeyboardStateAlt))
-        flags |= FAKEKEYMOD_ALT;
-
-      if (mb_kbd_has_state(key->kbd, MBKeyboardStateMod1))
-        flags |= FAKEKEYMOD_META;
+      flags = mb_kbd_key_modifiers (key, state);
 
       if (!mb_kdb_key_has_state (key, state))
         {
@@ -749,7 +885,7 @@ mb_kbd_key_release(MBKeyboard *kbd, Bool cancel)
             const char *key_char;
 
             if ((key_char = mb_kbd_key_get_char_action (key, state)) != NULL)
-              mb_kbd_ui_send_press(key->kbd->ui, key_char, flags);
+              mb_kbd_send_press(key->kbd, key_char, flags);
             break;
           }
         case MBKeyboardKeyActionXKeySym:
@@ -766,21 +902,29 @@ mb_kbd_key_release(MBKeyboard *kbd, Bool cancel)
                      * Fake shift for Greek capitals.
                      */
                     if (ks >= XK_Greek_ALPHA && ks <= XK_Greek_OMEGA)
-                      flags |= FAKEKEYMOD_SHIFT;
+                      flags |= MBKeyboardStateShifted;
                     if (ks >= XK_Greek_alpha && ks <= XK_Greek_omega)
-                      flags &= ~FAKEKEYMOD_SHIFT;
+                      flags &= ~MBKeyboardStateShifted;
 
-                    mb_kbd_ui_send_keysym_press(key->kbd->ui, ks, flags);
+                    mb_kbd_send_keysym_press(key->kbd, ks, flags);
                   }
               }
 
             break;
           }
 
-#if WANT_GTK_WIDGET
         case MBKeyboardKeyActionModifier:
           switch (mb_kbd_key_get_modifer_action (key, state))
             {
+            case MBKeyboardKeyModLayout:
+              {
+                MBKeyboardLayout *old = mb_kbd_get_selected_layout (kbd);
+
+                mb_kbd_key_switch_layout (key, state);
+                layout_changed = (mb_kbd_get_selected_layout (kbd) != old);
+                break;
+              }
+#if WANT_GTK_WIDGET
             case MBKeyboardKeyModShift:
               if (key->press_timeout)
                 {
@@ -790,10 +934,11 @@ mb_kbd_key_release(MBKeyboard *kbd, Bool cancel)
                   key->press_flag = FALSE;
                 }
               break;
+#endif
             default:
               break;
             }
-#endif
+          break;
         default:
           break;
         }
@@ -823,13 +968,107 @@ mb_kbd_key_release(MBKeyboard *kbd, Bool cancel)
 	    }
 	}
 
-      if (queue_full_kbd_redraw)
+      /* the key is not on screen any more; the new layout is drawn */
+      if (layout_changed)
+	;
+      else if (queue_full_kbd_redraw)
 	mb_kbd_redraw(key->kbd);
       else
 	mb_kbd_redraw_key(key->kbd, key);
 
-      mb_kbd_ui_send_release(kbd->ui);
+      mb_kbd_send_release(kbd);
+    }
+}
+
+static boolean
+mb_kbd_key_str_equal(const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return (a == b);
+
+  return streq(a, b);
+}
+
+/*
+ * Whether a and b look and act the same; their faces, actions and caps
+ * handling, not their size or position.
+ */
+boolean
+mb_kbd_key_states_equal(MBKeyboardKey *a, MBKeyboardKey *b)
+{
+  int i;
+
+  if (a->obeys_caps != b->obeys_caps)
+    return False;
+
+  for (i=0; i<N_MBKeyboardKeyStateTypes; i++)
+    {
+      MBKeyboardKeyState *sa = a->states[i], *sb = b->states[i];
+
+      if (sa == NULL || sb == NULL)
+	{
+	  if (sa != sb)
+	    return False;
+	  continue;
+	}
+
+      if (sa->face.type != sb->face.type
+	  || sa->action.type != sb->action.type
+	  || !mb_kbd_key_str_equal(sa->action.layout, sb->action.layout))
+	return False;
+
+      /* images are shared through the frontend, by path */
+      if ((sa->face.type == MBKeyboardKeyFaceGlyph
+	   && !mb_kbd_key_str_equal(sa->face.u.str, sb->face.u.str))
+	  || (sa->face.type == MBKeyboardKeyFaceImage
+	      && sa->face.u.image != sb->face.u.image))
+	return False;
+
+      switch (sa->action.type)
+	{
+	case MBKeyboardKeyActionGlyph:
+	  if (!mb_kbd_key_str_equal(sa->action.u.glyph, sb->action.u.glyph))
+	    return False;
+	  break;
+	case MBKeyboardKeyActionXKeySym:
+	  if (sa->action.u.keysym != sb->action.u.keysym)
+	    return False;
+	  break;
+	case MBKeyboardKeyActionModifier:
+	  if (sa->action.u.type != sb->action.u.type)
+	    return False;
+	  break;
+	default:
+	  break;
+	}
+    }
+
+  return True;
+}
+
+/* trades faces, actions and caps handling between two keys */
+void
+mb_kbd_key_swap_states(MBKeyboardKey *a, MBKeyboardKey *b)
+{
+  MBKeyboardKeyState  *state;
+  MBKeyboardStateType  kbdstate;
+  boolean              obey;
+  int                  i;
+
+  for (i=0; i<N_MBKeyboardKeyStateTypes; i++)
+    {
+      state        = a->states[i];
+      a->states[i] = b->states[i];
+      b->states[i] = state;
     }
+
+  kbdstate         = a->sets_kbdstate;
+  a->sets_kbdstate = b->sets_kbdstate;
+  b->sets_kbdstate = kbdstate;
+
+  obey          = a->obeys_caps;
+  a->obeys_caps = b->obeys_caps;
+  b->obeys_caps = obey;
 }
 
 void
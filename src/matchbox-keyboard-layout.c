@@ -18,13 +18,21 @@
  *
  */
 
-#include "matchbox-keyboard.h"
+#include "matchbox-keyboard-core.h"
 
+/*
+ * A layout with page-rows set is split into pages of that many rows; the
+ * first page is the layout itself, the others hang off it and each get
+ * measured, laid out and drawn only when shown, like any other layout.
+ */
 struct MBKeyboardLayout
 {
   MBKeyboard       *kbd;
   char             *id;
   List             *rows;
+  int               page_rows;
+  MBKeyboardLayout *parent;    /* the first page, for later pages */
+  List             *pages;     /* later pages, for the first page */
 };
 
 
@@ -49,6 +57,14 @@ mb_kbd_layout_destroy (MBKeyboardLayout *layout)
   if (layout->id)
     free (layout->id);
 
+  while (layout->pages)
+    {
+      MBKeyboardLayout *page = layout->pages->data;
+
+      layout->pages = util_list_remove(layout->pages, page);
+      mb_kbd_layout_destroy (page);
+    }
+
   l = layout->rows;
 
   while (l)
@@ -72,9 +88,61 @@ mb_kbd_layout_append_row(MBKeyboardLayout *layout,
   layout->rows = util_list_append(layout->rows, (pointer)row);
 }
 
+const char*
+mb_kbd_layout_id(MBKeyboardLayout *layout)
+{
+  return layout->id;
+}
+
 List*
 mb_kbd_layout_rows(MBKeyboardLayout *layout)
 {
   return util_list_get_first(layout->rows);
 }
 
+void
+mb_kbd_layout_set_page_rows(MBKeyboardLayout *layout, int rows)
+{
+  layout->page_rows = rows;
+}
+
+int
+mb_kbd_layout_page_rows(MBKeyboardLayout *layout)
+{
+  return mb_kbd_layout_parent(layout)->page_rows;
+}
+
+/* starts another page, with an id of <layout id>#<page number> */
+MBKeyboardLayout*
+mb_kbd_layout_append_page(MBKeyboardLayout *layout)
+{
+  MBKeyboardLayout *page;
+  char             *id;
+  int               n;
+
+  layout = mb_kbd_layout_parent(layout);
+
+  n  = strlen(layout->id) + 16;
+  id = alloca(n);
+  snprintf(id, n, "%s#%i", layout->id, util_list_length(layout->pages) + 2);
+
+  page         = mb_kbd_layout_new(layout->kbd, id);
+  page->parent = layout;
+
+  layout->pages = util_list_append(layout->pages, page);
+
+  return page;
+}
+
+/* the layout a page belongs to; for anything else the layout itself */
+MBKeyboardLayout*
+mb_kbd_layout_parent(MBKeyboardLayout *layout)
+{
+  return layout->parent ? layout->parent : layout;
+}
+
+List*
+mb_kbd_layout_pages(MBKeyboardLayout *layout)
+{
+  return util_list_get_first(layout->pages);
+}
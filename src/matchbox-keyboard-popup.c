@@ -41,6 +41,8 @@ struct MBKeyboardPopup
 
   cairo_surface_t    *surface;
   cairo_t            *cr;
+
+  MBKeyboardCairoLabels *labels; /* at our own font size */
 };
 
 void
@@ -66,6 +68,8 @@ mb_kbd_popup_load_font (MBKeyboardPopup *popup)
     ( (double)mm_per_pixel * 0.039 * 72 );
 
   cairo_set_font_size (popup->cr, pixel_size);
+
+  mb_kbd_cairo_labels_clear (popup->labels);
 }
 
 static void
@@ -122,7 +126,8 @@ mb_kbd_popup_new (MBKeyboardUI *ui)
   XSetWindowAttributes  attrs;
   int                   width, height;
 
-  popup->ui = ui;
+  popup->ui     = ui;
+  popup->labels = mb_kbd_cairo_labels_new ();
 
   mb_kbd_popup_calc_size (popup, &width, &height);
 
@@ -170,6 +175,8 @@ mb_kbd_popup_destroy (MBKeyboardPopup *popup)
 {
   cairo_destroy (popup->cr);
 
+  mb_kbd_cairo_labels_destroy (popup->labels);
+
   free (popup);
 }
 
@@ -268,7 +275,8 @@ mb_kbd_popup_redraw (MBKeyboardPopup *popup, MBKeyboardKey *key)
 	cairo_font_extents_t font_extents;
         cairo_text_extents_t text_extents;
 
-        cairo_text_extents (popup->cr, face_str, &text_extents);
+        mb_kbd_cairo_label_extents (popup->labels, popup->cr,
+                                    face_str, &text_extents);
 	cairo_font_extents (popup->cr, &font_extents);
 
         x1 = x + round (((w - text_extents.width) / 2.0) -
@@ -277,8 +285,7 @@ mb_kbd_popup_redraw (MBKeyboardPopup *popup, MBKeyboardKey *key)
         y1 = y + round ((h - font_extents.ascent -
                          font_extents.descent) / 2.0  + font_extents.ascent);
 
-        cairo_move_to(popup->cr, x1, y1);
-        cairo_show_text (popup->cr, face_str);
+        mb_kbd_cairo_label_show (popup->labels, popup->cr, face_str, x1, y1);
       }
   }
   else if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceImage)
@@ -286,7 +293,11 @@ mb_kbd_popup_redraw (MBKeyboardPopup *popup, MBKeyboardKey *key)
       double x1, y1, w1, h1;
       cairo_surface_t *img;
 
-      img = mb_kbd_key_get_image_face(key, state);
+      img = mb_kbd_image_cairo_surface
+        (mb_kbd_image_scaled (mb_kbd_key_get_image_face(key, state)));
+
+      if (img == NULL)
+        return;
 
       w1 = cairo_image_surface_get_width (img);
       h1 = cairo_image_surface_get_height (img);
@@ -24,6 +24,8 @@ typedef enum {
   MBKeyboardRemoteShow,
   MBKeyboardRemoteHide,
   MBKeyboardRemoteToggle,
+  MBKeyboardRemoteNextLayout,
+  MBKeyboardRemoteSelectLayout, /* data.l[1] is the layout's index */
 } MBKeyboardRemoteOperation;
 
 #endif
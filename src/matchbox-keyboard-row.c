@@ -18,7 +18,7 @@
  *
  */
 
-#include "matchbox-keyboard.h"
+#include "matchbox-keyboard-core.h"
 
 struct MBKeyboardRow
 {
@@ -26,6 +26,7 @@ struct MBKeyboardRow
   List             *keys;
 
   int               alloc_x, alloc_y;
+  int               base_x[2], base_y[2]; /* compact, extended */
 };
 
 MBKeyboardRow*
@@ -132,6 +133,50 @@ mb_kbd_row_width(MBKeyboardRow *row)
   return result;
 }
 
+/*
+ * Keeps (or brings back) the base allocation of the row and all its keys
+ * for one of the two key sets.
+ */
+void
+mb_kbd_row_save_base_geometry(MBKeyboardRow *row, boolean extended)
+{
+  List *key_item;
+
+  row->base_x[extended ? 1 : 0] = row->alloc_x;
+  row->base_y[extended ? 1 : 0] = row->alloc_y;
+
+  mb_kbd_row_for_each_key(row, key_item)
+    mb_kbd_key_save_base_geometry(key_item->data, extended);
+}
+
+void
+mb_kbd_row_restore_base_geometry(MBKeyboardRow *row, boolean extended)
+{
+  List *key_item;
+
+  row->alloc_x = row->base_x[extended ? 1 : 0];
+  row->alloc_y = row->base_y[extended ? 1 : 0];
+
+  mb_kbd_row_for_each_key(row, key_item)
+    mb_kbd_key_restore_base_geometry(key_item->data, extended);
+}
+
+void
+mb_kbd_row_get_base_position(MBKeyboardRow *row, boolean extended,
+			     int *x, int *y)
+{
+  *x = row->base_x[extended ? 1 : 0];
+  *y = row->base_y[extended ? 1 : 0];
+}
+
+void
+mb_kbd_row_set_base_position(MBKeyboardRow *row, boolean extended,
+			     int x, int y)
+{
+  row->base_x[extended ? 1 : 0] = x;
+  row->base_y[extended ? 1 : 0] = y;
+}
+
 int
 mb_kbd_row_base_width(MBKeyboardRow *row)
 {
@@ -0,0 +1,78 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  Authored By Matthew Allum <mallum@o-hand.com>
+ *
+ *  Copyright (c) 2005-2012 Intel Corp
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * Text shaping for key labels. Backends shape each distinct label once per
+ * font and keep the result, so none of this runs per frame.
+ */
+
+#include "matchbox-keyboard.h"
+
+#include <hb.h>
+#include <hb-ft.h>
+
+/*
+ * Shapes str with the given (sized) face. Returns the number of glyphs and
+ * sets *glyphs to a malloc'ed array of glyph indices with pen positions
+ * relative to the label origin, in pixels and in visual order.
+ */
+int
+mb_kbd_shape_text (FT_Face                 face,
+		   const char             *str,
+		   MBKeyboardShapedGlyph **glyphs)
+{
+  hb_font_t           *font;
+  hb_buffer_t         *buf;
+  hb_glyph_info_t     *info;
+  hb_glyph_position_t *pos;
+  unsigned int         n_glyphs, i;
+  double               x = 0, y = 0;
+
+  font = hb_ft_font_create (face, NULL);
+  buf  = hb_buffer_create ();
+
+  hb_buffer_add_utf8 (buf, str, -1, 0, -1);
+  hb_buffer_guess_segment_properties (buf);
+
+  hb_shape (font, buf, NULL, 0);
+
+  info = hb_buffer_get_glyph_infos (buf, &n_glyphs);
+  pos  = hb_buffer_get_glyph_positions (buf, &n_glyphs);
+
+  *glyphs = util_malloc0 ((n_glyphs ? n_glyphs : 1)
+			  * sizeof(MBKeyboardShapedGlyph));
+
+  /* harfbuzz positions are 26.6 fixed point, y going up */
+  for (i = 0; i < n_glyphs; i++)
+    {
+      (*glyphs)[i].index = info[i].codepoint;
+      (*glyphs)[i].x     = x + pos[i].x_offset / 64.0;
+      (*glyphs)[i].y     = y - pos[i].y_offset / 64.0;
+
+      x += pos[i].x_advance / 64.0;
+      y -= pos[i].y_advance / 64.0;
+    }
+
+  DBG("shaped '%s' into %i glyphs, %s", str, n_glyphs,
+      hb_buffer_get_direction (buf) == HB_DIRECTION_RTL ? "rtl" : "ltr");
+
+  hb_buffer_destroy (buf);
+  hb_font_destroy (font);
+
+  return n_glyphs;
+}
@@ -25,17 +25,162 @@
 #define RAD 2
 #define R(x) (M_PI * (double)x / 180.)
 
+#define MB_KBD_CAIRO_BUCKETS 128
+
+/*
+ * Labels are turned into glyphs (shaped, with harfbuzz) once per font and
+ * kept along with their extents; drawing is then just cairo_show_glyphs().
+ */
+typedef struct MBKeyboardCairoLabel
+{
+  char                        *str;
+  cairo_glyph_t               *glyphs;
+  int                          n_glyphs;
+  cairo_text_extents_t         extents;
+  struct MBKeyboardCairoLabel *next;
+}
+MBKeyboardCairoLabel;
+
+struct MBKeyboardCairoLabels
+{
+  MBKeyboardCairoLabel        *buckets[MB_KBD_CAIRO_BUCKETS];
+};
+
 typedef struct MBKeyboardUIBackendCario
 {
   MBKeyboardUIBackend backend;
 
   cairo_surface_t    *surface;
   cairo_t            *cr;
+  MBKeyboardCairoLabels *labels;
 
   Pixmap              foo_pxm;
 
 } MBKeyboardUIBackendCairo;
 
+MBKeyboardCairoLabels*
+mb_kbd_cairo_labels_new (void)
+{
+  return util_malloc0 (sizeof (MBKeyboardCairoLabels));
+}
+
+/* Must be called whenever the font changes */
+void
+mb_kbd_cairo_labels_clear (MBKeyboardCairoLabels *labels)
+{
+  int i;
+
+  for (i = 0; i < MB_KBD_CAIRO_BUCKETS; i++)
+    while (labels->buckets[i])
+      {
+	MBKeyboardCairoLabel *label = labels->buckets[i];
+
+	labels->buckets[i] = label->next;
+
+	if (label->glyphs)
+	  cairo_glyph_free (label->glyphs);
+
+	free (label->str);
+	free (label);
+      }
+}
+
+void
+mb_kbd_cairo_labels_destroy (MBKeyboardCairoLabels *labels)
+{
+  mb_kbd_cairo_labels_clear (labels);
+  free (labels);
+}
+
+#ifdef WANT_HARFBUZZ
+static void
+mb_kbd_cairo_label_shape (MBKeyboardCairoLabel *label, cairo_t *cr)
+{
+  cairo_scaled_font_t   *font = cairo_get_scaled_font (cr);
+  MBKeyboardShapedGlyph *shaped;
+  FT_Face                face;
+  int                    i;
+
+  if (cairo_scaled_font_get_type (font) != CAIRO_FONT_TYPE_FT
+      || (face = cairo_ft_scaled_font_lock_face (font)) == NULL)
+    return;
+
+  label->n_glyphs = mb_kbd_shape_text (face, label->str, &shaped);
+
+  cairo_ft_scaled_font_unlock_face (font);
+
+  label->glyphs = cairo_glyph_allocate (label->n_glyphs);
+
+  for (i = 0; label->glyphs && i < label->n_glyphs; i++)
+    {
+      label->glyphs[i].index = shaped[i].index;
+      label->glyphs[i].x     = shaped[i].x;
+      label->glyphs[i].y     = shaped[i].y;
+    }
+
+  free (shaped);
+}
+#endif
+
+static MBKeyboardCairoLabel*
+mb_kbd_cairo_label_get (MBKeyboardCairoLabels *labels,
+			cairo_t               *cr,
+			const char            *str)
+{
+  MBKeyboardCairoLabel *label;
+  int                   bucket = util_str_hash (str) % MB_KBD_CAIRO_BUCKETS;
+
+  for (label = labels->buckets[bucket]; label != NULL; label = label->next)
+    if (streq (label->str, str))
+      return label;
+
+  label      = util_malloc0 (sizeof (MBKeyboardCairoLabel));
+  label->str = strdup (str);
+
+#ifdef WANT_HARFBUZZ
+  mb_kbd_cairo_label_shape (label, cr);
+#endif
+
+  /* no shaping, just the cmap */
+  if (label->glyphs == NULL)
+    cairo_scaled_font_text_to_glyphs (cairo_get_scaled_font (cr), 0, 0,
+				      str, -1,
+				      &label->glyphs, &label->n_glyphs,
+				      NULL, NULL, NULL);
+
+  cairo_glyph_extents (cr, label->glyphs, label->n_glyphs, &label->extents);
+
+  label->next = labels->buckets[bucket];
+  labels->buckets[bucket] = label;
+
+  return label;
+}
+
+void
+mb_kbd_cairo_label_extents (MBKeyboardCairoLabels *labels,
+			    cairo_t               *cr,
+			    const char            *str,
+			    cairo_text_extents_t  *extents)
+{
+  *extents = mb_kbd_cairo_label_get (labels, cr, str)->extents;
+}
+
+/* Draws the label with its origin at x,y */
+void
+mb_kbd_cairo_label_show (MBKeyboardCairoLabels *labels,
+			 cairo_t               *cr,
+			 const char            *str,
+			 double                 x,
+			 double                 y)
+{
+  MBKeyboardCairoLabel *label = mb_kbd_cairo_label_get (labels, cr, str);
+
+  cairo_save (cr);
+  cairo_translate (cr, x, y);
+  cairo_show_glyphs (cr, label->glyphs, label->n_glyphs);
+  cairo_restore (cr);
+}
+
 static void
 mb_kbd_ui_cairo_text_extents (MBKeyboardUI  *ui,
 			      const  char   *str,
@@ -55,7 +200,8 @@ mb_kbd_ui_cairo_text_extents (MBKeyboardUI  *ui,
    * stretch stretch below the base line will end up drawn partially, or even
    * completely, of the key.
    */
-  cairo_text_extents (cairo_backend->cr, str, &text_extents);
+  mb_kbd_cairo_label_extents (cairo_backend->labels, cairo_backend->cr,
+			      str, &text_extents);
   cairo_font_extents (cairo_backend->cr, &font_extents);
 
   w_t = round (text_extents.width  + 2 * PAD);
@@ -95,6 +241,8 @@ mb_kbd_ui_cairo_load_font(MBKeyboardUI *ui)
 
   cairo_set_font_size (cairo_backend->cr, pixel_size);
 
+  mb_kbd_cairo_labels_clear (cairo_backend->labels);
+
   return 1;
 }
 
@@ -206,7 +354,11 @@ mb_kbd_ui_cairo_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
 	cairo_font_extents_t font_extents;
         cairo_text_extents_t text_extents;
 
-        cairo_text_extents (cairo_backend->cr, face_str, &text_extents);
+        /* text_extents pads by PAD on each side, as does the key outline */
+        face_str = mb_kbd_ui_fit_label (ui, face_str, w - 3 * PAD, NULL);
+
+        mb_kbd_cairo_label_extents (cairo_backend->labels, cairo_backend->cr,
+                                    face_str, &text_extents);
 	cairo_font_extents (cairo_backend->cr, &font_extents);
 
         x1 = x + round (((w - text_extents.width) / 2.0) -
@@ -216,8 +368,8 @@ mb_kbd_ui_cairo_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
                          font_extents.descent) / 2.0  + font_extents.ascent) -
           PAD;
 
-        cairo_move_to(cairo_backend->cr, x1, y1);
-        cairo_show_text (cairo_backend->cr, face_str);
+        mb_kbd_cairo_label_show (cairo_backend->labels, cairo_backend->cr,
+                                 face_str, x1, y1);
       }
   }
   else if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceImage)
@@ -225,17 +377,21 @@ mb_kbd_ui_cairo_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
       double x1, y1, w1, h1;
       cairo_surface_t *img;
 
-      img = mb_kbd_key_get_image_face(key, state);
+      img = mb_kbd_image_cairo_surface
+        (mb_kbd_image_scaled (mb_kbd_key_get_image_face(key, state)));
 
-      w1 = cairo_image_surface_get_width (img);
-      h1 = cairo_image_surface_get_height (img);
+      if (img != NULL)
+        {
+          w1 = cairo_image_surface_get_width (img);
+          h1 = cairo_image_surface_get_height (img);
 
-      x1 = mb_kbd_key_abs_x(key) + ((mb_kbd_key_width(key) - w1) / 2.0);
-      y1 = mb_kbd_key_abs_y(key) + ((mb_kbd_key_height(key) - h1 ) / 2.0);
+          x1 = mb_kbd_key_abs_x(key) + ((mb_kbd_key_width(key) - w1) / 2.0);
+          y1 = mb_kbd_key_abs_y(key) + ((mb_kbd_key_height(key) - h1 ) / 2.0);
 
-      cairo_set_source_surface (cairo_backend->cr, img, x1, y1);
-      cairo_rectangle (cairo_backend->cr, x1, y1, w1, h1);
-      cairo_fill (cairo_backend->cr);
+          cairo_set_source_surface (cairo_backend->cr, img, x1, y1);
+          cairo_rectangle (cairo_backend->cr, x1, y1, w1, h1);
+          cairo_fill (cairo_backend->cr);
+        }
     }
 
   if ( mb_kbd_key_is_held(kbd, key) )
@@ -341,6 +497,7 @@ mb_kbd_ui_cairo_init(MBKeyboardUI *ui)
   MBKeyboardUIBackendCairo *cairo_backend = NULL;
 
   cairo_backend = util_malloc0(sizeof(MBKeyboardUIBackendCairo));
+  cairo_backend->labels = mb_kbd_cairo_labels_new ();
 
   cairo_backend->backend.init             = mb_kbd_ui_cairo_init;
   cairo_backend->backend.font_load        = mb_kbd_ui_cairo_load_font;
@@ -386,5 +543,7 @@ mb_kbd_ui_cairo_destroy (MBKeyboardUI *ui)
 
   cairo_destroy (cairo_backend->cr);
 
+  mb_kbd_cairo_labels_destroy (cairo_backend->labels);
+
   free (cairo_backend);
 }
@@ -26,12 +26,40 @@
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
 
+#ifdef WANT_HARFBUZZ
+#include <cairo/cairo-ft.h>
+#endif
+
+typedef struct MBKeyboardCairoLabels MBKeyboardCairoLabels;
+
 MBKeyboardUIBackend*
 mb_kbd_ui_cairo_init(MBKeyboardUI *ui);
 
 void
 mb_kbd_ui_cairo_destroy (MBKeyboardUI *ui);
 
+MBKeyboardCairoLabels*
+mb_kbd_cairo_labels_new (void);
+
+void
+mb_kbd_cairo_labels_clear (MBKeyboardCairoLabels *labels);
+
+void
+mb_kbd_cairo_labels_destroy (MBKeyboardCairoLabels *labels);
+
+void
+mb_kbd_cairo_label_extents (MBKeyboardCairoLabels *labels,
+			    cairo_t               *cr,
+			    const char            *str,
+			    cairo_text_extents_t  *extents);
+
+void
+mb_kbd_cairo_label_show (MBKeyboardCairoLabels *labels,
+			 cairo_t               *cr,
+			 const char            *str,
+			 double                 x,
+			 double                 y);
+
 #define MB_KBD_UI_BACKEND_INIT_FUNC(ui)  mb_kbd_ui_cairo_init((ui))
 #define MB_KBD_UI_BACKEND_DESTROY_FUNC(ui)  mb_kbd_ui_cairo_destroy((ui))
 
@@ -21,6 +21,44 @@
 
 #include "matchbox-keyboard.h"
 
+#define MB_KBD_XFT_BUCKETS      128
+#define MB_KBD_XFT_ATLAS_WIDTH  512
+
+/*
+ * Label atlas; every distinct key label is rendered once, as a whole, into
+ * a single A8 picture, those of the loaded layouts at font load and any
+ * others (fitted labels, later pages, reloaded faces) when first drawn.
+ * A label is then drawn with one composite of its atlas rectangle through
+ * a solid colour source. Glyph metrics are cached for shaping the labels.
+ */
+typedef struct MBKeyboardXftGlyph
+{
+  FT_UInt                    index;
+  XGlyphInfo                 info;
+  struct MBKeyboardXftGlyph *next;
+}
+MBKeyboardXftGlyph;
+
+typedef struct MBKeyboardXftRunGlyph
+{
+  MBKeyboardXftGlyph        *glyph;
+  int                        x, y;     /* pen position from label origin */
+}
+MBKeyboardXftRunGlyph;
+
+typedef struct MBKeyboardXftLabel
+{
+  char                      *str;
+  int                        width;    /* ink width, as text_extents */
+  int                        n_glyphs;
+  MBKeyboardXftRunGlyph     *run;
+  int                        ink_x, ink_y, ink_width, ink_height;
+  int                        atlas_x, atlas_y;
+  boolean                    placed;
+  struct MBKeyboardXftLabel *next;
+}
+MBKeyboardXftLabel;
+
 typedef struct MBKeyboardUIBackendXft
 {
   MBKeyboardUIBackend backend;
@@ -30,6 +68,14 @@ typedef struct MBKeyboardUIBackendXft
   XftDraw            *xft_backbuffer;
   GC                  xgc;
 
+  Pixmap              label_pixmap;
+  Picture             label_atlas;
+  Picture             font_fill;
+  int                 atlas_width, atlas_height;
+  int                 pack_x, pack_y, shelf_h; /* where the next label goes */
+  MBKeyboardXftGlyph *glyphs[MB_KBD_XFT_BUCKETS];
+  MBKeyboardXftLabel *labels[MB_KBD_XFT_BUCKETS];
+
   /* Our theme */
 
   XColor xcol_c5c5c5, xcol_d3d3d3, xcol_f0f0f0, xcol_f8f8f5,
@@ -37,6 +83,440 @@ typedef struct MBKeyboardUIBackendXft
 
 } MBKeyboardUIBackendXft;
 
+static MBKeyboardXftLabel*
+mb_kbd_ui_xft_label_lookup (MBKeyboardUIBackendXft *xft_backend,
+			    const char             *str)
+{
+  MBKeyboardXftLabel *label;
+
+  for (label = xft_backend->labels[util_str_hash(str) % MB_KBD_XFT_BUCKETS];
+       label != NULL;
+       label = label->next)
+    if (streq(label->str, str))
+      return label;
+
+  return NULL;
+}
+
+static MBKeyboardXftGlyph*
+mb_kbd_ui_xft_glyph_get (MBKeyboardUI           *ui,
+			 MBKeyboardUIBackendXft *xft_backend,
+			 FT_UInt                 index)
+{
+  MBKeyboardXftGlyph *glyph;
+  int                 bucket = index % MB_KBD_XFT_BUCKETS;
+
+  for (glyph = xft_backend->glyphs[bucket]; glyph != NULL; glyph = glyph->next)
+    if (glyph->index == index)
+      return glyph;
+
+  glyph        = util_malloc0(sizeof(MBKeyboardXftGlyph));
+  glyph->index = index;
+  glyph->next  = xft_backend->glyphs[bucket];
+
+  XftGlyphExtents(mb_kbd_ui_x_display(ui), xft_backend->font,
+		  &index, 1, &glyph->info);
+
+  xft_backend->glyphs[bucket] = glyph;
+
+  return glyph;
+}
+
+#ifdef WANT_HARFBUZZ
+/*
+ * Shapes the label, so scripts like Arabic get their presentation forms;
+ * the width is the ink extent of the shaped run.
+ */
+static void
+mb_kbd_ui_xft_label_shape (MBKeyboardUI           *ui,
+			   MBKeyboardUIBackendXft *xft_backend,
+			   MBKeyboardXftLabel     *label)
+{
+  MBKeyboardShapedGlyph *shaped;
+  FT_Face                face;
+  int                    i, left = 0, right = 0;
+
+  if ((face = XftLockFace(xft_backend->font)) == NULL)
+    return;
+
+  label->n_glyphs = mb_kbd_shape_text (face, label->str, &shaped);
+
+  XftUnlockFace(xft_backend->font);
+
+  label->run = malloc((label->n_glyphs ? label->n_glyphs : 1)
+		      * sizeof(MBKeyboardXftRunGlyph));
+
+  for (i = 0; i < label->n_glyphs; i++)
+    {
+      MBKeyboardXftRunGlyph *g = &label->run[i];
+
+      g->glyph = mb_kbd_ui_xft_glyph_get (ui, xft_backend, shaped[i].index);
+      g->x     = (int)(shaped[i].x + 0.5);
+      g->y     = (int)(shaped[i].y + 0.5);
+
+      if (i == 0 || g->x - g->glyph->info.x < left)
+	left = g->x - g->glyph->info.x;
+
+      if (i == 0 || g->x - g->glyph->info.x + g->glyph->info.width > right)
+	right = g->x - g->glyph->info.x + g->glyph->info.width;
+    }
+
+  label->width = right - left;
+
+  free(shaped);
+}
+#else
+/* one glyph per character, from the font's cmap */
+static void
+mb_kbd_ui_xft_label_shape (MBKeyboardUI           *ui,
+			   MBKeyboardUIBackendXft *xft_backend,
+			   MBKeyboardXftLabel     *label)
+{
+  XGlyphInfo  extents;
+  FcChar32    ucs4;
+  const char *str = label->str;
+  int         len, n, x = 0;
+
+  len = strlen(str);
+
+  label->run = malloc((len ? len : 1) * sizeof(MBKeyboardXftRunGlyph));
+
+  while (len > 0 && (n = FcUtf8ToUcs4((FcChar8*)str, &ucs4, len)) > 0)
+    {
+      MBKeyboardXftRunGlyph *g = &label->run[label->n_glyphs++];
+
+      g->glyph = mb_kbd_ui_xft_glyph_get (ui, xft_backend,
+					  XftCharIndex(mb_kbd_ui_x_display(ui),
+						       xft_backend->font,
+						       ucs4));
+      g->x     = x;
+      g->y     = 0;
+
+      x   += g->glyph->info.xOff;
+      str += n;
+      len -= n;
+    }
+
+  XftTextExtentsUtf8(mb_kbd_ui_x_display(ui),
+		     xft_backend->font,
+		     (unsigned char*)label->str,
+		     strlen(label->str),
+		     &extents);
+
+  label->width = extents.width;
+}
+#endif
+
+static void
+mb_kbd_ui_xft_label_add (MBKeyboardUI           *ui,
+			 MBKeyboardUIBackendXft *xft_backend,
+			 const char             *str)
+{
+  MBKeyboardXftLabel *label;
+  int                 bucket, i;
+  int                 left = 0, top = 0, right = 0, bottom = 0;
+  boolean             inked = False;
+
+  if (mb_kbd_ui_xft_label_lookup (xft_backend, str))
+    return;
+
+  label      = util_malloc0(sizeof(MBKeyboardXftLabel));
+  label->str = strdup(str);
+
+  mb_kbd_ui_xft_label_shape (ui, xft_backend, label);
+
+  /* the box the run's glyphs cover, from the pen origin */
+  for (i = 0; i < label->n_glyphs; i++)
+    {
+      MBKeyboardXftRunGlyph *g = &label->run[i];
+      int                    x0, y0;
+
+      if (g->glyph->info.width == 0 || g->glyph->info.height == 0)
+	continue;
+
+      x0 = g->x - g->glyph->info.x;
+      y0 = g->y - g->glyph->info.y;
+
+      if (!inked || x0 < left)
+	left = x0;
+      if (!inked || y0 < top)
+	top = y0;
+      if (!inked || x0 + g->glyph->info.width > right)
+	right = x0 + g->glyph->info.width;
+      if (!inked || y0 + g->glyph->info.height > bottom)
+	bottom = y0 + g->glyph->info.height;
+
+      inked = True;
+    }
+
+  label->ink_x      = left;
+  label->ink_y      = top;
+  label->ink_width  = right - left;
+  label->ink_height = bottom - top;
+
+  bucket = util_str_hash(label->str) % MB_KBD_XFT_BUCKETS;
+
+  label->next = xft_backend->labels[bucket];
+  xft_backend->labels[bucket] = label;
+}
+
+static void
+mb_kbd_ui_xft_label_atlas_free (MBKeyboardUI *ui)
+{
+  MBKeyboardUIBackendXft *xft_backend;
+  Display                *xdpy = mb_kbd_ui_x_display(ui);
+  int                     i;
+
+  xft_backend = (MBKeyboardUIBackendXft*)mb_kbd_ui_backend(ui);
+
+  for (i = 0; i < MB_KBD_XFT_BUCKETS; i++)
+    {
+      while (xft_backend->labels[i])
+	{
+	  MBKeyboardXftLabel *label = xft_backend->labels[i];
+
+	  xft_backend->labels[i] = label->next;
+	  if (label->run)
+	    free(label->run);
+	  free(label->str);
+	  free(label);
+	}
+
+      while (xft_backend->glyphs[i])
+	{
+	  MBKeyboardXftGlyph *glyph = xft_backend->glyphs[i];
+
+	  xft_backend->glyphs[i] = glyph->next;
+	  free(glyph);
+	}
+    }
+
+  if (xft_backend->label_atlas)
+    {
+      util_trap_x_errors();
+      XRenderFreePicture(xdpy, xft_backend->label_atlas);
+      XFreePixmap(xdpy, xft_backend->label_pixmap);
+      util_untrap_x_errors();
+
+      xft_backend->label_atlas  = None;
+      xft_backend->label_pixmap = None;
+    }
+
+  xft_backend->atlas_height = 0;
+  xft_backend->pack_x       = 0;
+  xft_backend->pack_y       = 0;
+  xft_backend->shelf_h      = 0;
+}
+
+/* whether the label has ink that can go into the atlas */
+#define mb_kbd_ui_xft_label_fits(xft_backend, label)		\
+  ((label)->ink_width > 0 && (label)->ink_height > 0		\
+   && (label)->ink_width <= (xft_backend)->atlas_width)
+
+/*
+ * Finds room for the labels not in the atlas yet, shelf packed, growing
+ * the atlas downwards if need be, and renders them into it.
+ */
+static void
+mb_kbd_ui_xft_label_atlas_place (MBKeyboardUI *ui)
+{
+  MBKeyboardUIBackendXft  *xft_backend;
+  Display                 *xdpy = mb_kbd_ui_x_display(ui);
+  MBKeyboardXftLabel      *label;
+  XftDraw                 *xft_draw;
+  XftColor                 white;
+  XRenderColor             clear = { 0, 0, 0, 0 };
+  int                      i, j, height, n = 0;
+
+  xft_backend = (MBKeyboardUIBackendXft*)mb_kbd_ui_backend(ui);
+
+  for (i = 0; i < MB_KBD_XFT_BUCKETS; i++)
+    for (label = xft_backend->labels[i]; label != NULL; label = label->next)
+      {
+	if (label->placed || !mb_kbd_ui_xft_label_fits(xft_backend, label))
+	  continue;
+
+	if (xft_backend->pack_x + label->ink_width > xft_backend->atlas_width)
+	  {
+	    xft_backend->pack_x   = 0;
+	    xft_backend->pack_y  += xft_backend->shelf_h + 1;
+	    xft_backend->shelf_h  = 0;
+	  }
+
+	label->atlas_x = xft_backend->pack_x;
+	label->atlas_y = xft_backend->pack_y;
+
+	if (label->ink_height > xft_backend->shelf_h)
+	  xft_backend->shelf_h = label->ink_height;
+
+	xft_backend->pack_x += label->ink_width + 1;
+	n++;
+      }
+
+  if (n == 0)
+    return;
+
+  height = xft_backend->pack_y + xft_backend->shelf_h;
+
+  if (height > xft_backend->atlas_height)
+    {
+      Pixmap  pixmap;
+      Picture atlas;
+
+      /* room to spare, so adding the odd label does not grow it each time */
+      if (xft_backend->atlas_height && height < 2 * xft_backend->atlas_height)
+	height = 2 * xft_backend->atlas_height;
+
+      pixmap = XCreatePixmap(xdpy, mb_kbd_ui_x_win_root(ui),
+			     xft_backend->atlas_width, height, 8);
+
+      atlas = XRenderCreatePicture(xdpy, pixmap,
+				   XRenderFindStandardFormat(xdpy,
+							     PictStandardA8),
+				   0, NULL);
+
+      XRenderFillRectangle(xdpy, PictOpSrc, atlas,
+			   &clear, 0, 0, xft_backend->atlas_width, height);
+
+      if (xft_backend->label_atlas)
+	{
+	  XRenderComposite(xdpy, PictOpSrc, xft_backend->label_atlas, None,
+			   atlas, 0, 0, 0, 0, 0, 0,
+			   xft_backend->atlas_width,
+			   xft_backend->atlas_height);
+
+	  XRenderFreePicture(xdpy, xft_backend->label_atlas);
+	  XFreePixmap(xdpy, xft_backend->label_pixmap);
+	}
+
+      xft_backend->label_pixmap = pixmap;
+      xft_backend->label_atlas  = atlas;
+      xft_backend->atlas_height = height;
+    }
+
+  DBG("%i more labels, atlas now %ix%i", n,
+      xft_backend->atlas_width, xft_backend->atlas_height);
+
+  /* let Xft do the rasterising, once */
+  xft_draw = XftDrawCreateAlpha(xdpy, xft_backend->label_pixmap, 8);
+
+  memset(&white, 0, sizeof(white));
+  white.color.alpha = 0xffff;
+
+  for (i = 0; i < MB_KBD_XFT_BUCKETS; i++)
+    for (label = xft_backend->labels[i]; label != NULL; label = label->next)
+      if (!label->placed && mb_kbd_ui_xft_label_fits(xft_backend, label))
+	{
+	  XftGlyphSpec *specs = malloc(label->n_glyphs * sizeof(XftGlyphSpec));
+
+	  for (j = 0; j < label->n_glyphs; j++)
+	    {
+	      specs[j].glyph = label->run[j].glyph->index;
+	      specs[j].x     = label->atlas_x - label->ink_x + label->run[j].x;
+	      specs[j].y     = label->atlas_y - label->ink_y + label->run[j].y;
+	    }
+
+	  XftDrawGlyphSpec(xft_draw, &white, xft_backend->font,
+			   specs, label->n_glyphs);
+	  free(specs);
+
+	  label->placed = True;
+	}
+
+  XftDrawDestroy(xft_draw);
+}
+
+/*
+ * Starts the atlas afresh with the labels of every loaded layout.
+ */
+static void
+mb_kbd_ui_xft_label_atlas_build (MBKeyboardUI *ui)
+{
+  MBKeyboardUIBackendXft  *xft_backend;
+  MBKeyboard              *kbd  = mb_kbd_ui_kbd(ui);
+  MBKeyboardXftLabel      *label;
+  List                    *layout_item, *row_item, *key_item;
+  int                      i, state;
+
+  xft_backend = (MBKeyboardUIBackendXft*)mb_kbd_ui_backend(ui);
+
+  mb_kbd_ui_xft_label_atlas_free (ui);
+
+  for (layout_item = kbd->layouts;
+       layout_item != NULL;
+       layout_item = util_list_next(layout_item))
+    for (row_item = mb_kbd_layout_rows(layout_item->data);
+	 row_item != NULL;
+	 row_item = util_list_next(row_item))
+      mb_kbd_row_for_each_key(row_item->data, key_item)
+	{
+	  mb_kdb_key_foreach_state(key_item->data, state)
+	    {
+	      const char *str;
+
+	      if (mb_kbd_key_get_face_type(key_item->data, state)
+		  != MBKeyboardKeyFaceGlyph)
+		continue;
+
+	      if ((str = mb_kbd_key_get_glyph_face(key_item->data, state)))
+		mb_kbd_ui_xft_label_add (ui, xft_backend, str);
+	    }
+	}
+
+  xft_backend->atlas_width = MB_KBD_XFT_ATLAS_WIDTH;
+
+  for (i = 0; i < MB_KBD_XFT_BUCKETS; i++)
+    for (label = xft_backend->labels[i]; label != NULL; label = label->next)
+      if (label->ink_width + 1 > xft_backend->atlas_width)
+	xft_backend->atlas_width = label->ink_width + 1;
+
+  mb_kbd_ui_xft_label_atlas_place (ui);
+}
+
+/*
+ * Draws a label with its pen starting at x on baseline y, adding it to the
+ * atlas first if it is new; returns False if it cannot be drawn from the
+ * atlas.
+ */
+static boolean
+mb_kbd_ui_xft_draw_label (MBKeyboardUI *ui, const char *str, int x, int y)
+{
+  MBKeyboardUIBackendXft *xft_backend;
+  MBKeyboardXftLabel     *label;
+
+  xft_backend = (MBKeyboardUIBackendXft*)mb_kbd_ui_backend(ui);
+
+  if (xft_backend->font == NULL)
+    return False;
+
+  if ((label = mb_kbd_ui_xft_label_lookup (xft_backend, str)) == NULL)
+    {
+      mb_kbd_ui_xft_label_add (ui, xft_backend, str);
+      mb_kbd_ui_xft_label_atlas_place (ui);
+
+      label = mb_kbd_ui_xft_label_lookup (xft_backend, str);
+    }
+
+  /* nothing to draw, e.g. a space */
+  if (label->ink_width == 0 || label->ink_height == 0)
+    return True;
+
+  if (!label->placed)
+    return False;
+
+  XRenderComposite(mb_kbd_ui_x_display(ui),
+		   PictOpOver,
+		   xft_backend->font_fill,
+		   xft_backend->label_atlas,
+		   XftDrawPicture (xft_backend->xft_backbuffer),
+		   0, 0,
+		   label->atlas_x, label->atlas_y,
+		   x + label->ink_x, y + label->ink_y,
+		   label->ink_width, label->ink_height);
+
+  return True;
+}
+
 static void
 mb_kbd_ui_xft_text_extents (MBKeyboardUI        *ui,
 			    const char          *str,
@@ -45,9 +525,18 @@ mb_kbd_ui_xft_text_extents (MBKeyboardUI        *ui,
 {
   XGlyphInfo  extents;
   MBKeyboardUIBackendXft *xft_backend = NULL;
+  MBKeyboardXftLabel     *label;
 
   xft_backend = (MBKeyboardUIBackendXft*)mb_kbd_ui_backend(ui);
 
+  *height = xft_backend->font->ascent + xft_backend->font->descent;
+
+  if ((label = mb_kbd_ui_xft_label_lookup (xft_backend, str)) != NULL)
+    {
+      *width = label->width;
+      return;
+    }
+
   XftTextExtentsUtf8(mb_kbd_ui_x_display(ui),
 		     xft_backend->font,
 		     (unsigned char*)str,
@@ -56,7 +545,6 @@ mb_kbd_ui_xft_text_extents (MBKeyboardUI        *ui,
 
   *width  = extents.width;
   /* *height = extents.height; */
-  *height = xft_backend->font->ascent + xft_backend->font->descent;
 }
 
 void
@@ -106,6 +594,8 @@ mb_kbd_ui_xft_load_font(MBKeyboardUI *ui)
 					   desc)) == NULL)
     return 0;
 
+  mb_kbd_ui_xft_label_atlas_build (ui);
+
   return 1;
 }
 
@@ -133,18 +623,14 @@ mb_kbd_ui_xft_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
   kbd         = mb_kbd_ui_kbd(ui);
 
 
+  /*
+   * The layout gives keys exact, shared edges; XDrawRectangles() covers
+   * width + 1 pixels, so the outline rect is one short to stay inside.
+   */
   rect.x      = mb_kbd_key_abs_x(key);
   rect.y      = mb_kbd_key_abs_y(key);
-  rect.width  = mb_kbd_key_width(key);
-  rect.height = mb_kbd_key_height(key);
-
-  /* Hacky clip to work around issues with off by ones in layout code :( */
-
-  if (rect.x + rect.width >= mb_kbd_ui_x_win_width(ui))
-    rect.width  = mb_kbd_ui_x_win_width(ui) - rect.x - 1;
-
-  if (rect.y + rect.height >= mb_kbd_ui_x_win_height(ui))
-    rect.height  = mb_kbd_ui_x_win_height(ui) - rect.y - 1;
+  rect.width  = mb_kbd_key_width(key) - 1;
+  rect.height = mb_kbd_key_height(key) - 1;
 
   /* clear it */
 
@@ -204,12 +690,11 @@ mb_kbd_ui_xft_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
     + mb_kbd_keys_margin(kbd)
     + mb_kbd_keys_pad(kbd);
 
-  /* Why does below need +1's ? */
   XFillRectangle(xdpy, backbuffer, xft_backend->xgc,
 		 rect.x + side_pad,
 		 rect.y + side_pad,
-		 rect.width  - (side_pad * 2) + 1,
-		 rect.height - (side_pad * 2) + 1);
+		 mb_kbd_key_width(key)  - (side_pad * 2),
+		 mb_kbd_key_height(key) - (side_pad * 2));
 
   /* real code is here */
 
@@ -235,13 +720,15 @@ mb_kbd_ui_xft_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
   if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceGlyph)
     {
       const char *face_str = mb_kbd_key_get_glyph_face(key, state);
-      int         face_str_w, face_str_h;
+      int         face_str_w;
 
       if (face_str)
 	{
 	  int x, y;
 
-	  mb_kbd_ui_xft_text_extents(ui, face_str, &face_str_w, &face_str_h);
+	  face_str = mb_kbd_ui_fit_label(ui, face_str,
+					 mb_kbd_key_width(key) - (side_pad * 2),
+					 &face_str_w);
 
 	  x = mb_kbd_key_abs_x(key) + ((mb_kbd_key_width(key) - face_str_w)/2);
 
@@ -250,13 +737,15 @@ mb_kbd_ui_xft_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
                  - (xft_backend->font->ascent + xft_backend->font->descent))
 	                             / 2 );
 
-	  XftDrawStringUtf8(xft_backend->xft_backbuffer,
-			    &xft_backend->font_col,
-			    xft_backend->font,
-			    x,
-			    y + xft_backend->font->ascent,
-			    (unsigned char*)face_str,
-			    strlen(face_str));
+	  if (!mb_kbd_ui_xft_draw_label (ui, face_str,
+					 x, y + xft_backend->font->ascent))
+	    XftDrawStringUtf8(xft_backend->xft_backbuffer,
+			      &xft_backend->font_col,
+			      xft_backend->font,
+			      x,
+			      y + xft_backend->font->ascent,
+			      (unsigned char*)face_str,
+			      strlen(face_str));
 	}
     }
   else if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceImage)
@@ -264,7 +753,7 @@ mb_kbd_ui_xft_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
       int x, y, w, h;
       MBKeyboardImage *img;
 
-      img = mb_kbd_key_get_image_face(key, state);
+      img = mb_kbd_image_scaled (mb_kbd_key_get_image_face(key, state));
 
       w = mb_kbd_image_width (img);
       h = mb_kbd_image_height (img);
@@ -273,12 +762,9 @@ mb_kbd_ui_xft_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
       y = mb_kbd_key_abs_y(key) + ((mb_kbd_key_height(key) - h ) / 2);
 
 
-      XRenderComposite(xdpy,
-		       PictOpOver,
-		       mb_kbd_image_render_picture (img),
-		       None,
-		       XftDrawPicture (xft_backend->xft_backbuffer),
-		       0, 0, 0, 0, x, y, w, h);
+      mb_kbd_image_render (img,
+			   XftDrawPicture (xft_backend->xft_backbuffer),
+			   x, y);
     }
 }
 
@@ -334,6 +820,10 @@ mb_kbd_ui_xft_resources_create(MBKeyboardUI  *ui)
 		     &coltmp,
 		     &xft_backend->font_col);
 
+  /* the same colour as a source for label atlas composites */
+  xft_backend->font_fill = XRenderCreateSolidFill(mb_kbd_ui_x_display(ui),
+						  &coltmp);
+
   xft_backend->xgc = XCreateGC(mb_kbd_ui_x_display(ui),
 			       mb_kbd_ui_x_win(ui), 0, NULL);
 
@@ -393,5 +883,14 @@ mb_kbd_ui_xft_destroy (MBKeyboardUI *ui)
   MBKeyboardUIBackend *backend = mb_kbd_ui_backend (ui);
   MBKeyboardUIBackendXft *xft_backend = (MBKeyboardUIBackendXft*)backend;
 
+  mb_kbd_ui_xft_label_atlas_free (ui);
+
+  if (xft_backend->font_fill)
+    {
+      util_trap_x_errors();
+      XRenderFreePicture(mb_kbd_ui_x_display(ui), xft_backend->font_fill);
+      util_untrap_x_errors();
+    }
+
   free (xft_backend);
 }
@@ -28,12 +28,55 @@
 
 #include "matchbox-keyboard.h"
 
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+
+#define MB_KBD_UI_FIT_BUCKETS           64
+
 #define PROP_MOTIF_WM_HINTS_ELEMENTS    5
 #define MWM_HINTS_DECORATIONS          (1L << 1)
 #define MWM_DECOR_BORDER               (1L << 1)
 
 static FakeKey *fakekey = NULL;
 
+/*
+ * What the UI keeps per layout, so switching back to one that has been
+ * shown before costs no more than a redraw.
+ */
+typedef struct MBKeyboardUILayout
+{
+  MBKeyboardLayout   *layout;
+
+  /* base size of the compact [0] and extended [1] key sets */
+  int                 set_alloc_width[2], set_alloc_height[2];
+
+  /* window size, key set and font size the keys were last laid out for */
+  int                 width, height;
+  boolean             extended;
+  int                 font_pt_size;
+}
+MBKeyboardUILayout;
+
+/* where a monitor is on the root window; width 0 when it is off */
+typedef struct MBKeyboardUIMonitor
+{
+  unsigned long       crtc;
+  int                 x, y, width, height;
+}
+MBKeyboardUIMonitor;
+
+/* a label as fitted to a key width, see mb_kbd_ui_fit_label() */
+typedef struct MBKeyboardUIFit
+{
+  char                   *str;
+  int                     width;
+  char                   *fitted;        /* NULL if str fits as it is */
+  int                     fitted_width;
+  struct MBKeyboardUIFit *next;
+}
+MBKeyboardUIFit;
+
 typedef struct
 {
   unsigned long       flags;
@@ -50,15 +93,30 @@ struct MBKeyboardUI
   Window              xwin_root, xwin, xembedder;
 #if WANT_GTK_WIDGET
   GdkWindow          *gwin;
+  GdkWindow          *parent;
+#else
+  Window              parent;   /* widget mode only */
 #endif
   Pixmap              backbuffer;
 
   int                 dpy_width, dpy_height;
   int                 xwin_width, xwin_height;
 
-  int                 key_uwidth, key_uheight;
+  /*
+   * Display geometry as last reported by the server; dpy_width/height is
+   * the monitor we are on, see mb_kbd_ui_handle_display_event().
+   */
+  int                 root_width, root_height;
+  int                 xwin_x, xwin_y;
+  MBKeyboardUIMonitor *monitors;
+  int                 n_monitors;
+  Bool                have_randr;
+  int                 randr_event_base;
 
   int                 base_alloc_width, base_alloc_height;
+
+  List               *layouts; /* MBKeyboardUILayout, as they get shown */
+  MBKeyboardUILayout *current;
   int                 base_font_pt_size;
 
   Bool                want_embedding;
@@ -71,6 +129,13 @@ struct MBKeyboardUI
 
   MBKeyboardDisplayOrientation dpy_orientation;
   MBKeyboardDisplayOrientation valid_orientation;
+
+  MBKeyboardUIFit    *fits[MB_KBD_UI_FIT_BUCKETS];
+
+  /* ConfigureNotify coalescing, see mb_kbd_ui_queue_configure() */
+  Bool                configure_pending;
+  int                 pending_width, pending_height;
+  int                 skipped_layouts;
 };
 
 static int
@@ -152,19 +217,47 @@ get_desktop_area(MBKeyboardUI *ui, int *x, int *y, int *width, int *height)
   return True;
 }
 
-void
-mb_kbd_ui_update_display_size(MBKeyboardUI *ui)
+/*
+ * Picks the monitor the keyboard is (mostly) on, falling back to the one
+ * at the origin or the whole root, and takes its size as the display's.
+ */
+static void
+mb_kbd_ui_set_display_size(MBKeyboardUI *ui)
 {
-  XWindowAttributes winattr;
+  MBKeyboardUIMonitor *monitor = NULL;
+  int                  i, cx, cy;
 
-  MARK();
+  cx = ui->xwin_x + ui->xwin_width / 2;
+  cy = ui->xwin_y + ui->xwin_height / 2;
 
-  XGetWindowAttributes(ui->xdpy, ui->xwin_root, &winattr);
+  for (i = 0; i < ui->n_monitors; i++)
+    {
+      MBKeyboardUIMonitor *m = &ui->monitors[i];
 
-  /* XXX should actually trap an X error here */
+      if (m->width == 0)
+	continue;
+
+      if (cx >= m->x && cx < m->x + m->width
+	  && cy >= m->y && cy < m->y + m->height)
+	{
+	  monitor = m;
+	  break;
+	}
 
-  ui->dpy_width  = winattr.width;
-  ui->dpy_height = winattr.height;
+      if (monitor == NULL || (m->x == 0 && m->y == 0))
+	monitor = m;
+    }
+
+  if (monitor)
+    {
+      ui->dpy_width  = monitor->width;
+      ui->dpy_height = monitor->height;
+    }
+  else
+    {
+      ui->dpy_width  = ui->root_width;
+      ui->dpy_height = ui->root_height;
+    }
 
   if (ui->dpy_width > ui->dpy_height)
     ui->dpy_orientation = MBKeyboardDisplayLandscape;
@@ -176,325 +269,409 @@ mb_kbd_ui_update_display_size(MBKeyboardUI *ui)
     mb_kbd_ui_hide (ui);
 
   DBG("#### Orientation know '%i'", ui->dpy_orientation);
-
-  return;
 }
 
-static boolean
-want_extended(MBKeyboardUI *ui)
+#ifdef HAVE_XRANDR
+static void
+mb_kbd_ui_set_monitor(MBKeyboardUI *ui,
+		      RRCrtc        crtc,
+		      int           x,
+		      int           y,
+		      int           width,
+		      int           height)
 {
-  /* Are we in portrait ? */
-  if (ui->dpy_width > ui->dpy_height)
-    return True;
+  MBKeyboardUIMonitor *m;
+  int                  i;
 
-  return False;
-}
+  for (i = 0; i < ui->n_monitors; i++)
+    if (ui->monitors[i].crtc == crtc)
+      break;
 
-void
-mb_kbd_ui_send_press(MBKeyboardUI        *ui,
-		     const char          *utf8_char_in,
-		     int                  modifiers)
-{
-  DBG("Sending '%s'", utf8_char_in);
-  fakekey_press(ui->fakekey, (unsigned char*)utf8_char_in, -1, modifiers);
-}
+  if (i == ui->n_monitors)
+    {
+      ui->monitors = realloc(ui->monitors,
+			     ++ui->n_monitors * sizeof(MBKeyboardUIMonitor));
+      ui->monitors[i].crtc = crtc;
+    }
 
-void
-mb_kbd_ui_send_keysym_press(MBKeyboardUI  *ui,
-			    KeySym         ks,
-			    int            modifiers)
-{
-  fakekey_press_keysym(ui->fakekey, ks, modifiers);
-}
+  m = &ui->monitors[i];
 
-void
-mb_kbd_ui_send_release(MBKeyboardUI  *ui)
-{
-  fakekey_release(ui->fakekey);
+  m->x      = x;
+  m->y      = y;
+  m->width  = width;
+  m->height = height;
+
+  DBG("crtc %lu now %dx%d+%d+%d", crtc, width, height, x, y);
 }
+#endif
 
-static void
-mb_kdb_ui_unit_key_size(MBKeyboardUI *ui, int *width, int *height)
+/*
+ * Asks the server for the display geometry; only done once, at start up,
+ * after that the events keep us up to date.
+ */
+void
+mb_kbd_ui_update_display_size(MBKeyboardUI *ui)
 {
-  MBKeyboardLayout       *layout;
-  List                   *row_item, *key_item;
-  MBKeyboardKeyStateType  state;
-  const char             *face_str;
-
-  *width = 0; *height = 0;
-
-  layout   = mb_kbd_get_selected_layout(ui->kbd);
-  row_item = mb_kbd_layout_rows(layout);
+  XWindowAttributes winattr;
 
-  /*
-   * Figure out the base size of a 'regular' single glyph key.
-   */
+  MARK();
 
-  while (row_item != NULL)
-    {
-      mb_kbd_row_for_each_key(row_item->data, key_item)
-	{
-	  MBKeyboardKey *key = key_item->data;
+  XGetWindowAttributes(ui->xdpy, ui->xwin_root, &winattr);
 
-          if (!mb_kbd_is_extended(ui->kbd)
-              && mb_kbd_key_get_extended(key))
-            continue;
+  /* XXX should actually trap an X error here */
 
-	  /* Ignore keys whose width is forced */
-	  if (mb_kbd_key_get_req_uwidth(key))
-	    continue;
+  ui->root_width  = winattr.width;
+  ui->root_height = winattr.height;
 
-	  mb_kdb_key_foreach_state(key, state)
-	    {
-	      if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceGlyph)
-		{
-		  face_str = mb_kbd_key_get_glyph_face(key, state);
+#ifdef HAVE_XRANDR
+  {
+    int major, minor, error_base;
 
-		  if (util_utf8_char_cnt(face_str) == 1)
-		    {
-		      int str_w =0, str_h = 0;
+    if (!ui->have_randr
+	&& XRRQueryExtension(ui->xdpy, &ui->randr_event_base, &error_base)
+	&& XRRQueryVersion(ui->xdpy, &major, &minor)
+	&& (major > 1 || (major == 1 && minor >= 2)))
+      {
+	XRRScreenResources *res;
+	int                 i;
 
-                      ui->backend->text_extents(ui, face_str, &str_w, &str_h);
+	ui->have_randr = True;
 
-                      if (str_w > *width) *width = str_w;
-                      if (str_h > *height) *height = str_h;
+	XRRSelectInput(ui->xdpy, ui->xwin_root,
+		       RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
 
-		    }
-		}
-	      else if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceImage)
-		{
-		  MBKeyboardImage *img;
+	if ((res = XRRGetScreenResources(ui->xdpy, ui->xwin_root)) != NULL)
+	  {
+	    for (i = 0; i < res->ncrtc; i++)
+	      {
+		XRRCrtcInfo *info;
 
-		  img = mb_kbd_key_get_image_face(key, state);
+		if ((info = XRRGetCrtcInfo(ui->xdpy, res,
+					   res->crtcs[i])) == NULL)
+		  continue;
 
-                  if (mb_kbd_image_width (img) > *width)
-                    *width = mb_kbd_image_width (img);
+		mb_kbd_ui_set_monitor(ui, res->crtcs[i], info->x, info->y,
+				      info->mode != None ? info->width : 0,
+				      info->mode != None ? info->height : 0);
 
-                  if (mb_kbd_image_height (img) > *height)
-                    *height = mb_kbd_image_height (img);
-                }
-            }
-        }
-      row_item = util_list_next(row_item);
-    }
+		XRRFreeCrtcInfo(info);
+	      }
 
-  /* FIXME: hack for small displays */
-  if (mb_kbd_ui_display_height(ui) <= 320)
-    {
-      *height += 4;
-    }
+	    XRRFreeScreenResources(res);
+	  }
+      }
+  }
+#endif
 
+  mb_kbd_ui_set_display_size(ui);
 }
 
+/* where the window is on the root, as the monitor we are on goes by it */
 static void
-mb_kbd_ui_min_key_size(MBKeyboardUI  *ui,
-		       MBKeyboardKey *key,
-		       int           *width,
-		       int           *height)
+mb_kbd_ui_update_position(MBKeyboardUI *ui)
 {
-  const char *face_str = NULL;
-  int         max_w = 0, max_h = 0, state, kw, kh;
+  Window child;
 
-  /*
-   * Figure out how small a key can really be UI wise.
-  */
-
-  if (mb_kbd_key_get_req_uwidth(key) || mb_kbd_key_is_blank(key))
-    {
-      *width = (ui->key_uwidth * mb_kbd_key_get_req_uwidth(key)) / 1000 ;
-      *height = ui->key_uheight;
-      return;
-    }
+  XTranslateCoordinates(ui->xdpy, ui->xwin, ui->xwin_root, 0, 0,
+			&ui->xwin_x, &ui->xwin_y, &child);
+}
 
-  mb_kdb_key_foreach_state(key, state)
+/*
+ * Keeps the display geometry current from the events the server sends
+ * anyway, so working out our size never has to wait on a round trip.
+ * Returns True if the event was only of interest here.
+ */
+Bool
+mb_kbd_ui_handle_display_event(MBKeyboardUI *ui, XEvent *xev)
+{
+  if (xev->type == ConfigureNotify)
     {
-      if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceGlyph)
+      if (xev->xconfigure.window == ui->xwin_root)
 	{
-	  face_str = mb_kbd_key_get_glyph_face(key, state);
+	  ui->root_width  = xev->xconfigure.width;
+	  ui->root_height = xev->xconfigure.height;
 
-	  ui->backend->text_extents(ui, face_str, &kw, &kh);
-
-	  if (kw > max_w) max_w = kw;
-	  if (kh > max_h) max_h = kh;
+	  mb_kbd_ui_set_display_size(ui);
+	  return True;
 	}
-      else if (mb_kbd_key_get_face_type(key, state) == MBKeyboardKeyFaceImage)
-	{
-	  MBKeyboardImage *img;
 
-	  img = mb_kbd_key_get_image_face(key, state);
+      if (xev->xconfigure.window == ui->xwin)
+	{
+	  /*
+	   * Window managers send root relative positions synthetically; the
+	   * real events are relative to the parent, which may be a frame.
+	   */
+	  if (xev->xconfigure.send_event)
+	    {
+	      ui->xwin_x = xev->xconfigure.x;
+	      ui->xwin_y = xev->xconfigure.y;
+	    }
+	  else
+	    mb_kbd_ui_update_position(ui);
 
-          if (mb_kbd_image_width (img) > max_w)
-            max_w = mb_kbd_image_width (img);
+	  mb_kbd_ui_set_display_size(ui);
+	}
 
-          if (mb_kbd_image_height (img) > max_h)
-            max_h = mb_kbd_image_height (img);
-        }
+      return False;
     }
-}
 
-void
-mb_kbd_ui_allocate_ui_layout(MBKeyboardUI *ui,
-			     int          *width,
-			     int          *height)
-{
-  MBKeyboardLayout *layout;
-  List             *row_item, *key_item;
-  int               key_y = 0, key_x = 0;
-  int               row_y, max_row_key_height, max_row_width;
+  if (xev->type == MapNotify && xev->xmap.window == ui->xwin)
+    {
+      mb_kbd_ui_update_position(ui);
+      mb_kbd_ui_set_display_size(ui);
+      return False;
+    }
 
-  layout = mb_kbd_get_selected_layout(ui->kbd);
+#ifdef HAVE_XRANDR
+  if (!ui->have_randr)
+    return False;
 
-  /* Do an initial run to figure out a 'base' size for single glyph keys */
-  mb_kdb_ui_unit_key_size(ui, &ui->key_uwidth, &ui->key_uheight);
+  if (xev->type == ui->randr_event_base + RRScreenChangeNotify)
+    {
+      XRRScreenChangeNotifyEvent *sce = (XRRScreenChangeNotifyEvent *)xev;
 
-  row_item = mb_kbd_layout_rows(layout);
+      XRRUpdateConfiguration(xev);
 
-  row_y = mb_kbd_row_spacing(ui->kbd);
+      ui->root_width  = sce->width;
+      ui->root_height = sce->height;
 
-  max_row_width = 0;
+      mb_kbd_ui_set_display_size(ui);
+      return True;
+    }
 
-  /*
-   * First of entire keyboard, basically get the minimum space needed
-  */
-  while (row_item != NULL)
+  if (xev->type == ui->randr_event_base + RRNotify
+      && ((XRRNotifyEvent *)xev)->subtype == RRNotify_CrtcChange)
     {
-      MBKeyboardRow *row = row_item->data;
-
-      key_x = mb_kbd_col_spacing(ui->kbd);
+      XRRCrtcChangeNotifyEvent *cce = (XRRCrtcChangeNotifyEvent *)xev;
 
-      max_row_key_height = 0;
+      mb_kbd_ui_set_monitor(ui, cce->crtc, cce->x, cce->y,
+			    cce->mode != None ? cce->width : 0,
+			    cce->mode != None ? cce->height : 0);
 
-      mb_kbd_row_for_each_key(row, key_item)
-        {
-          int            key_w = 0, key_h = 0;
-          MBKeyboardKey *key = key_item->data;
+      mb_kbd_ui_set_display_size(ui);
+      return True;
+    }
+#endif
 
-	  mb_kbd_key_set_extra_height_pad(key, 0);
-	  mb_kbd_key_set_extra_width_pad(key, 0);
-	  mb_kbd_key_set_geometry(key, 0, 0, 0, 0);
+  return False;
+}
 
-	  if (!mb_kbd_is_extended(ui->kbd) && mb_kbd_key_get_extended(key))
-	    continue;
+static boolean
+want_extended(MBKeyboardUI *ui)
+{
+  /* Are we in portrait ? */
+  if (ui->dpy_width > ui->dpy_height)
+    return True;
 
-	  mb_kbd_ui_min_key_size(ui, key, &key_w, &key_h);
+  return False;
+}
 
-	  if (!mb_kbd_key_get_req_uwidth(key)
-	      && key_w < ui->key_uwidth)
-	    key_w = ui->key_uwidth;
+/*
+ * The UI as the keyboard core's frontend; key events go out through
+ * libfakekey, measuring and drawing through the backend.
+ */
 
-          if (key_h < ui->key_uheight)
-            key_h = ui->key_uheight;
+static int
+mb_kbd_ui_fakekey_modifiers(int modifiers)
+{
+  int flags = 0;
 
-	  key_y = 0;
+  if (modifiers & MBKeyboardStateShifted)
+    flags |= FAKEKEYMOD_SHIFT;
 
-          key_w += 2 * ( mb_kbd_keys_border(ui->kbd)
-                         + mb_kbd_keys_margin(ui->kbd)
-                         + mb_kbd_keys_pad(ui->kbd) );
+  if (modifiers & MBKeyboardStateControl)
+    flags |= FAKEKEYMOD_CONTROL;
 
-          key_h += 2 * ( mb_kbd_keys_border(ui->kbd)
-                         + mb_kbd_keys_margin(ui->kbd)
-                         + mb_kbd_keys_pad(ui->kbd) );
+  if (modifiers & MBKeyboardStateAlt)
+    flags |= FAKEKEYMOD_ALT;
 
-          if (key_h > max_row_key_height)
-            max_row_key_height = key_h;
+  if (modifiers & MBKeyboardStateMod1)
+    flags |= FAKEKEYMOD_META;
 
-          mb_kbd_key_set_geometry(key, key_x, key_y, key_w, key_h);
+  return flags;
+}
 
-          key_x += (mb_kbd_col_spacing(ui->kbd) + key_w);
-        }
+static void
+mb_kbd_ui_send_press(MBKeyboard *kbd,
+		     const char *utf8_char_in,
+		     int         modifiers)
+{
+  fakekey_press(mb_kbd_get_ui(kbd)->fakekey, (unsigned char*)utf8_char_in, -1,
+		mb_kbd_ui_fakekey_modifiers(modifiers));
+}
 
-      if (key_x > max_row_width) /* key_x now represents row width */
-	max_row_width = key_x;
+static void
+mb_kbd_ui_send_keysym_press(MBKeyboard *kbd,
+			    KeySym      ks,
+			    int         modifiers)
+{
+  fakekey_press_keysym(mb_kbd_get_ui(kbd)->fakekey, ks,
+		       mb_kbd_ui_fakekey_modifiers(modifiers));
+}
 
-      mb_kbd_row_set_y(row, row_y);
+static void
+mb_kbd_ui_send_release(MBKeyboard *kbd)
+{
+  fakekey_release(mb_kbd_get_ui(kbd)->fakekey);
+}
 
-      row_y += max_row_key_height + mb_kbd_row_spacing(ui->kbd);
+static void
+mb_kbd_ui_text_extents(MBKeyboard *kbd,
+		       const char *str,
+		       int        *width,
+		       int        *height)
+{
+  MBKeyboardUI *ui = mb_kbd_get_ui(kbd);
 
-      row_item = util_list_next(row_item);
-    }
+  ui->backend->text_extents(ui, str, width, height);
+}
 
-  *height = row_y;
+static KeySym
+mb_kbd_ui_lookup_keysym(MBKeyboard *kbd, const char *name)
+{
+  return XStringToKeysym(name);
+}
 
-  row_item = mb_kbd_layout_rows(layout);
+static void
+mb_kbd_ui_image_size(MBKeyboardImage *img, int *width, int *height)
+{
+  *width  = mb_kbd_image_width(img);
+  *height = mb_kbd_image_height(img);
+}
 
-  /* Now pass again allocating any extra space with have left over */
+static void
+mb_kbd_ui_frontend_redraw(MBKeyboard *kbd)
+{
+  mb_kbd_ui_redraw(mb_kbd_get_ui(kbd));
+}
 
-  while (row_item != NULL)
-    {
-      MBKeyboardRow *row        = row_item->data;
-      int            n_fillers  = 0, free_space = 0, new_w = 0;
+static void
+mb_kbd_ui_frontend_redraw_key(MBKeyboard *kbd, MBKeyboardKey *key)
+{
+  mb_kbd_ui_redraw_key(mb_kbd_get_ui(kbd), key);
+  mb_kbd_ui_swap_buffers(mb_kbd_get_ui(kbd));
+}
 
-      mb_kbd_row_for_each_key(row,key_item)
-        {
-          if (!mb_kbd_is_extended(ui->kbd)
-              && mb_kbd_key_get_extended(key_item->data))
-            continue;
-
-          if (mb_kbd_key_get_fill(key_item->data)
-              || mb_kbd_ui_display_height(ui) <= 320
-              || mb_kbd_ui_display_width(ui) <= 320 )
-            n_fillers++;
-        }
+static void
+mb_kbd_ui_frontend_layout_changed(MBKeyboard *kbd)
+{
+  mb_kbd_ui_layout_changed(mb_kbd_get_ui(kbd));
+}
 
-      if (!n_fillers)
-	goto next_row;
+static void
+mb_kbd_ui_frontend_config_reloaded(MBKeyboard *kbd, boolean relayout)
+{
+  mb_kbd_ui_config_reloaded(mb_kbd_get_ui(kbd), relayout);
+}
 
-      free_space = max_row_width - mb_kbd_row_width(row);
+static const MBKeyboardFrontend mb_kbd_ui_frontend =
+  {
+    mb_kbd_ui_text_extents,
+    mb_kbd_ui_lookup_keysym,
+    mb_kbd_image_new,
+    mb_kbd_ui_image_size,
+    mb_kbd_image_destroy,
+    mb_kbd_ui_send_press,
+    mb_kbd_ui_send_keysym_press,
+    mb_kbd_ui_send_release,
+    mb_kbd_ui_frontend_redraw,
+    mb_kbd_ui_frontend_redraw_key,
+    mb_kbd_ui_frontend_layout_changed,
+    mb_kbd_ui_frontend_config_reloaded
+  };
 
-      mb_kbd_row_for_each_key(row, key_item)
-        {
-          if (!mb_kbd_is_extended(ui->kbd)
-              && mb_kbd_key_get_extended(key_item->data))
-            continue;
+static void
+mb_kbd_ui_fits_clear(MBKeyboardUI *ui)
+{
+  int i;
 
-          if (mb_kbd_key_get_fill(key_item->data)
-              || mb_kbd_ui_display_height(ui) <= 320
-              || mb_kbd_ui_display_width(ui) <= 320 )
-            {
-              int   old_w;
-              List *nudge_key_item = util_list_next(key_item);
+  for (i = 0; i < MB_KBD_UI_FIT_BUCKETS; i++)
+    while (ui->fits[i])
+      {
+	MBKeyboardUIFit *fit = ui->fits[i];
 
-              old_w = mb_kbd_key_width(key_item->data);
-              new_w = old_w + (free_space/n_fillers);
+	ui->fits[i] = fit->next;
+	if (fit->fitted)
+	  free(fit->fitted);
+	free(fit->str);
+	free(fit);
+      }
+}
 
-              mb_kbd_key_set_geometry(key_item->data, -1, -1, new_w, -1);
+/* byte length of the first n characters of a utf8 string */
+static int
+mb_kbd_ui_utf8_prefix_len(const char *str, int n)
+{
+  const unsigned char *p = (const unsigned char *)str;
 
-              /* nudge next keys forward */
+  while (*p && n)
+    {
+      p++;
+      while ((*p & 0xc0) == 0x80)
+	p++;
+      n--;
+    }
 
-              for (;
-                   nudge_key_item != NULL;
-                   nudge_key_item = util_list_next(nudge_key_item))
-                {
-                  if (!mb_kbd_is_extended(ui->kbd)
-                      && mb_kbd_key_get_extended(nudge_key_item->data))
-                    continue;
+  return p - (const unsigned char *)str;
+}
 
-                  mb_kbd_key_set_geometry(nudge_key_item->data,
-                                          mb_kbd_key_x(nudge_key_item->data) + (new_w - old_w ), -1, -1, -1);
+/*
+ * Returns the label to draw on a key with width pixels to spare, and its
+ * width: str itself if it fits, otherwise as much of it as fits followed
+ * by an ellipsis. Worked out once per label and width, and kept until the
+ * font or the key sizes change.
+ */
+const char*
+mb_kbd_ui_fit_label(MBKeyboardUI *ui,
+		    const char   *str,
+		    int           width,
+		    int          *fitted_width)
+{
+  MBKeyboardUIFit *fit;
+  int              bucket, w, h, n;
 
-                }
-            }
+  bucket = (util_str_hash(str) ^ width) % MB_KBD_UI_FIT_BUCKETS;
 
-	}
-    next_row:
-      row_item = util_list_next(row_item);
-    }
+  for (fit = ui->fits[bucket]; fit != NULL; fit = fit->next)
+    if (fit->width == width && streq(fit->str, str))
+      goto out;
 
+  fit        = util_malloc0(sizeof(MBKeyboardUIFit));
+  fit->str   = strdup(str);
+  fit->width = width;
 
-  /* Now center the rows */
+  ui->backend->text_extents(ui, str, &w, &h);
 
-  row_item = mb_kbd_layout_rows(layout);
+  fit->fitted_width = w;
 
-  while (row_item != NULL)
+  /* drop characters from the end until it fits, ellipsis and all */
+  for (n = util_utf8_char_cnt(str) - 1; w > width && n > 0; n--)
     {
-      MBKeyboardRow *row = row_item->data;
+      int len = mb_kbd_ui_utf8_prefix_len(str, n);
 
-      mb_kbd_row_set_x(row, (max_row_width - mb_kbd_row_width(row))/2);
+      if (fit->fitted)
+	free(fit->fitted);
 
-      row_item = util_list_next(row_item);
+      fit->fitted = malloc(len + sizeof("\xe2\x80\xa6"));
+      memcpy(fit->fitted, str, len);
+      strcpy(fit->fitted + len, "\xe2\x80\xa6"); /* U+2026 */
+
+      ui->backend->text_extents(ui, fit->fitted, &w, &h);
+
+      fit->fitted_width = w;
     }
 
-  *width = max_row_width;
+  DBG("'%s' fitted to %d as '%s'", str, width,
+      fit->fitted ? fit->fitted : str);
+
+  fit->next = ui->fits[bucket];
+  ui->fits[bucket] = fit;
+
+ out:
+  if (fitted_width)
+    *fitted_width = fit->fitted_width;
+
+  return fit->fitted ? fit->fitted : fit->str;
 }
 
 void
@@ -601,7 +778,7 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
       attrs.wclass = GDK_INPUT_OUTPUT;
       attrs.window_type = GDK_WINDOW_CHILD;
 
-      ui->gwin = gdk_window_new (ui->kbd->parent, &attrs,
+      ui->gwin = gdk_window_new (ui->parent, &attrs,
                                  GDK_WA_X | GDK_WA_Y | GDK_WA_NOREDIR);
 
       ui->xwin = GDK_WINDOW_XID (ui->gwin);
@@ -609,7 +786,7 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
       XSetWindowAttributes attrs;
 
       DBG ("Creating new window for widget, parent 0x%x!!!",
-           (unsigned int) ui->kbd->parent);
+           (unsigned int) ui->parent);
 
       attrs.override_redirect = True;
       attrs.event_mask =
@@ -624,7 +801,7 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
        * actual size allocation happens later.
        */
       ui->xwin = XCreateWindow (ui->xdpy,
-                                ui->kbd->parent,
+                                ui->parent,
                                 ui->kbd->req_x, ui->kbd->req_y,
                                 ui->kbd->req_width, ui->kbd->req_height,
                                 0,
@@ -890,9 +1067,23 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
   ui->backend->resources_create(ui);
 
 
-  /* Get root size change events for rotation */
+  /*
+   * Root size changes, for rotation, come from RandR where there is one
+   * (see mb_kbd_ui_update_display_size()) and the application window
+   * selects them above. A widget without RandR adds them to whatever its
+   * toolkit has selected on the root on the shared connection.
+   */
+  if (ui->kbd->is_widget && !ui->have_randr)
+    {
+#if WANT_GTK_WIDGET
+      GdkWindow *root = gdk_get_default_root_window ();
 
-  /* XSelectInput(ui->xdpy, ui->xwin_root, StructureNotifyMask); */
+      gdk_window_set_events (root,
+                             gdk_window_get_events (root) | GDK_STRUCTURE_MASK);
+#else
+      XSelectInput(ui->xdpy, ui->xwin_root, StructureNotifyMask);
+#endif
+    }
 
   return 1;
 }
@@ -924,11 +1115,7 @@ void
 mb_kbd_ui_resize(MBKeyboardUI *ui, int x, int y, int width, int height)
 {
   MBKeyboard       *kbd = ui->kbd;
-  MBKeyboardLayout *layout;
-  List              *row_item, *key_item;
-  int               width_diff, height_diff;
   int               height_font_pt_size, width_font_pt_size, new_font_pt_size;
-  int               next_row_y,  n_rows, extra_key_height;
 
   if (width == ui->xwin_width && height == ui->xwin_height)
     {
@@ -957,23 +1144,8 @@ mb_kbd_ui_resize(MBKeyboardUI *ui, int x, int y, int width, int height)
       DBG ("Tweaked height to %d", height);
     }
 
-  width_diff  = width  - ui->base_alloc_width;
-  height_diff = height - ui->base_alloc_height;
-
-#if 0
-  /* FIXME -- this was well intentioned, but it does not work like that because
-   * if we do not resize here, we end up with a wrong size of a backing pixmap
-   * attached to the window, and all kind of weird things happen (especially
-   * when the pixmap is smaller in one axis then the window!)
-   *
-   * We simply have to respect this request.
-   */
-  if (width_diff < 0 || height_diff < 0)
-    return;  /* dont go smaller than our int request - get clipped */
-#endif
-
-  layout   = mb_kbd_get_selected_layout(ui->kbd);
-  row_item = mb_kbd_layout_rows(layout);
+  /* the keys are about to change width */
+  mb_kbd_ui_fits_clear(ui);
 
   /*
    * load a bigger font ?
@@ -998,157 +1170,436 @@ mb_kbd_ui_resize(MBKeyboardUI *ui, int x, int y, int width, int height)
       mb_kbd_ui_load_font(ui);
     }
 
-  n_rows = util_list_length(row_item);
+  /* and bigger image faces ? */
+  mb_kbd_image_set_scale (kbd,
+                          ((100 * width) / ui->base_alloc_width
+                           < (100 * height) / ui->base_alloc_height)
+                          ? (100 * width) / ui->base_alloc_width
+                          : (100 * height) / ui->base_alloc_height);
+
+  mb_kbd_scale_layout(kbd, ui->base_alloc_width, ui->base_alloc_height,
+		      width, height);
 
-  extra_key_height = (height_diff / n_rows);
+  if (x < 0 || y < 0)
+    XResizeWindow(ui->xdpy, ui->xwin, width, height);
+  else
+    XMoveResizeWindow(ui->xdpy, ui->xwin, x, y, width, height);
 
-  DBG("****** extra height is %i ******", extra_key_height);
+  ui->xwin_width  = width;
+  ui->xwin_height = height;
 
-  next_row_y = mb_kbd_row_spacing(ui->kbd);
+  mb_kbd_ui_resize_backbuffer (ui);
 
-  /* allocate the extra width we have as padding to keys */
+  mb_kbd_resize_popup (ui->kbd);
+}
 
-  while (row_item != NULL)
+/*
+ * Lays out both the compact (portrait) and the extended (landscape) key
+ * sets up front and keeps their base geometry, so that rotating only has
+ * to swap it in and scale, see mb_kbd_ui_use_key_set().
+ */
+static void
+mb_kbd_ui_allocate_key_sets(MBKeyboardUI *ui)
+{
+  MBKeyboardLayout *layout = mb_kbd_get_selected_layout(ui->kbd);
+  List             *row_item;
+  int               set;
+
+  for (set = 0; set < 2; set++)
     {
-      int row_base_width, new_row_base_width, row_width_diff;
-      int  next_key_x = 0,  n_fillers  = 0, free_space = 0, new_w = 0;
+      mb_kbd_set_extended(ui->kbd, set);
+
+      mb_kbd_allocate_layout(ui->kbd,
+                             mb_kbd_ui_display_width(ui),
+                             mb_kbd_ui_display_height(ui),
+                             &ui->current->set_alloc_width[set],
+                             &ui->current->set_alloc_height[set]);
+
+      for (row_item = mb_kbd_layout_rows(layout);
+           row_item != NULL;
+           row_item = util_list_next(row_item))
+        mb_kbd_row_save_base_geometry(row_item->data, set);
+    }
+}
 
-      row_base_width = mb_kbd_row_base_width(row_item->data);
+/*
+ * Hash of everything the base key set geometry depends on: the layout's
+ * keys and faces, the font, the spacing and the display size (which both
+ * the small display tweaks and the cairo font size look at).
+ */
+static unsigned int
+mb_kbd_ui_layout_hash(MBKeyboardUI *ui)
+{
+  MBKeyboard             *kbd = ui->kbd;
+  List                   *row_item, *key_item;
+  MBKeyboardKeyStateType  state;
+  unsigned int            h;
+  int                     params[8];
 
-      new_row_base_width = ( row_base_width * width ) / ui->base_alloc_width;
+#ifdef WANT_CAIRO
+  h = util_str_hash("cairo");
+#else
+  h = util_str_hash("xft");
+#endif
 
-      row_width_diff = new_row_base_width - row_base_width;
+  if (kbd->font_family)
+    h = util_hash_update(h, kbd->font_family, strlen(kbd->font_family) + 1);
 
-      DBG("row_width_diff = %i", row_width_diff);
+  if (kbd->font_variant)
+    h = util_hash_update(h, kbd->font_variant, strlen(kbd->font_variant) + 1);
 
-      next_key_x = mb_kbd_col_spacing(ui->kbd);
+  params[0] = kbd->font_pt_size;
+  params[1] = kbd->key_border;
+  params[2] = kbd->key_pad;
+  params[3] = kbd->key_margin;
+  params[4] = kbd->row_spacing;
+  params[5] = kbd->col_spacing;
+  params[6] = ui->dpy_width;
+  params[7] = ui->dpy_height;
 
-      /*
-       * row_base_width
-       * --------------  X  new_width  = new_base_width
-       *   base_width
-       *
-       * key_extra_pad  = key_base_width X base_width_diff
-       *                  --------------------------------
-       *                          row_base_width
-      */
+  h = util_hash_update(h, params, sizeof(params));
 
+  for (row_item = mb_kbd_layout_rows(mb_kbd_get_selected_layout(kbd));
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    {
       mb_kbd_row_for_each_key(row_item->data, key_item)
 	{
 	  MBKeyboardKey *key = key_item->data;
-	  int            key_base_width, key_new_pad;
 
-	  if (!mb_kbd_is_extended(kbd) && mb_kbd_key_get_extended(key))
-	    continue;
+	  params[0] = mb_kbd_key_get_extended(key);
+	  params[1] = mb_kbd_key_get_req_uwidth(key);
+	  params[2] = mb_kbd_key_get_fill(key);
+	  params[3] = mb_kbd_key_is_blank(key);
 
-          key_base_width =( mb_kbd_key_width(key)
-                            - mb_kbd_key_get_extra_width_pad(key));
+	  h = util_hash_update(h, params, 4 * sizeof(int));
 
-          key_new_pad= ( (key_base_width + mb_kbd_col_spacing(kbd)) * row_width_diff) / row_base_width;
+	  mb_kdb_key_foreach_state(key, state)
+	    {
+	      const char      *face_str;
+	      MBKeyboardImage *img;
 
-          mb_kbd_key_set_extra_width_pad (key, key_new_pad );
+	      params[0] = mb_kbd_key_get_face_type(key, state);
 
-	  /* Height */
+	      switch (params[0])
+		{
+		case MBKeyboardKeyFaceGlyph:
+		  face_str = mb_kbd_key_get_glyph_face(key, state);
+		  h = util_hash_update(h, face_str, strlen(face_str) + 1);
+		  break;
+		case MBKeyboardKeyFaceImage:
+		  img = mb_kbd_key_get_image_face(key, state);
+		  params[1] = mb_kbd_image_width(img);
+		  params[2] = mb_kbd_image_height(img);
+		  break;
+		default:
+		  break;
+		}
 
-	  mb_kbd_key_set_extra_height_pad (key, extra_key_height);
+	      h = util_hash_update(h, params,
+				   (params[0] == MBKeyboardKeyFaceImage ? 3 : 1)
+				   * sizeof(int));
+	    }
+	}
+    }
 
-	  mb_kbd_key_set_geometry(key, next_key_x, -1, -1, -1);
+  return h;
+}
 
-          next_key_x += (mb_kbd_key_width(key) + mb_kbd_col_spacing(ui->kbd));
+/*
+ * The key sets are stored in the geometry cache as the two base sizes, the
+ * unit key size, then for each set every row's position followed by the
+ * geometry of its keys.
+ */
+static int
+mb_kbd_ui_key_sets_cache_size(MBKeyboardUI *ui)
+{
+  List *row_item, *key_item;
+  int   n = 6;
 
-	  if (mb_kbd_key_get_fill(key))
-	      n_fillers++;
-	}
+  for (row_item = mb_kbd_layout_rows(mb_kbd_get_selected_layout(ui->kbd));
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    {
+      n += 2 * 2;
 
-      /* The above ( likely due to rounding ) leaves a few pixels free.
-       * This can be critical on a small handheld display. Therefore
-       * we do a second parse deviding up any left over space between
-       * keys marked as fill.
-       */
+      mb_kbd_row_for_each_key(row_item->data, key_item)
+	n += 2 * 4;
+    }
 
-      if (n_fillers)
-        {
-          free_space = width - mb_kbd_row_width(row_item->data);
+  return n;
+}
 
-          mb_kbd_row_for_each_key(row_item->data, key_item)
-            {
-              if (!mb_kbd_is_extended(kbd)
-                  && mb_kbd_key_get_extended(key_item->data))
-                continue;
+static boolean
+mb_kbd_ui_load_key_sets(MBKeyboardUI *ui, unsigned int hash)
+{
+  MBKeyboardLayout *layout = mb_kbd_get_selected_layout(ui->kbd);
+  List             *row_item, *key_item;
+  int              *data, *p;
+  int               set;
 
-              if (mb_kbd_key_get_fill(key_item->data))
-                {
-                  int   old_w;
-                  List *nudge_key_item = util_list_next(key_item);
+  data = mb_kbd_cache_load(ui->kbd, mb_kbd_layout_id(layout), hash,
+			   mb_kbd_ui_key_sets_cache_size(ui));
+  if (!data)
+    return False;
 
-                  old_w = mb_kbd_key_width(key_item->data);
-                  new_w = old_w + (free_space/n_fillers);
+  p = data;
 
-                  mb_kbd_key_set_geometry(key_item->data, -1, -1, new_w, -1);
+  for (set = 0; set < 2; set++)
+    {
+      ui->current->set_alloc_width[set]  = *p++;
+      ui->current->set_alloc_height[set] = *p++;
+    }
 
-                  /* nudge next keys forward */
+  ui->kbd->key_uwidth  = *p++;
+  ui->kbd->key_uheight = *p++;
 
-                  for (;
-                       nudge_key_item != NULL;
-                       nudge_key_item = util_list_next(nudge_key_item))
-                    {
-                      if (!mb_kbd_is_extended(ui->kbd)
-                          && mb_kbd_key_get_extended(nudge_key_item->data))
-                        continue;
+  for (set = 0; set < 2; set++)
+    for (row_item = mb_kbd_layout_rows(layout);
+	 row_item != NULL;
+	 row_item = util_list_next(row_item))
+      {
+	mb_kbd_row_set_base_position(row_item->data, set, p[0], p[1]);
+	p += 2;
+
+	mb_kbd_row_for_each_key(row_item->data, key_item)
+	  {
+	    mb_kbd_key_set_base_geometry(key_item->data, set, p);
+	    p += 4;
+	  }
+      }
 
-		      mb_kbd_key_set_geometry(nudge_key_item->data,
-					      mb_kbd_key_x(nudge_key_item->data) + (new_w - old_w ), -1, -1, -1);
+  free(data);
 
-		    }
-		}
+  return True;
+}
 
-	    }
-	}
+static void
+mb_kbd_ui_save_key_sets(MBKeyboardUI *ui, unsigned int hash)
+{
+  MBKeyboardLayout *layout = mb_kbd_get_selected_layout(ui->kbd);
+  List             *row_item, *key_item;
+  int              *data, *p;
+  int               n, set;
+
+  n = mb_kbd_ui_key_sets_cache_size(ui);
+  p = data = malloc(n * sizeof(int));
+
+  for (set = 0; set < 2; set++)
+    {
+      *p++ = ui->current->set_alloc_width[set];
+      *p++ = ui->current->set_alloc_height[set];
+    }
 
+  *p++ = ui->kbd->key_uwidth;
+  *p++ = ui->kbd->key_uheight;
 
-      /* re-center row */
+  for (set = 0; set < 2; set++)
+    for (row_item = mb_kbd_layout_rows(layout);
+	 row_item != NULL;
+	 row_item = util_list_next(row_item))
+      {
+	mb_kbd_row_get_base_position(row_item->data, set, &p[0], &p[1]);
+	p += 2;
+
+	mb_kbd_row_for_each_key(row_item->data, key_item)
+	  {
+	    mb_kbd_key_get_base_geometry(key_item->data, set, p);
+	    p += 4;
+	  }
+      }
 
-      mb_kbd_row_set_x(row_item->data,
-                       (width - mb_kbd_row_width(row_item->data))/2);
+  mb_kbd_cache_save(ui->kbd, mb_kbd_layout_id(layout), hash, data, n);
 
-      /* and position down */
+  free(data);
+}
 
-      mb_kbd_row_set_y(row_item->data, next_row_y);
+static void
+mb_kbd_ui_use_key_set(MBKeyboardUI *ui, boolean extended)
+{
+  MBKeyboardLayout *layout = mb_kbd_get_selected_layout(ui->kbd);
+  List             *row_item;
+  int               set = extended ? 1 : 0;
 
-      next_row_y  += (mb_kbd_row_height(row_item->data)
-                      + mb_kbd_row_spacing(ui->kbd));
+  mb_kbd_set_extended(ui->kbd, extended);
 
-      row_item = util_list_next(row_item);
+  for (row_item = mb_kbd_layout_rows(layout);
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    mb_kbd_row_restore_base_geometry(row_item->data, extended);
+
+  ui->base_alloc_width  = ui->current->set_alloc_width[set];
+  ui->base_alloc_height = ui->current->set_alloc_height[set];
+
+  /* the keys are now laid out at base size, whatever the window is */
+  ui->xwin_width  = ui->base_alloc_width;
+  ui->xwin_height = ui->base_alloc_height;
+}
+
+/*
+ * Makes the selected layout current, working out the base geometry of its
+ * key sets (or fetching it from the geometry cache) the first time round.
+ * That is always done at the base font size, like for the first layout,
+ * since mb_kbd_ui_resize() scales from there.
+ */
+static void
+mb_kbd_ui_prepare_layout(MBKeyboardUI *ui)
+{
+  MBKeyboard         *kbd    = ui->kbd;
+  MBKeyboardLayout   *layout = mb_kbd_get_selected_layout(kbd);
+  MBKeyboardUILayout *entry;
+  List               *l;
+  unsigned int        hash;
+  int                 font_pt_size = kbd->font_pt_size;
+
+  for (l = ui->layouts; l != NULL; l = util_list_next(l))
+    {
+      entry = l->data;
+
+      if (entry->layout == layout)
+	{
+	  ui->current = entry;
+	  return;
+	}
     }
 
-  /* center entire layout vertically if space left */
+  entry = util_malloc0(sizeof(MBKeyboardUILayout));
+  entry->layout = layout;
+
+  ui->layouts = util_list_append(ui->layouts, entry);
+  ui->current = entry;
 
-  if (next_row_y < height)
+  /* the window has been resized since start up */
+  if (font_pt_size != ui->base_font_pt_size)
     {
-      int vspace = ( height - next_row_y ) / 2;
+      kbd->font_pt_size = ui->base_font_pt_size;
+      mb_kbd_ui_load_font(ui);
+    }
 
-      row_item = mb_kbd_layout_rows(layout);
+  hash = mb_kbd_ui_layout_hash(ui);
 
-      while (row_item != NULL)
-        {
-          mb_kbd_row_set_y(row_item->data,
-                           mb_kbd_row_y(row_item->data) + vspace + 1);
+  if (!mb_kbd_ui_load_key_sets(ui, hash))
+    {
+      mb_kbd_ui_allocate_key_sets(ui);
+      mb_kbd_ui_save_key_sets(ui, hash);
+    }
+
+  if (font_pt_size != ui->base_font_pt_size)
+    {
+      kbd->font_pt_size = font_pt_size;
+      mb_kbd_ui_load_font(ui);
+    }
+}
+
+/*
+ * Called once the keyboard has selected another layout. The keys of every
+ * layout keep their own geometry, so if the new one was last laid out for
+ * the window as it is now, all that is left to do is draw it.
+ */
+void
+mb_kbd_ui_layout_changed(MBKeyboardUI *ui)
+{
+  MBKeyboard *kbd      = ui->kbd;
+  boolean     extended = mb_kbd_is_extended(kbd);
+  int         width    = ui->xwin_width;
+  int         height   = ui->xwin_height;
+
+  if (ui->current == NULL) 	/* not realized yet */
+    return;
+
+  ui->current->width        = width;
+  ui->current->height       = height;
+  ui->current->extended     = extended;
+  ui->current->font_pt_size = kbd->font_pt_size;
+
+  mb_kbd_ui_prepare_layout(ui);
 
-	  row_item = util_list_next(row_item);
+  mb_kbd_image_prefetch (kbd, ui->current->layout);
+
+  if (ui->current->width == width
+      && ui->current->height == height
+      && ui->current->extended == extended)
+    {
+      int set = extended ? 1 : 0;
+
+      DBG("layout already laid out for %d x %d", width, height);
+
+      mb_kbd_set_extended(kbd, extended);
+
+      ui->base_alloc_width  = ui->current->set_alloc_width[set];
+      ui->base_alloc_height = ui->current->set_alloc_height[set];
+
+      if (ui->current->font_pt_size != kbd->font_pt_size)
+	{
+	  kbd->font_pt_size = ui->current->font_pt_size;
+	  mb_kbd_ui_load_font(ui);
 	}
+
+      mb_kbd_resize_popup (kbd);
+      mb_kbd_ui_redraw(ui);
+      return;
     }
 
-  if (x < 0 || y < 0)
-    XResizeWindow(ui->xdpy, ui->xwin, width, height);
+  mb_kbd_ui_use_key_set(ui, extended);
+
+  if (width == ui->xwin_width && height == ui->xwin_height)
+    mb_kbd_ui_redraw(ui);
   else
-    XMoveResizeWindow(ui->xdpy, ui->xwin, x, y, width, height);
+    mb_kbd_ui_resize(ui, -1, -1, width, height);
+}
 
-  ui->xwin_width  = width;
-  ui->xwin_height = height;
+static void
+mb_kbd_ui_forget_layouts(MBKeyboardUI *ui)
+{
+  while (ui->layouts)
+    {
+      MBKeyboardUILayout *entry = ui->layouts->data;
 
-  mb_kbd_ui_resize_backbuffer (ui);
+      ui->layouts = util_list_remove(ui->layouts, entry);
+      free (entry);
+    }
 
-  mb_kbd_resize_popup (ui->kbd);
+  ui->current = NULL;
+}
+
+/*
+ * Called once the config has been reloaded, see mb_kbd_config_reload().
+ * Without relayout only faces changed and the core redraws those keys
+ * itself; otherwise everything is laid out again for the window as it is.
+ */
+void
+mb_kbd_ui_config_reloaded(MBKeyboardUI *ui, boolean relayout)
+{
+  MBKeyboard *kbd    = ui->kbd;
+  int         width  = ui->xwin_width;
+  int         height = ui->xwin_height;
+
+  if (ui->current == NULL) 	/* not realized yet */
+    return;
+
+  if (!relayout)
+    {
+      mb_kbd_image_prefetch (kbd, mb_kbd_get_selected_layout(kbd));
+      return;
+    }
+
+  mb_kbd_hide_popup (kbd);
+
+  /* the other layouts may have changed too, or be gone */
+  mb_kbd_ui_forget_layouts(ui);
+
+  kbd->font_pt_size = ui->base_font_pt_size;
+  mb_kbd_ui_load_font(ui);
+
+  mb_kbd_ui_prepare_layout(ui);
+  mb_kbd_ui_use_key_set(ui, want_extended(ui));
+
+  mb_kbd_image_prefetch (kbd, ui->current->layout);
+
+  if (width == ui->xwin_width && height == ui->xwin_height)
+    mb_kbd_ui_redraw(ui);
+  else
+    mb_kbd_ui_resize(ui, -1, -1, width, height);
 }
 
 void
@@ -1162,9 +1613,7 @@ mb_kbd_ui_handle_configure(MBKeyboardUI *ui,
 
   MARK();
 
-  /* Figure out if screen size has changed - does a round trip - bad */
-
-  mb_kbd_ui_update_display_size(ui);
+  /* the display size is kept current by mb_kbd_ui_handle_display_event() */
 
   old_state = mb_kbd_is_extended(ui->kbd);
   new_state = want_extended(ui);
@@ -1175,10 +1624,52 @@ mb_kbd_ui_handle_configure(MBKeyboardUI *ui,
       return;
     }
 
-  mb_kbd_set_extended(ui->kbd, new_state);
+  /* rotation; swap in the other key set and scale it */
+  mb_kbd_ui_use_key_set(ui, new_state);
+
+  if (width == ui->xwin_width && height == ui->xwin_height)
+    mb_kbd_ui_redraw(ui);
+  else
+    mb_kbd_ui_resize(ui, -1, -1, width, height);
+}
+
+/*
+ * Window managers and embedders tend to send a burst of ConfigureNotify
+ * events while negotiating our size; only the last one matters. The event
+ * loop queues them here and flushes once the X queue is drained.
+ */
+void
+mb_kbd_ui_queue_configure(MBKeyboardUI *ui,
+			  int           width,
+			  int           height)
+{
+  if (ui->configure_pending)
+    {
+      ui->skipped_layouts++;
+      DBG ("dropping pending relayout to %d x %d (%d skipped)",
+	   ui->pending_width, ui->pending_height, ui->skipped_layouts);
+    }
+
+  ui->configure_pending = True;
+  ui->pending_width     = width;
+  ui->pending_height    = height;
+}
+
+void
+mb_kbd_ui_flush_configure(MBKeyboardUI *ui)
+{
+  if (!ui->configure_pending)
+    return;
+
+  ui->configure_pending = False;
 
-  /* realocate the layout */
-  mb_kbd_ui_resize(ui, -1, -1, width, height);
+  mb_kbd_ui_handle_configure(ui, ui->pending_width, ui->pending_height);
+}
+
+int
+mb_kbd_ui_skipped_layouts(MBKeyboardUI *ui)
+{
+  return ui->skipped_layouts;
 }
 
 void
@@ -1199,6 +1690,7 @@ mb_kbd_ui_handle_widget_xevent (MBKeyboardUI *ui, XEvent *xev)
           /* Hack if we never get a release event */
           if (key != mb_kbd_get_held_key (ui->kbd))
             {
+              mb_kbd_hide_popup (ui->kbd);
               mb_kbd_key_release (ui->kbd, True);
             }
 
@@ -1221,6 +1713,7 @@ mb_kbd_ui_handle_widget_xevent (MBKeyboardUI *ui, XEvent *xev)
           if (key != mb_kbd_get_held_key(ui->kbd))
             cancel = True;
 
+          mb_kbd_hide_popup (ui->kbd);
           mb_kbd_key_release(ui->kbd, cancel);
         }
       break;
@@ -1253,6 +1746,7 @@ mb_kbd_ui_handle_widget_xevent (MBKeyboardUI *ui, XEvent *xev)
                     != MBKeyboardKeyActionModifier)
                   {
                     DBG ("New key for MotionNotify");
+                    mb_kbd_hide_popup (ui->kbd);
                     mb_kbd_key_release (ui->kbd, True);
 
                     mb_kbd_key_press(key);
@@ -1265,6 +1759,7 @@ mb_kbd_ui_handle_widget_xevent (MBKeyboardUI *ui, XEvent *xev)
             else
               {
                 DBG ("MotionNotify in noman's land");
+                mb_kbd_hide_popup (ui->kbd);
                 mb_kbd_key_release (ui->kbd, True);
               }
           }
@@ -1272,13 +1767,13 @@ mb_kbd_ui_handle_widget_xevent (MBKeyboardUI *ui, XEvent *xev)
       }
     case ConfigureNotify:
       DBG ("ConfigureNotify");
-      if (xev->xconfigure.window == ui->xwin_root)
-        mb_kbd_ui_update_display_size(ui);
+      mb_kbd_ui_handle_display_event(ui, xev);
       break;
     case MapNotify:
       if (xev->xmap.window == ui->xwin)
         {
           DBG("Got MapNotify for 0x%x", (unsigned int) ui->xwin);
+          mb_kbd_ui_handle_display_event(ui, xev);
           XSetWindowBackgroundPixmap (ui->xdpy, ui->xwin, ui->backbuffer);
           mb_kbd_ui_redraw(ui);
         }
@@ -1295,6 +1790,7 @@ mb_kbd_ui_handle_widget_xevent (MBKeyboardUI *ui, XEvent *xev)
       XRefreshKeyboardMapping(&xev->xmapping);
       break;
     default:
+      mb_kbd_ui_handle_display_event(ui, xev);
       break;
     }
 }
@@ -1306,6 +1802,8 @@ mb_kbd_ui_load_font(MBKeyboardUI *ui)
 
   ret = ui->backend->font_load(ui);
 
+  mb_kbd_ui_fits_clear(ui);
+
   mb_kbd_load_popup_font (ui->kbd);
 
   return ret;
@@ -1399,25 +1897,26 @@ mb_kbd_ui_realize(MBKeyboardUI *ui)
   if (!mb_kbd_ui_load_font(ui))
     return 0;
 
-  /* potrait or landscape */
-  if (want_extended(ui))
-    mb_kbd_set_extended(ui->kbd, True);
-
   /*
-   * figure out how small this keyboard can be..
+   * figure out how small this keyboard can be, in both orientations, and
+   * start with potrait or landscape as the display is now. Measuring every
+   * label is the slow bit, so the result is kept on disk between runs.
    */
-  mb_kbd_ui_allocate_ui_layout(ui,
-                               &ui->base_alloc_width, &ui->base_alloc_height);
-
-  ui->xwin_width  = ui->base_alloc_width;
-  ui->xwin_height = ui->base_alloc_height;
+  mb_kbd_ui_prepare_layout(ui);
+  mb_kbd_ui_use_key_set(ui, want_extended(ui));
 
   mb_kbd_ui_resources_create(ui);
 
 #ifdef WANT_CAIRO
-  ui->kbd->popup = mb_kbd_popup_new (ui);
+  mb_kbd_x(ui->kbd)->popup = mb_kbd_popup_new (ui);
+#else
+  /* reserve atlas space for all image faces in one go */
+  mb_kbd_image_atlas_build (ui->kbd);
 #endif
 
+  /* decode what the first frame needs in parallel rather than key by key */
+  mb_kbd_image_prefetch (ui->kbd, mb_kbd_get_selected_layout(ui->kbd));
+
   return 1;
 }
 
@@ -1449,6 +1948,11 @@ mb_kbd_ui_unrealize (MBKeyboardUI *ui)
 
   util_untrap_x_errors ();
 
+  /* layouts get prepared afresh for the next realize */
+  mb_kbd_ui_forget_layouts(ui);
+
+  mb_kbd_ui_fits_clear(ui);
+
   MB_KBD_UI_BACKEND_DESTROY_FUNC (ui);
 }
 
@@ -1456,6 +1960,9 @@ void
 mb_kbd_ui_destroy (MBKeyboardUI *ui)
 {
   mb_kbd_ui_unrealize (ui);
+  if (ui->monitors)
+    free (ui->monitors);
+
   free (ui);
 }
 
@@ -1464,7 +1971,7 @@ mb_kbd_ui_init(MBKeyboard *kbd)
 {
   MBKeyboardUI     *ui = NULL;
 
-  ui = kbd->ui = util_malloc0(sizeof(MBKeyboardUI));
+  ui = mb_kbd_x(kbd)->ui = util_malloc0(sizeof(MBKeyboardUI));
 
   ui->kbd = kbd;
 
@@ -1482,11 +1989,24 @@ mb_kbd_ui_init(MBKeyboard *kbd)
 
   ui->backend = MB_KBD_UI_BACKEND_INIT_FUNC (ui);
 
+  mb_kbd_set_frontend (kbd, &mb_kbd_ui_frontend, mb_kbd_x(kbd));
+
   mb_kbd_ui_update_display_size(ui);
 
   return 1;
 }
 
+#if WANT_GTK_WIDGET
+void
+mb_kbd_ui_set_parent (MBKeyboardUI *ui, GdkWindow *parent)
+#else
+void
+mb_kbd_ui_set_parent (MBKeyboardUI *ui, Window parent)
+#endif
+{
+  ui->parent = parent;
+}
+
 /* Embedding */
 
 void
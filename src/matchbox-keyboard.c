@@ -41,6 +41,7 @@ mb_kbd_usage (char *progname)
   fprintf(stderr, "\nOptions are;\n"
 	  "   -xid,--xid            Print window ID to stdout ( for embedding )\n"
 	  "   -d,--daemon           Run in 'daemon' mode (for remote control)\n"
+	  "   -w,--watch            Reload the layout whenever its files change\n"
 	  "   -o,--orientation <portrait|landscape>\n"
           "                         Use to limit visibility with screen orientation \n"
           "   --fontfamily <font family>\n"
@@ -69,28 +70,19 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
 #endif
 {
   MBKeyboard *kb = NULL;
+  MBKeyboardX *kb_x;
   char       *variant = NULL;
   char       *lang = NULL;
   Bool        want_embedding = widget;
   Bool        want_daemon = False;
+  Bool        want_watch = False;
   int         i;
   MBKeyboardDisplayOrientation orientation = MBKeyboardDisplayAny;
   int         param_offset = widget ? 0 : 1;
 
-  kb = util_malloc0(sizeof(MBKeyboard));
+  /* the UI sets itself up as the frontend, see mb_kbd_ui_init() */
+  kb = mb_kbd_core_new(NULL, util_malloc0(sizeof(MBKeyboardX)));
 
-  kb->key_border = 1;
-  kb->key_pad    = 0;
-  kb->key_margin = 0;
-
-  kb->col_spacing = 0;
-  kb->row_spacing = 0;
-
-  kb->font_family  = strdup("sans");
-  kb->font_pt_size = 8;
-  kb->font_variant = strdup("bold");
-
-  kb->parent = parent;
   kb->is_widget = widget;
 
   if (width > 0)
@@ -141,12 +133,18 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           continue;
         }
 
+      if (!strcmp ("-w", argv[i]) || !strcmp ("--watch", argv[i]))
+        {
+          want_watch = True;
+          continue;
+        }
+
       if (!strcmp ("--fontfamily", argv[i]))
         {
           if (++i>=argc)
             {
               if (widget)
-                return NULL;
+                goto fail;
               else
               mb_kbd_usage (argv[0]);
             }
@@ -178,7 +176,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           if (++i>=argc)
             {
               if (widget)
-                return NULL;
+                goto fail;
               else
                 mb_kbd_usage (argv[0]);
             }
@@ -192,7 +190,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           if (++i>=argc)
         {
               if (widget)
-                return NULL;
+                goto fail;
               else
                 mb_kbd_usage (argv[0]);
             }
@@ -207,7 +205,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           if (++i>=argc)
             {
               if (widget)
-                return NULL;
+                goto fail;
               else
                 mb_kbd_usage (argv[0]);
             }
@@ -226,7 +224,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           if (++i>=argc)
             {
               if (widget)
-                return NULL;
+                goto fail;
               else
                 mb_kbd_usage (argv[0]);
             }
@@ -244,7 +242,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           if (++i>=argc)
             {
               if (widget)
-                return NULL;
+                goto fail;
               else
                 mb_kbd_usage (argv[0]);
             }
@@ -259,7 +257,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
 	    }
           else if (widget)
             {
-              return NULL;
+              goto fail;
             }
 	  else
             {
@@ -276,7 +274,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
           if (++i>=argc)
             {
               if (widget)
-                return NULL;
+                goto fail;
               else
                 mb_kbd_usage (argv[0]);
             }
@@ -292,7 +290,7 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
       if (i == (argc-1) && argv[i][0] != '-')
 	variant = argv[i];
       else if (widget)
-        return NULL;
+        goto fail;
       else
 	mb_kbd_usage(argv[0]);
     }
@@ -301,242 +299,83 @@ mb_kbd_new (int argc, char **argv, Bool widget, Window parent,
     variant = getenv("MB_KBD_VARIANT");
 
   if (!mb_kbd_ui_init(kb))
-    return NULL;
-
-  if (!mb_kbd_config_load(kb, variant, lang))
-    return NULL;
-
-  kb->selected_layout
-    = (MBKeyboardLayout *)util_list_get_nth_data(kb->layouts, 0);
-
-  if (want_embedding && !widget)
-    mb_kbd_ui_set_embeded (kb->ui, True);
-
-  mb_kbd_ui_set_widget (kb->ui, widget);
-
-  if (want_daemon && !widget)
     {
-      mb_kbd_ui_set_daemon (kb->ui, True);
-      if (orientation != MBKeyboardDisplayAny)
-	mb_kbd_ui_limit_orientation (kb->ui, orientation);
+      /* nothing of the UI but the struct to free */
+      free (mb_kbd_get_ui(kb));
+      goto fail;
     }
 
-  return kb;
-}
-
-void
-mb_kbd_destroy (MBKeyboard *kb)
-{
-  if (kb->font_family)
-    free (kb->font_family);
+  mb_kbd_ui_set_parent (mb_kbd_get_ui(kb), parent);
 
-  if (kb->font_variant)
-    free (kb->font_variant);
-
-  if (kb->config_file)
-    free (kb->config_file);
-
-  if (kb->layouts)
+  if (!mb_kbd_load(kb, variant, lang))
     {
-      List *l;
-
-      l = kb->layouts;
-      while (l)
-        {
-          List             *n = l->next;
-          MBKeyboardLayout *c = l->data;
-
-          n = l->next;
-          mb_kbd_layout_destroy (c);
-          free (l);
-          l = n;
-        }
+      mb_kbd_destroy (kb);
+      return NULL;
     }
 
-#ifdef WANT_CAIRO
-  if (kb->popup)
-    mb_kbd_popup_destroy (kb->popup);
-#endif
-
-  mb_kbd_ui_destroy (kb->ui);
-
-  free (kb);
-}
-
-int
-mb_kbd_row_spacing(MBKeyboard *kb)
-{
-  return kb->row_spacing;
-}
-
-int
-mb_kbd_col_spacing(MBKeyboard *kb)
-{
-  return kb->col_spacing;
-}
-
-int
-mb_kbd_keys_border(MBKeyboard *kb)
-{
-  return kb->key_border;
-}
+  /* only main.c's event loop looks after the watch */
+  if (want_watch && !widget)
+    mb_kbd_config_watch (kb);
 
-int
-mb_kbd_keys_pad(MBKeyboard *kb)
-{
-  return kb->key_pad;
-}
-
-int
-mb_kbd_keys_margin(MBKeyboard *kb)
-{
-  return kb->key_margin;
-}
-
-void
-mb_kbd_add_state(MBKeyboard *kbd, MBKeyboardStateType state)
-{
-  kbd->keys_state |= state;
-}
-
-void
-mb_kbd_toggle_state(MBKeyboard *kbd, MBKeyboardStateType state)
-{
-  kbd->keys_state ^= state;
-}
-
-boolean
-mb_kbd_has_state(MBKeyboard *kbd, MBKeyboardStateType state)
-{
-  return (kbd->keys_state & state);
-}
-
-boolean
-mb_kbd_has_any_state(MBKeyboard *kbd)
-{
-  return  (kbd->keys_state > 0);
-}
-
-void
-mb_kbd_remove_state(MBKeyboard *kbd, MBKeyboardStateType state)
-{
-  kbd->keys_state &= ~(state);
-}
-
-MBKeyboardKeyStateType
-mb_kbd_keys_current_state(MBKeyboard *kbd)
-{
-  if (mb_kbd_has_state(kbd, MBKeyboardStateShifted))
-    return MBKeyboardKeyStateShifted;
-
-  if (mb_kbd_has_state(kbd, MBKeyboardStateMod1))
-    return MBKeyboardKeyStateMod1;
-
-  if (mb_kbd_has_state(kbd, MBKeyboardStateMod2))
-    return MBKeyboardKeyStateMod2;
-
-  if (mb_kbd_has_state(kbd, MBKeyboardStateMod3))
-    return MBKeyboardKeyStateMod3;
-
-  return MBKeyboardKeyStateNormal;
-}
-
-void
-mb_kbd_redraw(MBKeyboard *kb)
-{
-  mb_kbd_ui_redraw(kb->ui);
-}
-
-void
-mb_kbd_redraw_key(MBKeyboard *kb, MBKeyboardKey *key)
-{
-  mb_kbd_ui_redraw_key(kb->ui, key);
-  mb_kbd_ui_swap_buffers(kb->ui);
-}
-
-MBKeyboardKey*
-mb_kbd_locate_key(MBKeyboard *kb, int x, int y)
-{
-  MBKeyboardLayout *layout;
-  List             *row_item, *key_item;
-
-  layout = mb_kbd_get_selected_layout(kb);
+  if (want_embedding && !widget)
+    mb_kbd_ui_set_embeded (mb_kbd_get_ui(kb), True);
 
-  row_item = mb_kbd_layout_rows(layout);
+  mb_kbd_ui_set_widget (mb_kbd_get_ui(kb), widget);
 
-  while (row_item != NULL)
+  if (want_daemon && !widget)
     {
-      MBKeyboardRow *row = row_item->data;
-
-      if (x >= mb_kbd_row_x(row)
-          && x <= mb_kbd_row_x(row) + mb_kbd_row_width(row)
-          && y >= mb_kbd_row_y(row)
-          && y <= mb_kbd_row_y(row) + mb_kbd_row_height(row) )
-        {
-          mb_kbd_row_for_each_key(row, key_item)
-            {
-              MBKeyboardKey *key = key_item->data;
-
-              if (!mb_kbd_is_extended(kb)
-                  && mb_kbd_key_get_extended(key))
-                continue;
-
-              if (!mb_kbd_key_is_blank(key)
-                  && x >= mb_kbd_key_abs_x(key)
-                  && x <= mb_kbd_key_abs_x(key) + mb_kbd_key_width(key))
-                return key;
+      mb_kbd_ui_set_daemon (mb_kbd_get_ui(kb), True);
+      if (orientation != MBKeyboardDisplayAny)
+	mb_kbd_ui_limit_orientation (mb_kbd_get_ui(kb), orientation);
+    }
 
-            }
+  return kb;
 
-          return NULL;
-        }
+ fail:
+  kb_x = mb_kbd_x (kb);
+  mb_kbd_core_destroy (kb);
+  free (kb_x);
 
-      row_item = util_list_next(row_item);
-    }
   return NULL;
 }
 
 void
-mb_kbd_add_layout(MBKeyboard *kb, MBKeyboardLayout *layout)
+mb_kbd_destroy (MBKeyboard *kb)
 {
-  kb->layouts = util_list_append(kb->layouts, (pointer)layout);
-}
+  MBKeyboardX *x;
 
-MBKeyboardLayout*
-mb_kbd_get_selected_layout(MBKeyboard *kb)
-{
-  return kb->selected_layout;
-}
+#ifdef WANT_CAIRO
+  if (mb_kbd_x(kb)->popup)
+    mb_kbd_popup_destroy (mb_kbd_x(kb)->popup);
+#else
+  mb_kbd_image_atlas_destroy (kb);
+#endif
 
-void
-mb_kbd_set_held_key(MBKeyboard *kb, MBKeyboardKey *key)
-{
-  kb->held_key = key;
-}
+  mb_kbd_ui_destroy (mb_kbd_get_ui(kb));
 
-MBKeyboardKey *
-mb_kbd_get_held_key(MBKeyboard *kb)
-{
-  return kb->held_key;
+  /* the image faces go with the layouts, so the cache has to outlive them */
+  x = mb_kbd_x(kb);
+  mb_kbd_core_destroy (kb);
+  free (x);
 }
 
-void
-mb_kbd_set_extended(MBKeyboard *kb, boolean extend)
+MBKeyboardX*
+mb_kbd_x (MBKeyboard *kb)
 {
-  kb->extended = extend;
+  return (MBKeyboardX *)mb_kbd_frontend_data (kb);
 }
 
-boolean
-mb_kbd_is_extended(MBKeyboard *kb)
+MBKeyboardUI*
+mb_kbd_get_ui (MBKeyboard *kb)
 {
-  return kb->extended;
+  return mb_kbd_x (kb)->ui;
 }
 
 void
 mb_kbd_show_popup (MBKeyboard *kb, MBKeyboardKey *key, int x_root, int y_root)
 {
 #ifdef WANT_CAIRO
-  mb_kbd_popup_show (kb->popup, key, x_root, y_root);
+  mb_kbd_popup_show (mb_kbd_x(kb)->popup, key, x_root, y_root);
 #endif
 }
 
@@ -544,7 +383,7 @@ void
 mb_kbd_hide_popup (MBKeyboard *kb)
 {
 #ifdef WANT_CAIRO
-  mb_kbd_popup_hide (kb->popup);
+  mb_kbd_popup_hide (mb_kbd_x(kb)->popup);
 #endif
 }
 
@@ -552,8 +391,8 @@ void
 mb_kbd_load_popup_font (MBKeyboard *kb)
 {
 #ifdef WANT_CAIRO
-  if (kb->popup)
-    mb_kbd_popup_load_font (kb->popup);
+  if (mb_kbd_x(kb)->popup)
+    mb_kbd_popup_load_font (mb_kbd_x(kb)->popup);
 #endif
 }
 
@@ -561,7 +400,7 @@ void
 mb_kbd_resize_popup (MBKeyboard *kb)
 {
 #ifdef WANT_CAIRO
-  if (kb->popup)
-    mb_kbd_popup_resize (kb->popup);
+  if (mb_kbd_x(kb)->popup)
+    mb_kbd_popup_resize (mb_kbd_x(kb)->popup);
 #endif
 }
@@ -89,7 +89,7 @@ mb_gtk_keyboard_realize (GtkWidget *widget)
   DBG ("Wrapping xid 0x%x in GdkWindow",
            (unsigned int)mb_keyboard_get_xwindow (kb));
 
-  widget->window = g_object_ref (mb_kbd_ui_gdk_win (kb->ui));
+  widget->window = g_object_ref (mb_kbd_ui_gdk_win (mb_kbd_get_ui(kb)));
 
   DBG ("GdkWindow %p", widget->window);
   gdk_window_add_filter (widget->window, xevent_handler, widget);
@@ -123,7 +123,7 @@ mb_gtk_keyboard_size_allocate (GtkWidget *widget, GtkAllocation *allocation)
 
   if (GTK_WIDGET_REALIZED (widget))
     {
-      mb_kbd_ui_resize (priv->kb->ui,
+      mb_kbd_ui_resize (mb_kbd_get_ui(priv->kb),
                         allocation->x, allocation->y,
                         allocation->width, allocation->height);
     }
@@ -138,8 +138,8 @@ mb_gtk_keyboard_size_request (GtkWidget *widget, GtkRequisition *req)
   if (!priv->kb)
     gtk_widget_realize (widget);
 
-  req->width  = mb_kbd_ui_x_win_width (priv->kb->ui);
-  req->height = mb_kbd_ui_x_win_height (priv->kb->ui);
+  req->width  = mb_kbd_ui_x_win_width (mb_kbd_get_ui(priv->kb));
+  req->height = mb_kbd_ui_x_win_height (mb_kbd_get_ui(priv->kb));
 
   DBG ("Size request: %d x %d", req->width, req->height);
 }
@@ -184,11 +184,11 @@ mb_gtk_keyboard_style_set (GtkWidget *widget,
 
   if (GTK_WIDGET_REALIZED (widget))
     {
-      mb_kbd_ui_resize_backbuffer (priv->kb->ui);
+      mb_kbd_ui_resize_backbuffer (mb_kbd_get_ui(priv->kb));
     }
 #else
   if (GTK_WIDGET_REALIZED (widget))
-    mb_kbd_ui_redraw (priv->kb->ui);
+    mb_kbd_ui_redraw (mb_kbd_get_ui(priv->kb));
 #endif
 }
 
@@ -16,7 +16,7 @@
  *
  */
 
-#include "matchbox-keyboard.h"
+#include "matchbox-keyboard-core.h"
 
 List *
 util_list_alloc_item(void)
@@ -29,6 +29,9 @@ util_list_length(List *list)
 {
   int result = 1;
 
+  if (list == NULL)
+    return 0;
+
   list = util_list_get_first(list);
 
   while ((list = util_list_next(list)) != NULL)
@@ -93,13 +96,38 @@ util_list_append(List *list, void *data)
       List *last = util_list_get_last(list);
 
       last->next = util_list_alloc_item();
-      last->next->prev = list;
+      last->next->prev = last;
       last->next->data = data;
     }
 
   return list;
 }
 
+List*
+util_list_remove(List *list, void *data)
+{
+  List *item, *prev = NULL;
+
+  list = util_list_get_first(list);
+
+  for (item = list; item != NULL; prev = item, item = util_list_next(item))
+    if (item->data == data)
+      {
+	if (prev)
+	  prev->next = item->next;
+	else
+	  list = item->next;
+
+	if (item->next)
+	  item->next->prev = prev;
+
+	free(item);
+	break;
+      }
+
+  return list;
+}
+
 void
 util_list_foreach(List *list, ListForEachCB func, void *userdata)
 {
@@ -16,32 +16,7 @@
  *
  */
 
-#include "matchbox-keyboard.h"
-
-static int TrappedErrorCode = 0;
-static int (*old_error_handler) (Display *, XErrorEvent *);
-
-static int
-error_handler(Display     *xdpy,
-	      XErrorEvent *error)
-{
-  TrappedErrorCode = error->error_code;
-  return 0;
-}
-
-void
-util_trap_x_errors(void)
-{
-  TrappedErrorCode  = 0;
-  old_error_handler = XSetErrorHandler(error_handler);
-}
-
-int
-util_untrap_x_errors(void)
-{
-  XSetErrorHandler(old_error_handler);
-  return TrappedErrorCode;
-}
+#include "matchbox-keyboard-core.h"
 
 void*
 util_malloc0(int size)
@@ -127,3 +102,23 @@ util_file_readable(char *path)
  return True;
 }
 
+/* FNV-1a, continuing from h */
+unsigned int
+util_hash_update(unsigned int h, const void *data, int len)
+{
+  const unsigned char *p = data;
+
+  while (len-- > 0)
+    {
+      h ^= *p++;
+      h *= 16777619u;
+    }
+
+  return h;
+}
+
+unsigned int
+util_str_hash(const char *str)
+{
+  return util_hash_update(2166136261u, str, strlen(str));
+}
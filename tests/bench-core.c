@@ -0,0 +1,163 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * bench-core: times the display independent core on the stock layout;
+ * hit testing a tap on each character key in turn and running it through
+ * the press/release state machine, with a frontend that only counts the
+ * key events it is sent.
+ *
+ *   bench-core [ cycles ]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stub-frontend.h"
+
+static long bench_events = 0;
+
+static void
+bench_send_press (MBKeyboard *kbd, const char *utf8_char, int modifiers)
+{
+  bench_events++;
+}
+
+static void
+bench_send_keysym_press (MBKeyboard *kbd, KeySym ks, int modifiers)
+{
+  bench_events++;
+}
+
+/* makes name in the layouts dir available as ~/.matchbox/name */
+static void
+bench_link (const char *home, const char *name)
+{
+  char path[1024], link[1024];
+
+  snprintf(path, sizeof(path), "%s/%s", LAYOUTSDIR, name);
+  snprintf(link, sizeof(link), "%s/.matchbox/%s", home, name);
+
+  stub_link(path, link);
+}
+
+int
+main (int argc, char **argv)
+{
+  MBKeyboardFrontend frontend = stub_frontend;
+  MBKeyboard        *kb;
+  List              *row_item, *key_item;
+  char               home[] = "/tmp/bench-core-XXXXXX", dir[1024], path[1024];
+  int              (*taps)[2] = NULL;
+  int                n_taps = 0, width, height;
+  long               cycles = 5000000, i, missed = 0;
+  double             start, secs;
+
+  if (argc > 1)
+    cycles = strtol(argv[1], NULL, 0);
+
+  if (mkdtemp(home) == NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  snprintf(dir, sizeof(dir), "%s/.matchbox", home);
+  mkdir(dir, 0700);
+
+  bench_link(home, "keyboard.xml");
+  bench_link(home, "base-fragment.xml");
+
+  stub_environment(home);
+
+  /* counts the key events it is sent */
+  frontend.send_press        = bench_send_press;
+  frontend.send_keysym_press = bench_send_keysym_press;
+
+  kb = mb_kbd_core_new(&frontend, NULL);
+
+  start = stub_now();
+
+  if (!mb_kbd_load(kb, NULL, NULL))
+    {
+      fprintf(stderr, "failed to load keyboard.xml\n");
+      return 1;
+    }
+
+  mb_kbd_allocate_layout(kb, 800, 480, &width, &height);
+  mb_kbd_scale_layout(kb, width, height, 800, 240);
+
+  printf("load and lay out: %.2f ms\n", (stub_now() - start) * 1000);
+
+  snprintf(path, sizeof(path), "%s/keyboard.xml", dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/base-fragment.xml", dir);
+  unlink(path);
+  rmdir(dir);
+  rmdir(home);
+
+  /* the middle of every key that types a character */
+  for (row_item = mb_kbd_layout_rows(mb_kbd_get_selected_layout(kb));
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    mb_kbd_row_for_each_key(row_item->data, key_item)
+      {
+	MBKeyboardKey *key = key_item->data;
+
+	if (mb_kbd_key_get_action_type(key, MBKeyboardKeyStateNormal)
+	    != MBKeyboardKeyActionGlyph)
+	  continue;
+
+	taps = realloc(taps, (n_taps + 1) * sizeof(*taps));
+	taps[n_taps][0] = mb_kbd_key_abs_x(key) + mb_kbd_key_width(key) / 2;
+	taps[n_taps][1] = mb_kbd_key_abs_y(key) + mb_kbd_key_height(key) / 2;
+	n_taps++;
+      }
+
+  if (n_taps == 0)
+    {
+      fprintf(stderr, "no character keys\n");
+      return 1;
+    }
+
+  start = stub_now();
+
+  for (i = 0; i < cycles; i++)
+    {
+      MBKeyboardKey *key;
+
+      key = mb_kbd_locate_key(kb, taps[i % n_taps][0], taps[i % n_taps][1]);
+
+      if (key == NULL)
+	{
+	  missed++;
+	  continue;
+	}
+
+      mb_kbd_key_press(key);
+      mb_kbd_key_release(kb, False);
+    }
+
+  secs = stub_now() - start;
+
+  printf("%li locate+press+release cycles over %i keys: %.3f s, "
+	 "%.2fM cycles/s, %li events, %li missed\n",
+	 cycles, n_taps, secs, cycles / secs / 1e6, bench_events, missed);
+
+  mb_kbd_core_destroy(kb);
+  free(taps);
+
+  return (missed || bench_events != cycles) ? 1 : 0;
+}
@@ -0,0 +1,399 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * bench-parse: times parsing the whole layouts/ tree; each keyboard*.xml,
+ * and keyboard.xml once more with each language's base fragment. The
+ * parsed fragments and directory indexes are forgotten before every load,
+ * so each load reads and parses all of its files again.
+ *
+ * With --large it parses a corpus it writes out first instead, of a few
+ * configs far bigger than any bundled: many layouts of many rows, keys in
+ * several states with keysym and modifier actions, and an include each.
+ *
+ *   bench-parse [ --large ] [ rounds ]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stub-frontend.h"
+
+#include <dirent.h>
+
+/* the --large corpus; files of layouts of rows of keys */
+#define BENCH_LARGE_FILES     4
+#define BENCH_LARGE_LAYOUTS  16
+#define BENCH_LARGE_ROWS      8
+#define BENCH_LARGE_KEYS     12
+
+typedef struct BenchLoad
+{
+  char      home[1024];
+  long long bytes;      /* of the config and everything it includes */
+  int       n_layouts;
+}
+BenchLoad;
+
+static long long
+bench_file_size (const char *path)
+{
+  struct stat st;
+
+  return (stat(path, &st) == 0) ? st.st_size : 0;
+}
+
+/* loads the keyboard with HOME set to load->home, 0 if it fails */
+static MBKeyboard*
+bench_load (BenchLoad *load)
+{
+  MBKeyboard *kb;
+
+  setenv("HOME", load->home, 1);
+  mb_kbd_config_forget();
+
+  kb = mb_kbd_core_new(&stub_frontend, NULL);
+
+  if (!mb_kbd_load(kb, NULL, NULL))
+    {
+      fprintf(stderr, "%s: failed to load\n", load->home);
+      exit(1);
+    }
+
+  return kb;
+}
+
+/*
+ * A home of its own for each load, with dir/name in ~/.matchbox as
+ * keyboard.xml and dir/base, if any, as base-fragment.xml, next to the
+ * other fragments.
+ */
+static void
+bench_add_load (BenchLoad **loads, int *n_loads, const char *top,
+		const char *dir, char **fragments, int n_fragments,
+		const char *name, const char *base)
+{
+  BenchLoad *load;
+  char       path[1024], link[1024];
+  int        i;
+
+  *loads = realloc(*loads, (*n_loads + 1) * sizeof(BenchLoad));
+  load = &(*loads)[(*n_loads)++];
+  memset(load, 0, sizeof(BenchLoad));
+
+  snprintf(load->home, sizeof(load->home), "%s/%i", top, *n_loads);
+  mkdir(load->home, 0700);
+  snprintf(path, sizeof(path), "%s/.matchbox", load->home);
+  mkdir(path, 0700);
+
+  for (i = 0; i < n_fragments; i++)
+    {
+      if (!strncmp(fragments[i], "base-fragment", 13))
+	continue;
+
+      snprintf(path, sizeof(path), "%s/%s", dir, fragments[i]);
+      snprintf(link, sizeof(link), "%s/.matchbox/%s",
+	       load->home, fragments[i]);
+      stub_link(path, link);
+    }
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  snprintf(link, sizeof(link), "%s/.matchbox/keyboard.xml", load->home);
+  stub_link(path, link);
+
+  if (base)
+    {
+      snprintf(path, sizeof(path), "%s/%s", dir, base);
+      snprintf(link, sizeof(link), "%s/.matchbox/base-fragment.xml",
+	       load->home);
+      stub_link(path, link);
+    }
+}
+
+static void
+bench_write_key (FILE *f, int n)
+{
+  static const char *keysyms[] = { "backspace", "tab", "return", "escape",
+				   "delete", "left", "right", "f1" };
+  static const char *mods[] = { "shift", "alt", "ctrl", "mod1", "caps" };
+
+  switch (n % 12)
+    {
+    case 10:
+      fprintf(f, "      <key width=\"1500\"><default display=\"%s\" "
+	      "action=\"%s\" /></key>\n",
+	      keysyms[n % 8], keysyms[n % 8]);
+      break;
+    case 11:
+      fprintf(f, "      <key fill=\"true\"><default display=\"%s\" "
+	      "action=\"modifier:%s\" /></key>\n",
+	      mods[n % 5], mods[n % 5]);
+      break;
+    default:
+      fprintf(f,
+	      "      <key obey-caps=\"true\">\n"
+	      "        <default display=\"%c\" />\n"
+	      "        <shifted display=\"%c\" />\n"
+	      "        <mod1 display=\"%i\" action=\"xkeysym:F%i\" />\n"
+	      "      </key>\n",
+	      'a' + n % 26, 'A' + n % 26, n % 10, 1 + n % 12);
+      break;
+    }
+}
+
+static void
+bench_write_rows (FILE *f, int n_rows)
+{
+  int r, k;
+
+  for (r = 0; r < n_rows; r++)
+    {
+      fprintf(f, "    <row>\n");
+
+      for (k = 0; k < BENCH_LARGE_KEYS; k++)
+	bench_write_key(f, r * BENCH_LARGE_KEYS + k);
+
+      fprintf(f, "    </row>\n");
+    }
+}
+
+/* the --large corpus, written to dir */
+static void
+bench_write_corpus (const char *dir, char ***keyboards, int *n_keyboards,
+		    char ***fragments, int *n_fragments)
+{
+  char  path[1024];
+  FILE *f;
+  int   i, l;
+
+  mkdir(dir, 0700);
+
+  snprintf(path, sizeof(path), "%s/large-fragment.xml", dir);
+
+  if ((f = fopen(path, "w")) == NULL)
+    {
+      perror(path);
+      exit(1);
+    }
+
+  fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<fragment>\n");
+  bench_write_rows(f, BENCH_LARGE_ROWS / 2);
+  fprintf(f, "</fragment>\n");
+  fclose(f);
+
+  *fragments = realloc(*fragments, (*n_fragments + 1) * sizeof(char *));
+  (*fragments)[(*n_fragments)++] = strdup("large-fragment.xml");
+
+  for (i = 0; i < BENCH_LARGE_FILES; i++)
+    {
+      char name[64];
+
+      snprintf(name, sizeof(name), "keyboard-large-%i.xml", i);
+      snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+      if ((f = fopen(path, "w")) == NULL)
+	{
+	  perror(path);
+	  exit(1);
+	}
+
+      fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	      "<keyboard>\n");
+
+      for (l = 0; l < BENCH_LARGE_LAYOUTS; l++)
+	{
+	  fprintf(f, "  <layout id=\"large-%i-%i\">\n", i, l);
+	  bench_write_rows(f, BENCH_LARGE_ROWS);
+	  fprintf(f, "    <include file=\"large-fragment.xml\" />\n"
+		  "  </layout>\n");
+	}
+
+      fprintf(f, "</keyboard>\n");
+      fclose(f);
+
+      *keyboards = realloc(*keyboards, (*n_keyboards + 1) * sizeof(char *));
+      (*keyboards)[(*n_keyboards)++] = strdup(name);
+    }
+}
+
+static void
+bench_remove_tree (const char *path)
+{
+  DIR           *d;
+  struct dirent *de;
+  struct stat    st;
+
+  if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)
+      && (d = opendir(path)) != NULL)
+    {
+      while ((de = readdir(d)) != NULL)
+	if (!streq(de->d_name, ".") && !streq(de->d_name, ".."))
+	  {
+	    char sub[1024];
+
+	    snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+	    bench_remove_tree(sub);
+	  }
+
+      closedir(d);
+      rmdir(path);
+    }
+  else
+    unlink(path);
+}
+
+int
+main (int argc, char **argv)
+{
+  BenchLoad     *loads = NULL;
+  char         **keyboards = NULL, **fragments = NULL;
+  int            n_loads = 0, n_keyboards = 0, n_fragments = 0;
+  char           top[] = "/tmp/bench-parse-XXXXXX", dir[1024];
+  long           rounds = 200, r;
+  long long      bytes = 0;
+  int            n_layouts = 0, i;
+  boolean        large = False;
+  double         start, secs;
+  DIR           *d;
+  struct dirent *de;
+
+  if (argc > 1 && streq(argv[1], "--large"))
+    {
+      large = True;
+      argc--;
+      argv++;
+    }
+
+  if (argc > 1)
+    rounds = strtol(argv[1], NULL, 0);
+
+  if (mkdtemp(top) == NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  /* each load sets its own HOME */
+  stub_environment(NULL);
+
+  if (large)
+    {
+      snprintf(dir, sizeof(dir), "%s/corpus", top);
+
+      bench_write_corpus(dir, &keyboards, &n_keyboards,
+			 &fragments, &n_fragments);
+
+      for (i = 0; i < n_keyboards; i++)
+	bench_add_load(&loads, &n_loads, top, dir, fragments, n_fragments,
+		       keyboards[i], NULL);
+    }
+  else
+    {
+      snprintf(dir, sizeof(dir), "%s", LAYOUTSDIR);
+
+      if ((d = opendir(dir)) == NULL)
+	{
+	  perror(dir);
+	  return 1;
+	}
+
+      while ((de = readdir(d)) != NULL)
+	{
+	  int n = strlen(de->d_name);
+
+	  if (n < 4 || !streq(de->d_name + n - 4, ".xml"))
+	    continue;
+
+	  if (!strncmp(de->d_name, "keyboard", 8))
+	    {
+	      keyboards = realloc(keyboards,
+				  (n_keyboards + 1) * sizeof(char *));
+	      keyboards[n_keyboards++] = strdup(de->d_name);
+	    }
+	  else
+	    {
+	      fragments = realloc(fragments,
+				  (n_fragments + 1) * sizeof(char *));
+	      fragments[n_fragments++] = strdup(de->d_name);
+	    }
+	}
+
+      closedir(d);
+
+      for (i = 0; i < n_keyboards; i++)
+	bench_add_load(&loads, &n_loads, top, dir, fragments, n_fragments,
+		       keyboards[i], "base-fragment.xml");
+
+      for (i = 0; i < n_fragments; i++)
+	if (!strncmp(fragments[i], "base-fragment-", 14))
+	  bench_add_load(&loads, &n_loads, top, dir, fragments, n_fragments,
+			 "keyboard.xml", fragments[i]);
+    }
+
+  if (n_loads == 0)
+    {
+      fprintf(stderr, "no layouts in %s\n", dir);
+      return 1;
+    }
+
+  /* once untimed, to count what each load reads */
+  for (i = 0; i < n_loads; i++)
+    {
+      MBKeyboard *kb = bench_load(&loads[i]);
+      List       *item, *prev;
+
+      loads[i].bytes     = bench_file_size(kb->config_file);
+      loads[i].n_layouts = util_list_length(kb->layouts);
+
+      /* a file included again is replayed, not parsed, so counts once */
+      for (item = kb->config_includes; item; item = util_list_next(item))
+	{
+	  MBKeyboardConfigInclude *inc = item->data;
+
+	  for (prev = kb->config_includes; prev != item;
+	       prev = util_list_next(prev))
+	    if (streq(((MBKeyboardConfigInclude *)prev->data)->path,
+		      inc->path))
+	      break;
+
+	  if (prev == item)
+	    loads[i].bytes += bench_file_size(inc->path);
+	}
+
+      bytes     += loads[i].bytes;
+      n_layouts += loads[i].n_layouts;
+
+      mb_kbd_core_destroy(kb);
+    }
+
+  start = stub_now();
+
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n_loads; i++)
+      mb_kbd_core_destroy(bench_load(&loads[i]));
+
+  secs = stub_now() - start;
+
+  printf("%li rounds of %i loads, %lli bytes and %i layouts a round: "
+	 "%.3f s, %.2f MB/s, %.0f loads/s, %.0f layouts/s\n",
+	 rounds, n_loads, bytes, n_layouts, secs,
+	 rounds * bytes / secs / 1e6, rounds * n_loads / secs,
+	 rounds * n_layouts / secs);
+
+  bench_remove_tree(top);
+  mb_kbd_config_forget();
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stub-frontend.h"
+
+#include <errno.h>
+#include <sys/time.h>
+
+#include <X11/Xlib.h>
+
+struct MBKeyboardImage
+{
+  int dummy;
+};
+
+static void
+stub_text_extents (MBKeyboard *kbd, const char *str, int *width, int *height)
+{
+  *width  = 8 * util_utf8_char_cnt(str);
+  *height = 12;
+}
+
+static KeySym
+stub_lookup_keysym (MBKeyboard *kbd, const char *name)
+{
+  return XStringToKeysym(name);
+}
+
+static MBKeyboardImage*
+stub_image_new (MBKeyboard *kbd, const char *path)
+{
+  const unsigned char *data;
+  int                  size;
+
+  /* files on disk are not looked at, the layouts name installed ones */
+  if ((data = mb_kbd_embedded_file(path, &size)) != NULL
+      && (size < 8 || memcmp(data, "\211PNG\r\n\032\n", 8)))
+    return NULL;
+
+  return util_malloc0(sizeof(MBKeyboardImage));
+}
+
+static void
+stub_image_size (MBKeyboardImage *img, int *width, int *height)
+{
+  *width = *height = 16;
+}
+
+static void
+stub_image_destroy (MBKeyboardImage *img)
+{
+  free(img);
+}
+
+const MBKeyboardFrontend stub_frontend =
+{
+  stub_text_extents,
+  stub_lookup_keysym,
+  stub_image_new,
+  stub_image_size,
+  stub_image_destroy,
+  NULL, NULL, NULL,		/* send_* */
+  NULL, NULL, NULL,		/* redraw, redraw_key, layout_changed */
+  NULL				/* config_reloaded */
+};
+
+void
+stub_environment (const char *home)
+{
+  if (home)
+    setenv("HOME", home, 1);
+  else
+    unsetenv("HOME");
+
+  setenv("LANG", "C", 1);
+  setenv("MB_KBD_NO_COMPILED", "1", 1);
+  unsetenv("MB_KBD_CONFIG");
+  unsetenv("MB_KBD_LANG");
+}
+
+void
+stub_link (const char *path, const char *link)
+{
+  if (symlink(path, link) < 0)
+    {
+      fprintf(stderr, "cannot link %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+}
+
+double
+stub_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,42 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+#ifndef HAVE_STUB_FRONTEND_H
+#define HAVE_STUB_FRONTEND_H
+
+#include "matchbox-keyboard-core.h"
+
+/*
+ * A frontend with no display, shared by the tests, the benchmarks and the
+ * fuzzing harness. Labels measure a fixed 8 pixels a character by 12 and
+ * images 16x16, so layouts do not depend on the fonts installed. An image
+ * fails to load if it is built in, see mb_kbd_embedded_file(), but is not
+ * a PNG. It sends no key events and draws nothing; copy it and fill in
+ * what is needed.
+ */
+extern const MBKeyboardFrontend stub_frontend;
+
+/* only home/.matchbox is looked at, or no home at all for NULL */
+void
+stub_environment (const char *home);
+
+/* makes path available as link, or exits */
+void
+stub_link (const char *path, const char *link);
+
+/* wall clock seconds */
+double
+stub_now (void);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * test-config: loads configs written out into a scratch ~/.matchbox for the
+ * cases the bundled layouts never hit: files that change while, or after,
+ * they are loaded, with or without a compiled copy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stub-frontend.h"
+
+static char test_home[] = "/tmp/test-config-XXXXXX";
+static int  test_failures = 0;
+static int  test_reloads = 0;
+
+#define test_check(cond, what)					\
+  do {								\
+    if (!(cond))						\
+      {								\
+	fprintf(stderr, "%s:%i: %s\n", __FILE__, __LINE__, what);	\
+	test_failures++;					\
+      }								\
+  } while (0)
+
+/* writes contents to name in ~/.matchbox */
+static void
+test_write (const char *name, const char *contents)
+{
+  FILE *f;
+  char  path[1024];
+
+  snprintf(path, sizeof(path), "%s/.matchbox/%s", test_home, name);
+
+  if ((f = fopen(path, "w")) == NULL)
+    {
+      perror(path);
+      exit(1);
+    }
+
+  fputs(contents, f);
+  fclose(f);
+}
+
+static void
+test_remove (const char *name)
+{
+  char path[1024];
+
+  snprintf(path, sizeof(path), "%s/.matchbox/%s", test_home, name);
+  unlink(path);
+}
+
+/* the label of the first key of the selected layout */
+static const char*
+test_first_label (MBKeyboard *kb)
+{
+  List *rows = mb_kbd_layout_rows(mb_kbd_get_selected_layout(kb));
+
+  if (rows == NULL || mb_kdb_row_keys(rows->data) == NULL)
+    return "";
+
+  return mb_kbd_key_get_glyph_face(mb_kdb_row_keys(rows->data)->data,
+				   MBKeyboardKeyStateNormal);
+}
+
+static void
+test_config_reloaded (MBKeyboard *kbd, boolean relayout)
+{
+  test_reloads++;
+}
+
+static MBKeyboardImage*
+test_rewrite_image_new (MBKeyboard *kbd, const char *path)
+{
+  test_write("changing.xml",
+	     "<fragment><row><key><default display=\"changed\" /></key>"
+	     "</row></fragment>\n");
+
+  return stub_frontend.image_new(kbd, path);
+}
+
+/*
+ * A fragment that includes itself, and is edited while it is replayed:
+ * the nested include sees it changed and parses it again, which must not
+ * take the elements away from under the outer replay.
+ */
+static void
+test_fragment_changed_in_replay (void)
+{
+  MBKeyboardFrontend frontend = stub_frontend;
+  MBKeyboard        *kb;
+
+  test_write("keyboard.xml",
+	     "<keyboard><layout id=\"a\"><include file=\"changing\" />"
+	     "</layout></keyboard>\n");
+  test_write("changing.xml",
+	     "<fragment><row><key><default display=\"image:x.png\" /></key>"
+	     "</row><include file=\"changing\" /><row><key>"
+	     "<default display=\"after\" /></key></row></fragment>\n");
+
+  /* loading the image is when the fragment changes */
+  frontend.image_new = test_rewrite_image_new;
+
+  mb_kbd_config_forget();
+
+  kb = mb_kbd_core_new(&frontend, NULL);
+
+  test_check(mb_kbd_load(kb, NULL, NULL), "fragment changed in replay: load");
+  /* the old version's rows either side of the new one's */
+  test_check(util_list_length(mb_kbd_layout_rows(kb->layouts->data)) == 3,
+	     "fragment changed in replay: rows");
+
+  mb_kbd_core_destroy(kb);
+
+  test_remove("keyboard.xml");
+  test_remove("changing.xml");
+}
+
+/*
+ * With --watch, an include edited after the config was loaded from its
+ * compiled copy must still be noticed, and the config reloaded.
+ */
+static void
+test_watch_compiled_include (void)
+{
+#ifdef HAVE_INOTIFY
+  MBKeyboardFrontend frontend = stub_frontend;
+  MBKeyboard        *kb;
+  char              *compiled;
+
+  test_write("keyboard.xml",
+	     "<keyboard><layout id=\"a\"><include file=\"watched\" />"
+	     "</layout></keyboard>\n");
+  test_write("watched.xml",
+	     "<fragment><row><key><default display=\"a\" /></key>"
+	     "</row></fragment>\n");
+
+  unsetenv("MB_KBD_NO_COMPILED");
+  mb_kbd_config_forget();
+
+  /* what matchbox-keyboard-compile would write */
+  kb = mb_kbd_core_new(&stub_frontend, NULL);
+  test_check(mb_kbd_load(kb, NULL, NULL), "watch compiled: first load");
+  compiled = mb_kbd_config_compiled_path(kb->config_file);
+  test_check(mb_kbd_config_save_compiled(kb, compiled, NULL),
+	     "watch compiled: compile");
+  mb_kbd_core_destroy(kb);
+
+  mb_kbd_config_forget();
+
+  frontend.config_reloaded = test_config_reloaded;
+
+  kb = mb_kbd_core_new(&frontend, NULL);
+  test_check(mb_kbd_load(kb, NULL, NULL), "watch compiled: load");
+  test_check(util_list_length(kb->config_includes) == 1,
+	     "watch compiled: includes of the compiled copy");
+  test_check(mb_kbd_config_watch(kb), "watch compiled: watch");
+
+  /* a different size, so it is out of date within the same second too */
+  test_write("watched.xml",
+	     "<fragment><row><key><default display=\"edited\" /></key>"
+	     "</row></fragment>\n");
+
+  mb_kbd_config_watch_process(kb);
+
+  test_check(test_reloads == 1, "watch compiled: reloaded");
+  test_check(streq(test_first_label(kb), "edited"),
+	     "watch compiled: edited label");
+
+  mb_kbd_core_destroy(kb);
+
+  setenv("MB_KBD_NO_COMPILED", "1", 1);
+
+  unlink(compiled);
+  free(compiled);
+  test_remove("keyboard.xml");
+  test_remove("watched.xml");
+#endif
+}
+
+int
+main (int argc, char **argv)
+{
+  char dir[1024];
+
+  if (mkdtemp(test_home) == NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  snprintf(dir, sizeof(dir), "%s/.matchbox", test_home);
+  mkdir(dir, 0700);
+
+  stub_environment(test_home);
+
+  test_fragment_changed_in_replay();
+  test_watch_compiled_include();
+
+  rmdir(dir);
+  rmdir(test_home);
+
+  return test_failures ? 1 : 0;
+}
@@ -0,0 +1,368 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms and conditions of the GNU Lesser General Public License,
+ *  version 2.1, as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ *  more details.
+ *
+ */
+
+/*
+ * test-layout: lays out every layout of each layouts/keyboard*.xml, both
+ * key sets, the way the keyboard does at start up and then scaled to a few
+ * window sizes, and checks the key rectangles against test-layout.expected.
+ *
+ * It runs with the stub frontend, see stub-frontend.h, so the results do
+ * not depend on the fonts installed. With --generate the rectangles are
+ * written out instead, to make a new test-layout.expected when the layout
+ * code or the layouts change on purpose.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stub-frontend.h"
+
+#include <dirent.h>
+
+/* display sizes laid out for; the small one makes every key a filler */
+static const int test_displays[][2] = { { 800, 480 }, { 320, 240 } };
+
+/* window sizes scaled to */
+static const int test_sizes[][2] = { { 240, 100 }, { 640, 240 },
+				     { 1280, 400 } };
+
+static int test_failures = 0;
+
+/* writes out the rectangles of the selected layout, a row a line */
+static void
+test_dump (MBKeyboard *kb, FILE *out, const char *what)
+{
+  List *row_item, *key_item;
+
+  fprintf(out, "%s\n", what);
+
+  for (row_item = mb_kbd_layout_rows(mb_kbd_get_selected_layout(kb));
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    {
+      fprintf(out, " ");
+
+      mb_kbd_row_for_each_key(row_item->data, key_item)
+	{
+	  MBKeyboardKey *key = key_item->data;
+
+	  if (!mb_kbd_is_extended(kb) && mb_kbd_key_get_extended(key))
+	    continue;
+
+	  fprintf(out, " %i,%i,%i,%i",
+		  mb_kbd_key_abs_x(key), mb_kbd_key_abs_y(key),
+		  mb_kbd_key_width(key), mb_kbd_key_height(key));
+	}
+
+      fprintf(out, "\n");
+    }
+}
+
+/* keys in a row must not overlap, and all of them must be in the window */
+static void
+test_check_bounds (MBKeyboard *kb, const char *what, int width, int height)
+{
+  List *row_item, *key_item;
+
+  for (row_item = mb_kbd_layout_rows(mb_kbd_get_selected_layout(kb));
+       row_item != NULL;
+       row_item = util_list_next(row_item))
+    {
+      int right = 0;
+
+      mb_kbd_row_for_each_key(row_item->data, key_item)
+	{
+	  MBKeyboardKey *key = key_item->data;
+	  int            x, y, w, h;
+
+	  if (!mb_kbd_is_extended(kb) && mb_kbd_key_get_extended(key))
+	    continue;
+
+	  x = mb_kbd_key_abs_x(key);
+	  y = mb_kbd_key_abs_y(key);
+	  w = mb_kbd_key_width(key);
+	  h = mb_kbd_key_height(key);
+
+	  if (x < right || x < 0 || y < 0 || w <= 0 || h <= 0
+	      || x + w > width || y + h > height)
+	    {
+	      fprintf(stderr, "%s: key at %i,%i %ix%i out of place\n",
+		      what, x, y, w, h);
+	      test_failures++;
+	      return;
+	    }
+
+	  right = x + w;
+	}
+    }
+}
+
+static void
+test_layout_file (const char *layouts_dir,
+		  const char *name,
+		  const char *home,
+		  FILE       *out)
+{
+  MBKeyboard *kb;
+  List       *layout_item;
+  char        path[1024], link[1024];
+  int         set, d, s;
+
+  /* the layout stands in as ~/.matchbox/keyboard.xml */
+  snprintf(path, sizeof(path), "%s/%s", layouts_dir, name);
+  snprintf(link, sizeof(link), "%s/.matchbox/keyboard.xml", home);
+
+  unlink(link);
+  stub_link(path, link);
+
+  mb_kbd_config_forget();
+
+  kb = mb_kbd_core_new(&stub_frontend, NULL);
+
+  if (!mb_kbd_load(kb, NULL, NULL))
+    {
+      fprintf(stderr, "%s: failed to load\n", name);
+      test_failures++;
+      return;
+    }
+
+  for (layout_item = kb->layouts;
+       layout_item != NULL;
+       layout_item = util_list_next(layout_item))
+    {
+      mb_kbd_select_layout(kb, layout_item->data);
+
+      for (set = 0; set < 2; set++)
+	for (d = 0; d < sizeof(test_displays) / sizeof(test_displays[0]); d++)
+	  {
+	    char what[256];
+	    int  base_width, base_height;
+
+	    mb_kbd_set_extended(kb, set);
+
+	    mb_kbd_allocate_layout(kb,
+				   test_displays[d][0], test_displays[d][1],
+				   &base_width, &base_height);
+
+	    snprintf(what, sizeof(what), "%s %s %s %ix%i base %ix%i",
+		     name, mb_kbd_layout_id(layout_item->data),
+		     set ? "extended" : "compact",
+		     test_displays[d][0], test_displays[d][1],
+		     base_width, base_height);
+
+	    test_dump(kb, out, what);
+
+	    for (s = 0; s < sizeof(test_sizes) / sizeof(test_sizes[0]); s++)
+	      {
+		mb_kbd_scale_layout(kb, base_width, base_height,
+				    test_sizes[s][0], test_sizes[s][1]);
+
+		snprintf(what, sizeof(what), "%s %s %s %ix%i at %ix%i",
+			 name, mb_kbd_layout_id(layout_item->data),
+			 set ? "extended" : "compact",
+			 test_displays[d][0], test_displays[d][1],
+			 test_sizes[s][0], test_sizes[s][1]);
+
+		test_dump(kb, out, what);
+
+		test_check_bounds(kb, what,
+				  test_sizes[s][0], test_sizes[s][1]);
+	      }
+	  }
+    }
+
+  mb_kbd_core_destroy(kb);
+}
+
+/* a layout with no rows must scale without falling over */
+static void
+test_empty_layout (const char *home)
+{
+  MBKeyboard *kb;
+  FILE       *f;
+  char        path[1024];
+  int         width, height;
+
+  snprintf(path, sizeof(path), "%s/.matchbox/keyboard.xml", home);
+
+  unlink(path);
+
+  if ((f = fopen(path, "w")) == NULL)
+    {
+      perror(path);
+      exit(1);
+    }
+
+  fprintf(f, "<keyboard><layout id=\"empty\"></layout></keyboard>\n");
+  fclose(f);
+
+  mb_kbd_config_forget();
+
+  kb = mb_kbd_core_new(&stub_frontend, NULL);
+
+  if (!mb_kbd_load(kb, NULL, NULL))
+    {
+      fprintf(stderr, "empty layout: failed to load\n");
+      test_failures++;
+      return;
+    }
+
+  mb_kbd_allocate_layout(kb, 800, 480, &width, &height);
+  mb_kbd_scale_layout(kb, width, height, 640, 240);
+
+  mb_kbd_core_destroy(kb);
+}
+
+static int
+test_name_cmp (const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* first line where the two differ, or 0 */
+static int
+test_compare (FILE *a, FILE *b)
+{
+  char la[4096], lb[4096];
+  int  line = 0;
+
+  for (;;)
+    {
+      char *ra = fgets(la, sizeof(la), a);
+      char *rb = fgets(lb, sizeof(lb), b);
+
+      line++;
+
+      if (ra == NULL && rb == NULL)
+	return 0;
+
+      if (ra == NULL || rb == NULL || !streq(la, lb))
+	{
+	  fprintf(stderr, "line %i:\n  expected %s  got      %s",
+		  line, rb ? lb : "(end)\n", ra ? la : "(end)\n");
+	  return line;
+	}
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  const char    *layouts_dir = LAYOUTSDIR;
+  const char    *expected    = SRCDIR "/test-layout.expected";
+  char           home[] = "/tmp/test-layout-XXXXXX", dir[1024];
+  char         **names = NULL;
+  int            n_names = 0, i;
+  boolean        generate = False;
+  DIR           *d;
+  struct dirent *de;
+  FILE          *out, *want;
+
+  if (argc > 1 && streq(argv[1], "--generate"))
+    generate = True;
+
+  if (mkdtemp(home) == NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  snprintf(dir, sizeof(dir), "%s/.matchbox", home);
+  mkdir(dir, 0700);
+
+  /* only ~/.matchbox is looked at, includes and all */
+  stub_environment(home);
+
+  if ((d = opendir(layouts_dir)) == NULL)
+    {
+      perror(layouts_dir);
+      return 1;
+    }
+
+  while ((de = readdir(d)) != NULL)
+    {
+      int n = strlen(de->d_name);
+
+      if (n < 4 || !streq(de->d_name + n - 4, ".xml"))
+	continue;
+
+      if (!strncmp(de->d_name, "keyboard", 8))
+	{
+	  names = realloc(names, (n_names + 1) * sizeof(char *));
+	  names[n_names++] = strdup(de->d_name);
+	}
+      else
+	{
+	  /* fragments, for the includes */
+	  char path[1024], link[1024];
+
+	  snprintf(path, sizeof(path), "%s/%s", layouts_dir, de->d_name);
+	  snprintf(link, sizeof(link), "%s/%s", dir, de->d_name);
+	  stub_link(path, link);
+	}
+    }
+
+  closedir(d);
+
+  if (n_names == 0)
+    {
+      fprintf(stderr, "no layouts in %s\n", layouts_dir);
+      return 1;
+    }
+
+  qsort(names, n_names, sizeof(char *), test_name_cmp);
+
+  out = generate ? stdout : tmpfile();
+
+  for (i = 0; i < n_names; i++)
+    test_layout_file(layouts_dir, names[i], home, out);
+
+  test_empty_layout(home);
+
+  /* tidy up */
+  d = opendir(dir);
+  while ((de = readdir(d)) != NULL)
+    if (de->d_name[0] != '.')
+      {
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	unlink(path);
+      }
+  closedir(d);
+  rmdir(dir);
+  rmdir(home);
+
+  if (generate)
+    return test_failures ? 1 : 0;
+
+  if ((want = fopen(expected, "r")) == NULL)
+    {
+      perror(expected);
+      return 1;
+    }
+
+  rewind(out);
+
+  if (test_compare(out, want))
+    {
+      fprintf(stderr, "key rectangles differ from %s\n", expected);
+      test_failures++;
+    }
+
+  printf("%i layout files, %s\n", n_names, test_failures ? "FAIL" : "PASS");
+
+  return test_failures ? 1 : 0;
+}